@@ -98,7 +98,7 @@ function build_xdpsock_app()
 	build_cmd="${build_cmd} -Wall -g -O2 -DMAX_SOCKS=${MAX_SOCKS} ${FCQ_DEFINE}"
 	build_cmd="${build_cmd} -DXDPSOCK_KRNL=\"${krnlobj}\" ${DEBUG}"
 	build_cmd="${build_cmd} -o ${usrobj} ${usrsrc}"
-	build_cmd="${build_cmd} ${libxdp_static} ${libbpf_static} -lcap -pthread -lelf -lz"
+	build_cmd="${build_cmd} ${libxdp_static} ${libbpf_static} -lcap -pthread -lelf -lz -lm"
 
 	rm -f ${usrobj}
 	[ ! -f "${usrobj}" ] || fatal "Can't delete stale ${usrobj}"
@@ -6,7 +6,10 @@
 // SPDX-License-Identifier: GPL-2.0
 /* Copyright(c) 2017 - 2018 Intel Corporation. */
 
+#define _GNU_SOURCE /* CPU_SET(), sched_setaffinity() */
+#include <byteswap.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <linux/bpf.h>
@@ -15,27 +18,42 @@
 #include <linux/if_ether.h>
 #include <linux/ip.h>
 #include <linux/limits.h>
+#include <linux/perf_event.h>
 #include <linux/udp.h>
 #include <arpa/inet.h>
 #include <locale.h>
+#include <math.h>
 #include <net/ethernet.h>
 #include <netinet/ether.h>
 #include <net/if.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/capability.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
 #include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <sched.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <bpf/libbpf.h>
 #include <bpf/xsk.h>
@@ -82,6 +100,7 @@ static const char *xdpsock_krnl = "xdpsock_kern.bpf";
 #define VLAN_PRIO_MASK		0xe000 /* Priority Code Point */
 #define VLAN_PRIO_SHIFT		13
 #define VLAN_VID_MASK		0x0fff /* VLAN Identifier */
+#define VLAN_HLEN		4
 #define VLAN_VID__DEFAULT	1
 #define VLAN_PRI__DEFAULT	0
 
@@ -90,11 +109,85 @@ static const char *xdpsock_krnl = "xdpsock_kern.bpf";
 
 #define SCHED_PRI__DEFAULT	0
 
+#define LAT_SLOTS		65536 /* Probe send times kept, indexed by seq */
+#define LAT_TIMEOUT_NS		NSEC_PER_SEC /* Ping-pong probe given up after */
+
+#define RXCHECK_STREAMS		256 /* Tracked pktgen streams per socket */
+#define RXCHECK_WINDOW		64  /* Sequence numbers remembered per stream */
+
+#define SIZE_LIST_MAX		16 /* Entries in a --tx-size-profile list */
+#define SIZE_BUCKETS		7  /* Achieved TX size classes, see size_buckets */
+
+#define BATCH_AUTO_WINDOW	64 /* Polls per batch controller step */
+#define BATCH_AUTO_INC		8  /* Additive increase step */
+
+#define RFC2544_RESOLUTION	0.005 /* Search stops at this fraction of the rate */
+#define RFC2544_MAX_TRIALS	20
+#define RFC2544_DRAIN_NS	(200 * 1000 * 1000UL) /* RX only tail of a trial */
+
+#define RATE_SPIN_NS		50000 /* Pacing spins instead of sleeping below this */
+
+#define L3FWD_BATCH		256 /* RX descriptors routed per l3fwd() call */
+#define L3_NH_MAX		1024 /* Neighbour table entries */
+#define L3_NH_NONE		0x7fff
+#define L3_TBL8_FLAG		0x8000
+#define L3_TBL8_GROUPS		0x8000
+#define L3_TRIE_CHILD		0x80000000U
+
 typedef __u64 u64;
 typedef __u32 u32;
 typedef __u16 u16;
 typedef __u8  u8;
 
+enum encap_type {
+	ENCAP_NONE = 0,
+	ENCAP_VXLAN,
+	ENCAP_GRE,
+	ENCAP_GTPU,
+};
+
+enum flow_dist {
+	FLOW_DIST_RR = 0,
+	FLOW_DIST_UNIFORM = 1,
+	FLOW_DIST_ZIPF = 2,
+};
+
+static enum flow_dist opt_flow_dist = FLOW_DIST_RR;
+
+enum size_profile {
+	SIZE_PROFILE_FIXED = 0,
+	SIZE_PROFILE_IMIX = 1,
+	SIZE_PROFILE_LIST = 2,
+	SIZE_PROFILE_RANGE = 3,
+};
+
+static enum size_profile opt_size_profile = SIZE_PROFILE_FIXED;
+static struct size_weight {
+	u16 size;
+	u32 weight;
+} opt_sizes[SIZE_LIST_MAX];
+static int opt_num_sizes;
+static u16 opt_size_range[2];
+static const char *opt_replay;
+static const char *opt_template;
+static double opt_replay_speed;
+static const char *opt_capture;
+static u32 opt_snaplen = 65535;
+static u32 opt_sample = 1;
+static bool opt_capture_pcapng;
+static const char *opt_routes;
+static const char *opt_neigh;
+static struct rate_spec {
+	double rate;	/**< Packets or bits per second */
+	bool bps;
+} opt_rates[MAX_SOCKS];
+static int opt_num_rates;
+static u32 opt_rate_burst;
+static u16 opt_rfc2544_sizes[SIZE_LIST_MAX] = { 64, 128, 256, 512, 1024, 1280, 1518 };
+static int opt_rfc2544_num_sizes = 7;
+static u32 opt_trial_time = 5;
+static double opt_loss_tolerance;
+
 static unsigned long prev_time;
 static long tx_cycle_diff_min;
 static long tx_cycle_diff_max;
@@ -105,9 +198,41 @@ enum benchmark_type {
 	BENCH_RXDROP = 0,
 	BENCH_TXONLY = 1,
 	BENCH_L2FWD = 2,
+	BENCH_LATENCY = 3,
+	BENCH_L3FWD = 4,
+	BENCH_RFC2544 = 5,
 };
 
 static enum benchmark_type opt_bench = BENCH_RXDROP;
+static bool opt_testbed;
+static bool opt_reflect;
+static bool opt_csum_bench;
+static bool opt_batch_hist;
+static bool opt_perf_counters;
+static bool opt_util;
+static enum {
+	STATS_TEXT,
+	STATS_JSON,
+	STATS_CSV,
+} opt_stats_format;
+static const char *opt_csum_kernel;
+static enum {
+	BURST_OFF,
+	BURST_FIXED,
+	BURST_UNIFORM,
+	BURST_EXP,
+} opt_burst;
+static u32 opt_burst_size[2];	/**< Fixed size, uniform bounds, or exp mean */
+static u32 opt_burst_idle_us = 1000;
+static bool opt_burst_sync;
+static u32 opt_burst_detect_us;
+static char *opt_sweep;
+static bool opt_sweep_json;
+static u32 opt_warmup;
+static int opt_result_fd = -1;
+static const char *opt_metrics;
+static u16 opt_metrics_port;
+static enum benchmark_type opt_testbed_mode = BENCH_RXDROP;
 static u32 opt_xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST;
 static const char *opt_if = "";
 static int opt_ifindex;
@@ -116,6 +241,9 @@ static unsigned long opt_duration;
 static unsigned long start_time;
 static bool benchmark_done;
 static u32 opt_batch_size = 64;
+static bool opt_batch_auto;
+static u32 opt_batch_min;
+static u32 opt_batch_max;
 static int opt_pkt_count;
 static u16 opt_pkt_size = MIN_PKT_SIZE;
 static u32 opt_pkt_fill_pattern = 0x12345678;
@@ -146,12 +274,25 @@ static bool opt_need_wakeup = true;
 static u32 opt_num_xsks = 1;
 static u32 prog_id;
 static bool opt_busy_poll;
+static int opt_napi_cpu;
 static bool opt_reduced_cap;
 static clockid_t opt_clock = CLOCK_MONOTONIC;
 static unsigned long opt_tx_cycle_ns;
 static int opt_schpolicy = SCHED_OTHER;
 static int opt_schprio = SCHED_PRI__DEFAULT;
 static bool opt_tstamp;
+static unsigned long opt_lat_rate;
+static bool opt_rxcheck;
+static u32 opt_flow_count = 1;
+static u32 opt_flow_sip[2] = { 0x0a0a0a10, 0x0a0a0a10 };
+static u32 opt_flow_dip[2] = { 0x0a0a0a20, 0x0a0a0a20 };
+static u16 opt_flow_sport[2] = { 0x1000, 0x1000 };
+static u16 opt_flow_dport[2] = { 0x1000, 0x1000 };
+static double opt_flow_zipf_s = 1.0;
+static enum encap_type opt_encap;
+static u32 opt_encap_sip = 0x0a0a1410;
+static u32 opt_encap_dip = 0x0a0a1420;
+static u32 opt_tunnel_id = 1;
 
 struct vlan_ethhdr {
 	unsigned char h_dest[6];
@@ -169,9 +310,53 @@ struct pktgen_hdr {
 	__be32 tv_usec;
 };
 
+/* Classic libpcap file format, see pcap-savefile(5). */
+#define PCAP_MAGIC_USEC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET	1
+
+struct pcap_file_hdr {
+	u32 magic;
+	u16 version_major;
+	u16 version_minor;
+	int32_t thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 linktype;
+};
+
+struct pcap_rec_hdr {
+	u32 ts_sec;
+	u32 ts_frac; /**< usec or nsec, depending on the file magic */
+	u32 caplen;
+	u32 len;
+};
+
+/* pcapng blocks written by --capture-format=pcapng, see RFC draft
+ * draft-ietf-opsawg-pcapng.
+ */
+#define PCAPNG_SHB		0x0a0d0d0a
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER	0x1a2b3c4d
+#define PCAPNG_OPT_TSRESOL	9
+
+struct pcapng_epb {
+	u32 type;
+	u32 total_len;
+	u32 if_id;
+	u32 ts_high;
+	u32 ts_low;
+	u32 caplen;
+	u32 len;
+};
+
 struct xsk_ring_stats {
 	unsigned long rx_npkts;
 	unsigned long tx_npkts;
+	unsigned long rx_bytes;
+	unsigned long tx_bytes;
+	unsigned long tx_size_npkts[SIZE_BUCKETS];
 	unsigned long rx_dropped_npkts;
 	unsigned long rx_invalid_npkts;
 	unsigned long tx_invalid_npkts;
@@ -180,6 +365,8 @@ struct xsk_ring_stats {
 	unsigned long tx_empty_npkts;
 	unsigned long prev_rx_npkts;
 	unsigned long prev_tx_npkts;
+	unsigned long prev_rx_bytes;
+	unsigned long prev_tx_bytes;
 	unsigned long prev_rx_dropped_npkts;
 	unsigned long prev_rx_invalid_npkts;
 	unsigned long prev_tx_invalid_npkts;
@@ -206,6 +393,254 @@ struct xsk_app_stats {
 	unsigned long prev_opt_polls;
 };
 
+/* Log-linear histogram in the HdrHistogram style. Values below
+ * 2^HIST_SUB_BITS land in exact buckets, above that every power of two is
+ * split into 2^HIST_SUB_BITS linear sub-buckets, so the relative error is
+ * bounded (~3%) over the whole u64 range with a fixed 15KB table. Recording
+ * never allocates or locks; readers in the poller just see a slightly stale
+ * copy.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct hist {
+	unsigned long count[HIST_BUCKETS];
+	unsigned long total;
+	u64 max;
+};
+
+/* Ping-pong probe state and RTT histogram for --latency. */
+struct xsk_latency_stats {
+	unsigned long probes;
+	unsigned long replies;
+	unsigned long unmatched; /**< Probe replies we had no send time for */
+	unsigned long rx_other;	 /**< Received frames that were not probes */
+	unsigned long lost;	 /**< Unanswered after LAT_TIMEOUT_NS, see lat_expire() */
+	unsigned long next_ns;	 /**< Next probe due (or ping-pong timeout) */
+	u32 inflight;
+	u32 last_seq;		 /**< Of the ping-pong probe in flight */
+	u32 frame_nb;
+	struct hist rtt;
+};
+
+/* A pktgen stream, i.e. one UDP 4-tuple. The window has bit n set if
+ * sequence number (next_seq - 1 - n) has been seen.
+ */
+struct rxcheck_stream {
+	u32 saddr;
+	u32 daddr;
+	u16 sport;
+	u16 dport;
+	bool used;
+	u32 first_seq;
+	u32 next_seq;
+	u64 window;
+};
+
+/* --burst on TX, and on RX the bursts --burst-detect delimits by idle gaps,
+ * each charged with the ring drops the kernel counted while it lasted.
+ */
+struct xsk_burst_stats {
+	unsigned long bursts;
+	unsigned long pkts;
+	u32 max;
+	u32 cur;		/**< RX: packets of the burst in progress */
+	unsigned long last_rx;
+	unsigned long lossy;	/**< RX: bursts with ring full or fill empty drops */
+	u32 max_clean;		/**< RX: largest burst without drops */
+	u32 min_lossy;		/**< RX: smallest burst with drops */
+	unsigned long rx_full;
+	unsigned long fill_empty;
+	u64 max_full;		/**< RX: worst ring full count in one burst */
+	u64 prev_full;
+	u64 prev_fill_empty;
+};
+
+/* --perf-counters: the hardware events the worker spent on this socket,
+ * see perf_charge().
+ */
+#define PERF_EVENTS	5
+
+struct xsk_perf_stats {
+	u64 val[PERF_EVENTS];
+	u64 prev[PERF_EVENTS];
+	unsigned long prev_pkts;
+};
+
+/* --util: worker TSC ticks spent on this socket, by what they went to. */
+enum {
+	UTIL_BUSY,	/**< Moving packets */
+	UTIL_EMPTY,	/**< Polling a ring that had nothing */
+	UTIL_SYSCALL,	/**< recvfrom()/sendto() wakeups */
+	UTIL_STALL,	/**< Waiting for fill, TX or completion ring space */
+	UTIL_IDLE,	/**< Blocked in the -p poll() */
+	UTIL_STATES
+};
+
+struct xsk_util_stats {
+	u64 ticks[UTIL_STATES];
+	u64 prev[UTIL_STATES];
+	double pct[UTIL_STATES]; /**< Share of the last interval */
+};
+
+/* --rxcheck verification of received pktgen headers. lost counts sequence
+ * gaps not (yet) filled by a late arrival, late counts arrivals too far
+ * behind to tell a reorder from a duplicate.
+ */
+struct xsk_rxcheck_stats {
+	unsigned long pkts;
+	unsigned long other;
+	unsigned long lost;
+	unsigned long dups;
+	unsigned long reordered;
+	unsigned long late;
+	unsigned long streams;
+	unsigned long untracked;
+	struct hist owd; /**< One-way latency in ns, needs a shared clock */
+	struct rxcheck_stream stream[RXCHECK_STREAMS];
+};
+
+/* --l3fwd verdicts of the packets received on this socket. */
+struct xsk_l3fwd_stats {
+	unsigned long fwd;
+	unsigned long no_route;
+	unsigned long ttl_exceeded;
+	unsigned long other;	/**< Not IPv4/IPv6, or truncated */
+};
+
+/* Header offsets of a TX template, for named fields and for the checksums a
+ * field write has to patch. Zero offsets mean absent.
+ */
+struct pkt_layout {
+	u16 vlan;	/**< TCI of the outer tag */
+	u16 l3;
+	u16 l3_end;	/**< End of the IPv4 header, options included */
+	u16 l4;		/**< UDP/TCP header */
+	u16 ip_csum;
+	u16 l4_csum;
+	u16 pseudo[2];	/**< Address bytes the L4 pseudo-header covers */
+	bool ipv6;
+	bool udp;
+};
+
+#define MUTATORS_MAX		8
+#define MUTATOR_LIST_MAX	32
+
+enum mutator_field {
+	MUT_FIELD_RAW,
+	MUT_FIELD_SIP,
+	MUT_FIELD_DIP,
+	MUT_FIELD_SPORT,
+	MUT_FIELD_DPORT,
+	MUT_FIELD_VLAN,
+	MUT_FIELD_PCP,
+	MUT_FIELD_DSCP,
+	MUT_FIELD_TTL,
+	MUT_FIELD_IPID,
+	MUT_FIELD_NUM,
+};
+
+/* --mutate: one header field rewritten per transmitted frame. The field is
+ * the bits of mask within width bytes at off, big endian.
+ */
+struct tx_mutator {
+	enum mutator_field field;
+	u16 off;
+	u8 width;
+	u8 shift;
+	u32 mask;
+	enum { MUT_INC, MUT_RAND, MUT_LIST } kind;
+	u32 min;
+	u32 max;
+	u32 step;
+	u32 list[MUTATOR_LIST_MAX];
+	u32 nlist;
+};
+
+/* One generated UDP flow. Addresses and ports in host order, seq is the next
+ * pktgen sequence number of this flow (so --rxcheck sees per-flow streams).
+ */
+struct tx_flow {
+	u32 saddr;
+	u32 daddr;
+	u16 sport;
+	u16 dport;
+	u32 seq;
+};
+
+/* --rate token bucket of one socket. Tokens are packets, or frame bytes
+ * (FCS included) for a bps rate.
+ */
+struct xsk_rate {
+	bool bps;
+	double per_tick;	/**< Tokens added per TSC tick */
+	double tokens;
+	double burst;
+	u64 last;		/**< TSC of the last refill */
+	u64 prev_depart;	/**< TSC of the last batch posted */
+	double ideal_gap;	/**< Ticks that batch is worth at the rate */
+	struct hist jitter;	/**< |inter-departure - ideal| in ns */
+	unsigned long pkts;
+	unsigned long bytes;
+	unsigned long prev_pkts;
+	unsigned long prev_bytes;
+};
+
+/* --replay state of one socket, which gets the pcap packets hashing to it. */
+struct xsk_replay {
+	u32 *pkts;	/**< Indices into replay_pkts[], in file order */
+	u32 npkts;
+	u32 pos;
+	unsigned long loops;
+	bool preloaded;	/**< Every packet has its own frame, nothing to copy */
+	u64 base;	/**< First frame address of our TX area */
+	u32 nframes;
+	u32 frame_nb;
+};
+
+/* --capture writer of one socket. The RX loop appends records to a ring of
+ * staging buffers and a writer thread flushes each full buffer with one large
+ * O_DIRECT write, so the RX ring never waits on the disk.
+ */
+#define CAPTURE_BUFS		8
+#define CAPTURE_BUF_SIZE	(1 << 20)
+#define CAPTURE_ALIGN		4096
+
+struct xsk_capture {
+	int fd;
+	u8 *bufs[CAPTURE_BUFS];
+	u32 fill;		/**< Bytes used in the buffer being filled */
+	unsigned long filled;	/**< Buffers handed to the writer */
+	unsigned long written;	/**< Buffers the writer is done with */
+	bool stop;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long seen;
+	unsigned long pkts;
+	unsigned long bytes;
+	unsigned long drops;	/**< Records lost because every buffer was in flight */
+	unsigned long write_errors;
+	unsigned long prev_pkts;
+	unsigned long prev_drops;
+};
+
+/* Per-socket batch size controller, see batch_tune(). When autotuning is
+ * off, size simply holds opt_batch_size. The worker folds each new size into
+ * lo/hi atomically and the poller swaps them out at every dump.
+ */
+struct xsk_batch_ctl {
+	u32 size;
+	u32 polls;
+	u32 empty_polls;
+	u32 used;
+	u32 lo; /**< Smallest size set since the last stats dump */
+	u32 hi; /**< Largest size set since the last stats dump */
+	u32 dump_size; /**< Size at the last stats dump, poller only */
+	unsigned long adjusts;
+};
+
 struct xsk_umem_info {
 	struct xsk_ring_prod fq;
 	struct xsk_ring_cons cq;
@@ -233,6 +668,20 @@ struct xsk_socket_info {
 	struct xsk_ring_stats ring_stats;
 	struct xsk_app_stats app_stats;
 	struct xsk_driver_stats drv_stats;
+	struct xsk_batch_ctl batch;
+	struct xsk_latency_stats lat;
+	struct xsk_rxcheck_stats rxcheck;
+	struct xsk_replay replay;
+	struct xsk_rate rate;
+	struct xsk_burst_stats burst;
+	struct xsk_perf_stats perf;
+	struct xsk_util_stats util;
+	struct hist batch_tsc;	/**< --batch-hist, TSC ticks per batch */
+	struct hist batch_prev;	/**< batch_tsc at the previous interval */
+	struct xsk_l3fwd_stats l3fwd;
+	struct xsk_capture *cap;
+	struct xdp_desc *tx_img; /**< txonly descriptors, see tx_image_bake() */
+	u32 tx_img_frames;
 	u32 outstanding_tx;
 };
 
@@ -256,8 +705,54 @@ static const struct sched_map {
 	{ NULL }
 };
 
+/* Busy-poll profiles. The socket options apply per XSK, the NAPI knobs live
+ * in /sys/class/net/<if>/ and so apply to the whole device.
+ */
+static const struct busy_poll_profile {
+	const char *name;
+	int busy_poll_us;	/* SO_BUSY_POLL */
+	int budget;		/* SO_BUSY_POLL_BUDGET, 0 = batch size */
+	int defer_hard_irqs;	/* napi_defer_hard_irqs, -1 = leave alone */
+	long gro_flush_timeout;	/* gro_flush_timeout in ns, -1 = leave alone */
+	bool threaded;		/* Threaded NAPI, kthreads pinned from --napi-cpu */
+} bp_profiles[] = {
+	{ "default",	20,	0,	-1,	-1,		false },
+	{ "latency",	10,	8,	2,	20000,		false },
+	{ "balanced",	20,	0,	2,	200000,		false },
+	{ "throughput",	50,	256,	10,	1000000,	true },
+	{ NULL }
+};
+
+static const struct busy_poll_profile *opt_bp_profiles[MAX_SOCKS];
+static int opt_bp_num_profiles;
+
 static int num_socks = 0;
 struct xsk_socket_info *xsks[MAX_SOCKS];
+
+static struct tx_flow *tx_flows;
+static struct tx_mutator opt_mutators[MUTATORS_MAX];
+static int opt_num_mutators;
+static struct pkt_layout tx_layout;
+static u8 *tmpl_data;
+static u32 tmpl_len;
+static u64 tx_mut_seq;
+static u32 tx_frame_flow[NUM_FRAMES]; /**< Flow baked into each TX frame */
+static u16 tx_frame_size[NUM_FRAMES]; /**< Frame size incl. FCS, like -s */
+static u8 tx_frame_bucket[NUM_FRAMES]; /**< size_buckets[] index of the above */
+
+/* RFC 2819 etherStatsPkts size classes */
+static const struct size_bucket {
+	const char *name;
+	u32 max;
+} size_buckets[SIZE_BUCKETS] = {
+	{ "64", 64 },
+	{ "65-127", 127 },
+	{ "128-255", 255 },
+	{ "256-511", 511 },
+	{ "512-1023", 1023 },
+	{ "1024-1518", 1518 },
+	{ "1519+", ~0U },
+};
 int sock;
 
 static int get_clockid(clockid_t *id, const char *name)
@@ -288,6 +783,30 @@ static int get_schpolicy(int *policy, const char *name)
 	return -1;
 }
 
+static const struct busy_poll_profile *get_bp_profile(const char *name)
+{
+	const struct busy_poll_profile *prof;
+
+	for (prof = bp_profiles; prof->name; prof++) {
+		if (strcasecmp(prof->name, name) == 0)
+			return prof;
+	}
+
+	return NULL;
+}
+
+/* Profile for a given XSK. The last profile on the command line covers any
+ * sockets beyond the end of the list.
+ */
+static const struct busy_poll_profile *bp_profile_of(int xsk_index)
+{
+	if (!opt_bp_num_profiles)
+		return &bp_profiles[0];
+	if (xsk_index >= opt_bp_num_profiles)
+		xsk_index = opt_bp_num_profiles - 1;
+	return opt_bp_profiles[xsk_index];
+}
+
 static unsigned long get_nsecs(void)
 {
 	struct timespec ts;
@@ -296,18 +815,381 @@ static unsigned long get_nsecs(void)
 	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
-static void print_benchmark(struct xsk_socket_info *xsk, bool running)
+/* Cycle counter for pacing: the TSC on x86, calibrated against
+ * CLOCK_MONOTONIC_RAW by tsc_calibrate(), and the monotonic clock in
+ * nanoseconds elsewhere.
+ */
+static u64 tsc_hz = NSEC_PER_SEC;
+
+static inline u64 tsc_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline u64 tsc_to_ns(u64 ticks)
+{
+	return (double)ticks * NSEC_PER_SEC / tsc_hz;
+}
+
+static void tsc_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec t0, t1, wait = { 0, 50 * 1000 * 1000 };
+	u64 c0, c1;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	c0 = tsc_now();
+	nanosleep(&wait, NULL);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	c1 = tsc_now();
+
+	tsc_hz = (double)(c1 - c0) * NSEC_PER_SEC /
+		 ((t1.tv_sec - t0.tv_sec) * NSEC_PER_SEC + t1.tv_nsec - t0.tv_nsec);
+#endif
+}
+
+static inline u32 hist_index(u64 v)
+{
+	int shift;
+
+	if (v < HIST_SUB_COUNT)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return shift * HIST_SUB_COUNT + (v >> shift);
+}
+
+/* Highest value that maps to bucket idx. */
+static inline u64 hist_value(u32 idx)
+{
+	int shift;
+
+	if (idx < 2 * HIST_SUB_COUNT)
+		return idx;
+
+	shift = idx / HIST_SUB_COUNT - 1;
+	return (((u64)(idx % HIST_SUB_COUNT + HIST_SUB_COUNT) + 1) << shift) - 1;
+}
+
+static inline void hist_record(struct hist *h, u64 v)
+{
+	h->count[hist_index(v)]++;
+	h->total++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Smallest recorded value (to bucket precision) that at least pct percent of
+ * samples are less than or equal to.
+ */
+static u64 hist_percentile(const struct hist *h, double pct)
+{
+	unsigned long target, seen = 0;
+	u32 i;
+
+	if (!h->total)
+		return 0;
+
+	target = (unsigned long)(h->total * pct / 100.0 + 0.5);
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= target)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+
+	return h->max;
+}
+
+/* --batch-hist: TSC ticks from a batch being found to it being handed back,
+ * kept per socket by its worker. The poller only reads them.
+ */
+static inline u64 batch_time_start(void)
+{
+	return opt_batch_hist ? tsc_now() : 0;
+}
+
+static inline void batch_time_end(struct xsk_socket_info *xsk, u64 start)
+{
+	if (opt_batch_hist)
+		hist_record(&xsk->batch_tsc, tsc_now() - start);
+}
+
+/* The batches of the last interval: the difference of the worker's running
+ * histogram to the previous snapshot, its max being the top bucket hit.
+ */
+static void batch_hist_interval(struct xsk_socket_info *xsk, struct hist *iv)
+{
+	static struct hist snap;
+	u32 b;
+
+	memcpy(&snap, &xsk->batch_tsc, sizeof(snap));
+	memset(iv, 0, sizeof(*iv));
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		iv->count[b] = snap.count[b] - xsk->batch_prev.count[b];
+		iv->total += iv->count[b];
+		if (iv->count[b])
+			iv->max = hist_value(b) < snap.max ? hist_value(b) : snap.max;
+	}
+	memcpy(&xsk->batch_prev, &snap, sizeof(snap));
+}
+
+/* --perf-counters. One event group per worker thread, counting user and
+ * kernel time so the wakeup syscalls are included. The worker reads it
+ * between sockets and charges each socket the difference, with rdpmc from
+ * the mmap()ed pages when the kernel allows it and a group read() when not.
+ */
+static const struct perf_counter {
+	const char *name;
+	u32 type;
+	u64 config;
+} perf_counters[PERF_EVENTS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "LLC misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+	  PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+	{ "dTLB misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+	  PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+	{ "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int perf_fds[PERF_EVENTS];
+static struct perf_event_mmap_page *perf_pages[PERF_EVENTS];
+static bool perf_rdpmc;
+static u64 perf_last[PERF_EVENTS];
+
+/* With more events than PMCs the kernel multiplexes them, and an event only
+ * counts while it is on a PMC. Extrapolate its count to the time it was
+ * enabled, as perf stat does.
+ */
+static inline u64 perf_scale(u64 count, u64 enabled, u64 running)
+{
+	if (!running || running >= enabled)
+		return count;
+	return (u64)((double)count * enabled / running);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The self-monitoring read from the perf_event_mmap_page comment: the
+ * running count is offset plus the sign-extended PMC, retried if the event
+ * was rescheduled meanwhile. An event not on a PMC right now has its whole
+ * count in offset. The enabled and running times are brought up to now from
+ * the TSC the same way.
+ */
+static inline u64 perf_rdpmc_read(struct perf_event_mmap_page *pc)
+{
+	u64 count, enabled, running, cyc, quot, rem, delta;
+	u32 seq, idx;
+	__s64 pmc;
+
+	do {
+		seq = pc->lock;
+		__sync_synchronize();
+		idx = pc->index;
+		count = pc->offset;
+		enabled = pc->time_enabled;
+		running = pc->time_running;
+		if (pc->cap_user_time && enabled != running) {
+			cyc = __builtin_ia32_rdtsc();
+			quot = cyc >> pc->time_shift;
+			rem = cyc & (((u64)1 << pc->time_shift) - 1);
+			delta = pc->time_offset + quot * pc->time_mult +
+				((rem * pc->time_mult) >> pc->time_shift);
+			enabled += delta;
+			if (idx)
+				running += delta;
+		}
+		if (pc->cap_user_rdpmc && idx) {
+			pmc = __builtin_ia32_rdpmc(idx - 1);
+			pmc <<= 64 - pc->pmc_width;
+			pmc >>= 64 - pc->pmc_width;
+			count += pmc;
+		}
+		__sync_synchronize();
+	} while (pc->lock != seq);
+
+	return perf_scale(count, enabled, running);
+}
+#endif
+
+static inline void perf_read(u64 *val)
+{
+	struct {
+		u64 nr;
+		u64 time_enabled;
+		u64 time_running;
+		u64 values[PERF_EVENTS];
+	} group;
+	int k;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (perf_rdpmc) {
+		for (k = 0; k < PERF_EVENTS; k++)
+			val[k] = perf_rdpmc_read(perf_pages[k]);
+		return;
+	}
+#endif
+	if (read(perf_fds[0], &group, sizeof(group)) != sizeof(group))
+		return;
+	for (k = 0; k < PERF_EVENTS; k++)
+		val[k] = perf_scale(group.values[k], group.time_enabled, group.time_running);
+}
+
+/* Start of a pass over the sockets or a poll(): what comes before is not
+ * charged.
+ */
+static inline void perf_mark(void)
+{
+	if (opt_perf_counters)
+		perf_read(perf_last);
+}
+
+static inline void perf_charge(struct xsk_socket_info *xsk)
+{
+	u64 now[PERF_EVENTS];
+	int k;
+
+	if (!opt_perf_counters)
+		return;
+
+	perf_read(now);
+	for (k = 0; k < PERF_EVENTS; k++) {
+		xsk->perf.val[k] += now[k] - perf_last[k];
+		perf_last[k] = now[k];
+	}
+}
+
+/* The -p poll() serves all sockets, its events are split evenly among them. */
+static inline void perf_poll_end(void)
+{
+	u64 now[PERF_EVENTS], share;
+	int i, k;
+
+	if (!opt_perf_counters)
+		return;
+
+	perf_read(now);
+	for (k = 0; k < PERF_EVENTS; k++) {
+		share = (now[k] - perf_last[k]) / num_socks;
+		for (i = 0; i < num_socks; i++)
+			xsks[i]->perf.val[k] += share;
+		perf_last[k] = now[k];
+	}
+}
+
+/* --util. The worker adds up a socket's turn here by category, each call
+ * charging the ticks since the previous one, and util_turn_end() hands the
+ * turn to the socket. A syscall inside a stall loop counts as a syscall, the
+ * rest of the loop as the stall. Time outside the turns, such as --rate
+ * sleeps, is not charged at all.
+ */
+static u64 util_last;
+static u64 util_acc[UTIL_STATES];
+static int util_cat = UTIL_BUSY; /**< What the ticks between syscalls go to */
+
+static inline void util_charge(int what)
 {
-	const char *bench_str = "INVALID";
+	u64 now;
 
+	if (!opt_util)
+		return;
+
+	now = tsc_now();
+	util_acc[what] += now - util_last;
+	util_last = now;
+}
+
+/* Start of a turn or a poll(): what came before is not charged. */
+static inline void util_mark(void)
+{
+	if (opt_util)
+		util_last = tsc_now();
+}
+
+static inline void util_stall_begin(void)
+{
+	if (opt_util && util_cat != UTIL_STALL) {
+		util_charge(UTIL_BUSY);
+		util_cat = UTIL_STALL;
+	}
+}
+
+static inline void util_stall_end(void)
+{
+	if (opt_util && util_cat == UTIL_STALL) {
+		util_charge(UTIL_STALL);
+		util_cat = UTIL_BUSY;
+	}
+}
+
+static inline void util_turn_end(struct xsk_socket_info *xsk)
+{
+	int k;
+
+	if (!opt_util)
+		return;
+
+	util_charge(util_cat);
+	util_cat = UTIL_BUSY;
+	for (k = 0; k < UTIL_STATES; k++) {
+		xsk->util.ticks[k] += util_acc[k];
+		util_acc[k] = 0;
+	}
+}
+
+/* poll() waits on all sockets, so each gets an even share of it, as idle. */
+static inline void util_poll_end(void)
+{
+	u64 now, share;
+	int i;
+
+	if (!opt_util)
+		return;
+
+	now = tsc_now();
+	share = (now - util_last) / num_socks;
+	for (i = 0; i < num_socks; i++)
+		xsks[i]->util.ticks[UTIL_IDLE] += share;
+	util_last = now;
+}
+
+static const char *bench_name(void)
+{
 	if (opt_bench == BENCH_RXDROP)
-		bench_str = "rxdrop";
+		return "rxdrop";
 	else if (opt_bench == BENCH_TXONLY)
-		bench_str = "txonly";
+		return "txonly";
 	else if (opt_bench == BENCH_L2FWD)
-		bench_str = "l2fwd";
+		return opt_reflect ? "reflect" : "l2fwd";
+	else if (opt_bench == BENCH_LATENCY)
+		return "latency";
+	else if (opt_bench == BENCH_L3FWD)
+		return "l3fwd";
+	else if (opt_bench == BENCH_RFC2544)
+		return "rfc2544";
+
+	return "INVALID";
+}
 
-	printf("%s:%u %s ", opt_if, xsk->channel_id, bench_str);
+static void print_benchmark(struct xsk_socket_info *xsk, bool running)
+{
+	printf("%s:%u %s ", opt_if, xsk->channel_id, bench_name());
 	if (opt_xdp_flags & XDP_FLAGS_SKB_MODE)
 		printf("xdp-skb ");
 	else if (opt_xdp_flags & XDP_FLAGS_DRV_MODE)
@@ -449,14 +1331,15 @@ static int get_irqs(void)
 		printf("Error reading from %s\n", count_path);
 	} else {
 		static const char com[2] = ",";
-		char *token;
+		char *token, *save;
 
+		/* The --metrics thread reads this too, so no strtok() */
 		total_intrs = 0;
-		token = strtok(line, com);
+		token = strtok_r(line, com, &save);
 		while (token != NULL) {
 			/* sum up interrupts across all cores */
 			total_intrs += atoi(token);
-			token = strtok(NULL, com);
+			token = strtok_r(NULL, com, &save);
 		}
 	}
 
@@ -490,41 +1373,473 @@ static void dump_driver_stats(long dt)
 	}
 }
 
-static void dump_stats(void)
+/* Result lines for a --sweep parent: per-interval rates once warmed up,
+ * and the kernel's drop counters when done.
+ */
+static void result_sample(unsigned long now, double rx_pps, double tx_pps)
 {
-	unsigned long now = get_nsecs();
-	long dt = now - prev_time;
+	if (opt_result_fd >= 0 && now - start_time >= opt_warmup * NSEC_PER_SEC)
+		dprintf(opt_result_fd, "sample %.0f %.0f\n", rx_pps, tx_pps);
+}
+
+static void result_final(void)
+{
+	unsigned long drops[5] = {};
 	int i;
 
-	prev_time = now;
+	if (opt_result_fd < 0)
+		return;
 
-	fprintf(stdout, "----------------------------------------------------------------------\n");
-#ifdef USE_DEBUGMODE
-	fprintf(stdout, " *** WARNING - Debugmode is enabled - performance may not be good ***\n");
-#endif
+	for (i = 0; i < num_socks; i++) {
+		struct xsk_ring_stats *rs = &xsks[i]->ring_stats;
+
+		if (xsk_get_xdp_stats(xsk_socket__fd(xsks[i]->xsk), xsks[i]))
+			continue;
+		drops[0] += rs->rx_dropped_npkts;
+		drops[1] += rs->rx_invalid_npkts;
+		drops[2] += rs->tx_invalid_npkts;
+		drops[3] += rs->rx_full_npkts;
+		drops[4] += rs->rx_fill_empty_npkts;
+	}
 
-	for (i = 0; i < num_socks && xsks[i]; i++) {
-		char *fmt = "%-18s %'-14.0f %'-14lu\n";
-		double rx_pps, tx_pps, dropped_pps, rx_invalid_pps, full_pps, fill_empty_pps,
-			tx_invalid_pps, tx_empty_pps;
+	dprintf(opt_result_fd, "final %lu %lu %lu %lu %lu\n", drops[0], drops[1], drops[2],
+		drops[3], drops[4]);
+}
 
-		rx_pps = (xsks[i]->ring_stats.rx_npkts - xsks[i]->ring_stats.prev_rx_npkts) *
-			 1000000000. / dt;
-		tx_pps = (xsks[i]->ring_stats.tx_npkts - xsks[i]->ring_stats.prev_tx_npkts) *
-			 1000000000. / dt;
+/* --stats-format counters: the live value and the one at the last record,
+ * for the rate. A per-interface counter is copied into every socket, and
+ * goes into the total once.
+ */
+#define XSK_STAT(name, cur, prev) \
+	{ name, offsetof(struct xsk_socket_info, cur), offsetof(struct xsk_socket_info, prev) }
+#define XSK_STAT_IF(name, cur, prev) \
+	{ name, offsetof(struct xsk_socket_info, cur), offsetof(struct xsk_socket_info, prev), true }
 
-		printf("\n sock%d@", i);
-		print_benchmark(xsks[i], false);
-		printf("\n");
+static const struct xsk_stat_field {
+	const char *name;
+	size_t cur;
+	size_t prev;
+	bool per_if;
+} xsk_stat_fields[] = {
+	XSK_STAT("rx_pkts", ring_stats.rx_npkts, ring_stats.prev_rx_npkts),
+	XSK_STAT("tx_pkts", ring_stats.tx_npkts, ring_stats.prev_tx_npkts),
+	XSK_STAT("rx_bytes", ring_stats.rx_bytes, ring_stats.prev_rx_bytes),
+	XSK_STAT("tx_bytes", ring_stats.tx_bytes, ring_stats.prev_tx_bytes),
+	XSK_STAT("rx_dropped", ring_stats.rx_dropped_npkts, ring_stats.prev_rx_dropped_npkts),
+	XSK_STAT("rx_invalid", ring_stats.rx_invalid_npkts, ring_stats.prev_rx_invalid_npkts),
+	XSK_STAT("tx_invalid", ring_stats.tx_invalid_npkts, ring_stats.prev_tx_invalid_npkts),
+	XSK_STAT("rx_full", ring_stats.rx_full_npkts, ring_stats.prev_rx_full_npkts),
+	XSK_STAT("fill_empty", ring_stats.rx_fill_empty_npkts,
+		 ring_stats.prev_rx_fill_empty_npkts),
+	XSK_STAT("tx_empty", ring_stats.tx_empty_npkts, ring_stats.prev_tx_empty_npkts),
+	XSK_STAT("rx_empty_polls", app_stats.rx_empty_polls, app_stats.prev_rx_empty_polls),
+	XSK_STAT("fill_fail_polls", app_stats.fill_fail_polls, app_stats.prev_fill_fail_polls),
+	XSK_STAT("copy_tx_sendtos", app_stats.copy_tx_sendtos, app_stats.prev_copy_tx_sendtos),
+	XSK_STAT("tx_wakeup_sendtos", app_stats.tx_wakeup_sendtos,
+		 app_stats.prev_tx_wakeup_sendtos),
+	XSK_STAT("opt_polls", app_stats.opt_polls, app_stats.prev_opt_polls),
+	XSK_STAT_IF("irqs", drv_stats.intrs, drv_stats.prev_intrs),
+};
+
+#define XSK_STATS	(int)(sizeof(xsk_stat_fields) / sizeof(xsk_stat_fields[0]))
+
+static inline unsigned long *xsk_stat(struct xsk_socket_info *xsk, size_t off)
+{
+	return (unsigned long *)((char *)xsk + off);
+}
+
+/* A record is formatted here and written with one fwrite(), so it comes out
+ * whole. Only the poller blocks if the reader is slow, the workers never
+ * wait on it.
+ */
+static char stats_buf[65536];
+static size_t stats_len;
+
+static void stats_put(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(stats_buf + stats_len, sizeof(stats_buf) - stats_len, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		stats_len = stats_len + n < sizeof(stats_buf) ? stats_len + n : sizeof(stats_buf) - 1;
+}
+
+/* One counter set, as JSON members or CSV fields, with rates over secs. */
+static void stats_put_counters(const unsigned long *val, const unsigned long *delta, double secs)
+{
+	int f;
+
+	for (f = 0; f < XSK_STATS; f++) {
+		if (opt_stats_format == STATS_JSON)
+			stats_put(",\"%s\":%lu,\"%s_ps\":%.0f", xsk_stat_fields[f].name, val[f],
+				  xsk_stat_fields[f].name, delta[f] / secs);
+		else
+			stats_put(",%lu,%.0f", val[f], delta[f] / secs);
+	}
+}
+
+/* One JSON line, or one CSV row per socket plus an "all" row. The summary
+ * rates are averages over the whole run.
+ */
+static void stats_record(const char *type, unsigned long now, long dt)
+{
+	static bool header;
+	unsigned long val[XSK_STATS], delta[XSK_STATS];
+	unsigned long tval[XSK_STATS] = {}, tdelta[XSK_STATS] = {};
+	bool summary = !strcmp(type, "summary");
+	double secs = (summary ? now - start_time : dt) / 1000000000.;
+	double t = (now - start_time) / 1000000000.;
+	int i, f, n_ints = irq_no ? get_irqs() : -1;
+
+	stats_len = 0;
+	if (opt_stats_format == STATS_CSV && !header) {
+		stats_put("type,time,if,sock,queue,mode");
+		for (f = 0; f < XSK_STATS; f++)
+			stats_put(",%s,%s_ps", xsk_stat_fields[f].name, xsk_stat_fields[f].name);
+		stats_put("\n");
+		header = true;
+	}
+	if (opt_stats_format == STATS_JSON)
+		stats_put("{\"type\":\"%s\",\"time\":%.3f,\"if\":\"%s\",\"mode\":\"%s\",\"socks\":[",
+			  type, t, opt_if, bench_name());
+
+	for (i = 0; i < num_socks && xsks[i]; i++) {
+		struct xsk_socket_info *xsk = xsks[i];
+
+		xsk_get_xdp_stats(xsk_socket__fd(xsk->xsk), xsk);
+		if (n_ints >= 0)
+			xsk->drv_stats.intrs = n_ints - irqs_at_init;
+
+		for (f = 0; f < XSK_STATS; f++) {
+			unsigned long *cur = xsk_stat(xsk, xsk_stat_fields[f].cur);
+			unsigned long *prev = xsk_stat(xsk, xsk_stat_fields[f].prev);
+
+			val[f] = *cur;
+			delta[f] = summary ? val[f] : val[f] - *prev;
+			*prev = val[f];
+			if (xsk_stat_fields[f].per_if) {
+				tval[f] = val[f];
+				tdelta[f] = delta[f];
+			} else {
+				tval[f] += val[f];
+				tdelta[f] += delta[f];
+			}
+		}
+
+		if (opt_stats_format == STATS_JSON)
+			stats_put("%s{\"sock\":%d,\"queue\":%u", i ? "," : "", i, xsk->channel_id);
+		else
+			stats_put("%s,%.3f,%s,%d,%u,%s", type, t, opt_if, i, xsk->channel_id,
+				  bench_name());
+		stats_put_counters(val, delta, secs);
+		stats_put(opt_stats_format == STATS_JSON ? "}" : "\n");
+	}
+
+	if (opt_stats_format == STATS_JSON)
+		stats_put("],\"total\":{\"secs\":%.3f", secs);
+	else
+		stats_put("%s,%.3f,%s,all,,%s", type, t, opt_if, bench_name());
+	stats_put_counters(tval, tdelta, secs);
+	stats_put(opt_stats_format == STATS_JSON ? "}}\n" : "\n");
+
+	fwrite(stats_buf, 1, stats_len, stdout);
+	fflush(stdout);
+}
+
+/* --metrics endpoint. A scrape copies the worker counters with plain loads
+ * of aligned longs and asks the kernel for its own XDP statistics, so it
+ * takes no lock the workers use and writes nothing they or the poller own.
+ * metrics_lock only keeps a scrape away from socket teardown.
+ */
+#define METRICS_BUF_SIZE	(256 * 1024)
+
+static int metrics_fd = -1;
+static const char *metrics_path;
+static bool metrics_stopped;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static char metrics_buf[METRICS_BUF_SIZE];
+static size_t metrics_len;
+
+static void metrics_put(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(metrics_buf + metrics_len, sizeof(metrics_buf) - metrics_len, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		metrics_len = metrics_len + n < sizeof(metrics_buf) ?
+			      metrics_len + n : sizeof(metrics_buf) - 1;
+}
+
+static const char *metrics_help(size_t off)
+{
+	if (off >= offsetof(struct xsk_socket_info, drv_stats))
+		return "interrupts of the --irq-string IRQ since start";
+	if (off >= offsetof(struct xsk_socket_info, app_stats))
+		return "xdpsock application counter";
+	return "AF_XDP ring or XDP statistics counter";
+}
+
+/* Prometheus text format, one sample per socket for every counter. */
+static void metrics_render(void)
+{
+	static struct xsk_socket_info snaps[MAX_SOCKS];
+	int i, f, n, n_ints = irq_no ? get_irqs() : -1;
+
+	for (n = 0; n < num_socks && xsks[n]; n++) {
+		struct xsk_socket_info *snap = &snaps[n];
+
+		snap->channel_id = xsks[n]->channel_id;
+		snap->ring_stats = xsks[n]->ring_stats;
+		snap->app_stats = xsks[n]->app_stats;
+		snap->drv_stats = xsks[n]->drv_stats;
+		xsk_get_xdp_stats(xsk_socket__fd(xsks[n]->xsk), snap);
+		if (n_ints >= 0)
+			snap->drv_stats.intrs = n_ints - irqs_at_init;
+	}
+
+	metrics_len = 0;
+	for (f = 0; f < XSK_STATS; f++) {
+		const struct xsk_stat_field *field = &xsk_stat_fields[f];
+
+		if (!irq_no && field->cur == offsetof(struct xsk_socket_info, drv_stats.intrs))
+			continue;
+		metrics_put("# HELP xdpsock_%s_total %s\n# TYPE xdpsock_%s_total counter\n",
+			    field->name, metrics_help(field->cur), field->name);
+		for (i = 0; i < n; i++)
+			metrics_put("xdpsock_%s_total{interface=\"%s\",channel=\"%u\",mode=\"%s\"} %lu\n",
+				    field->name, opt_if, snaps[i].channel_id, bench_name(),
+				    *xsk_stat(&snaps[i], field->cur));
+	}
+
+	metrics_put("# HELP xdpsock_tx_size_pkts_total TX packets by RFC 2819 size class\n"
+		    "# TYPE xdpsock_tx_size_pkts_total counter\n");
+	for (i = 0; i < n; i++)
+		for (f = 0; f < SIZE_BUCKETS; f++)
+			metrics_put("xdpsock_tx_size_pkts_total{interface=\"%s\",channel=\"%u\","
+				    "mode=\"%s\",size=\"%s\"} %lu\n",
+				    opt_if, snaps[i].channel_id, bench_name(), size_buckets[f].name,
+				    snaps[i].ring_stats.tx_size_npkts[f]);
+}
+
+static bool metrics_send(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	for (; len; buf += n, len -= n) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+	}
+	return true;
+}
+
+/* Whatever the request, the answer is the metrics page. Timeouts keep a
+ * stuck client from holding up the next scrape.
+ */
+static void *metrics_thread(void *arg)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	char req[1024], head[256];
+	int fd, len;
+
+	(void)arg;
+	for (;;) {
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (recv(fd, req, sizeof(req), 0) > 0) {
+			pthread_mutex_lock(&metrics_lock);
+			if (!metrics_stopped) {
+				metrics_render();
+				len = snprintf(head, sizeof(head),
+					       "HTTP/1.0 200 OK\r\n"
+					       "Content-Type: text/plain; version=0.0.4\r\n"
+					       "Content-Length: %zu\r\n"
+					       "Connection: close\r\n\r\n", metrics_len);
+				if (metrics_send(fd, head, len))
+					metrics_send(fd, metrics_buf, metrics_len);
+			}
+			pthread_mutex_unlock(&metrics_lock);
+		}
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* Spread of one per-socket rate: a hot queue from RSS imbalance shows up as
+ * a max/mean well above 1.
+ */
+static void dump_skew(const char *name, const double *pps, int n)
+{
+	double min = pps[0], max = pps[0], sum = 0, sq = 0, mean, sd;
+	int i, hot = 0;
+
+	for (i = 0; i < n; i++) {
+		if (pps[i] < min)
+			min = pps[i];
+		if (pps[i] > max) {
+			max = pps[i];
+			hot = i;
+		}
+		sum += pps[i];
+		sq += pps[i] * pps[i];
+	}
+	mean = sum / n;
+	sd = sq / n > mean * mean ? sqrt(sq / n - mean * mean) : 0;
+
+	printf("%-18s %'-14.0f %'-14.0f %'-14.0f %-10.2f sock%d@q%u\n", name, min, max, sd,
+	       mean ? max / mean : 0, hot, xsks[hot]->channel_id);
+}
+
+/* Totals across sockets, printed after the per-socket blocks. */
+static void dump_aggregate_stats(long dt, const double *rx_pps, const double *tx_pps)
+{
+	static unsigned long prev_dropped, prev_full, prev_fill_empty;
+	unsigned long rx = 0, tx = 0, dropped = 0, full = 0, fill_empty = 0;
+	char *fmt = "%-18s %'-14.0f %'-14lu\n";
+	double rx_total = 0, tx_total = 0;
+	int i;
+
+	for (i = 0; i < num_socks && xsks[i]; i++) {
+		struct xsk_ring_stats *rs = &xsks[i]->ring_stats;
+
+		xsk_get_xdp_stats(xsk_socket__fd(xsks[i]->xsk), xsks[i]);
+		rx += rs->rx_npkts;
+		tx += rs->tx_npkts;
+		dropped += rs->rx_dropped_npkts;
+		full += rs->rx_full_npkts;
+		fill_empty += rs->rx_fill_empty_npkts;
+		rx_total += rx_pps[i];
+		tx_total += tx_pps[i];
+	}
+
+	printf("\n all@%s %s (%d sockets)\n", opt_if, bench_name(), i);
+	printf("%-18s %-14s %-14s\n", "", "pps", "pkts");
+	printf(fmt, "rx", rx_total, rx);
+	printf(fmt, "tx", tx_total, tx);
+	printf(fmt, "rx dropped", (dropped - prev_dropped) * 1000000000. / dt, dropped);
+	printf(fmt, "rx queue full", (full - prev_full) * 1000000000. / dt, full);
+	printf(fmt, "fill ring empty", (fill_empty - prev_fill_empty) * 1000000000. / dt,
+	       fill_empty);
+	prev_dropped = dropped;
+	prev_full = full;
+	prev_fill_empty = fill_empty;
+
+	printf("%-18s %-14s %-14s %-14s %-10s %-10s\n", "", "min", "max", "stddev",
+	       "max/mean", "hottest");
+	if (opt_bench == BENCH_TXONLY)
+		dump_skew("tx skew (pps)", tx_pps, i);
+	else
+		dump_skew("rx skew (pps)", rx_pps, i);
+
+	if (opt_util) {
+		double pct[UTIL_STATES] = {};
+		int n = i, k;
+
+		for (i = 0; i < n; i++)
+			for (k = 0; k < UTIL_STATES; k++)
+				pct[k] += xsks[i]->util.pct[k];
+		printf("%-18s %-10s %-10s %-10s %-10s %-10s %-10s\n", "",
+		       "busy", "empty", "syscall", "stall", "idle", "util");
+		printf("%-18s %-10.1f %-10.1f %-10.1f %-10.1f %-10.1f %-10.1f\n", "worker cpu (%)",
+		       pct[UTIL_BUSY], pct[UTIL_EMPTY], pct[UTIL_SYSCALL], pct[UTIL_STALL],
+		       pct[UTIL_IDLE], pct[UTIL_BUSY] + pct[UTIL_STALL]);
+	}
+}
+
+static void dump_stats(void)
+{
+	unsigned long now = get_nsecs();
+	long dt = now - prev_time;
+	double rx_total = 0, tx_total = 0;
+	double rx_socks[MAX_SOCKS], tx_socks[MAX_SOCKS];
+	int i;
+
+	prev_time = now;
+
+	if (opt_stats_format != STATS_TEXT) {
+		for (i = 0; i < num_socks && xsks[i]; i++) {
+			rx_total += (xsks[i]->ring_stats.rx_npkts -
+				     xsks[i]->ring_stats.prev_rx_npkts) * 1000000000. / dt;
+			tx_total += (xsks[i]->ring_stats.tx_npkts -
+				     xsks[i]->ring_stats.prev_tx_npkts) * 1000000000. / dt;
+		}
+		result_sample(now, rx_total, tx_total);
+		stats_record("interval", now, dt);
+		return;
+	}
+
+	fprintf(stdout, "----------------------------------------------------------------------\n");
+#ifdef USE_DEBUGMODE
+	fprintf(stdout, " *** WARNING - Debugmode is enabled - performance may not be good ***\n");
+#endif
+
+	for (i = 0; i < num_socks && xsks[i]; i++) {
+		char *fmt = "%-18s %'-14.0f %'-14lu\n";
+		double rx_pps, tx_pps, dropped_pps, rx_invalid_pps, full_pps, fill_empty_pps,
+			tx_invalid_pps, tx_empty_pps;
+
+		rx_pps = (xsks[i]->ring_stats.rx_npkts - xsks[i]->ring_stats.prev_rx_npkts) *
+			 1000000000. / dt;
+		tx_pps = (xsks[i]->ring_stats.tx_npkts - xsks[i]->ring_stats.prev_tx_npkts) *
+			 1000000000. / dt;
+
+		printf("\n sock%d@", i);
+		print_benchmark(xsks[i], false);
+		printf("\n");
 
 		printf("%-18s %-14s %-14s %-14.2f\n", "", "pps", "pkts",
 		       dt / 1000000000.);
 		printf(fmt, "rx", rx_pps, xsks[i]->ring_stats.rx_npkts);
 		printf(fmt, "tx", tx_pps, xsks[i]->ring_stats.tx_npkts);
+		rx_total += rx_pps;
+		tx_total += tx_pps;
+		rx_socks[i] = rx_pps;
+		tx_socks[i] = tx_pps;
 
 		xsks[i]->ring_stats.prev_rx_npkts = xsks[i]->ring_stats.rx_npkts;
 		xsks[i]->ring_stats.prev_tx_npkts = xsks[i]->ring_stats.tx_npkts;
 
+		if (opt_extra_stats || opt_size_profile != SIZE_PROFILE_FIXED) {
+			double rx_bps, tx_bps;
+
+			rx_bps = (xsks[i]->ring_stats.rx_bytes -
+				  xsks[i]->ring_stats.prev_rx_bytes) * 1000000000. / dt;
+			tx_bps = (xsks[i]->ring_stats.tx_bytes -
+				  xsks[i]->ring_stats.prev_tx_bytes) * 1000000000. / dt;
+
+			printf("%-18s %-14s %-14s\n", "", "bytes/s", "bytes");
+			printf(fmt, "rx bytes", rx_bps, xsks[i]->ring_stats.rx_bytes);
+			printf(fmt, "tx bytes", tx_bps, xsks[i]->ring_stats.tx_bytes);
+
+			xsks[i]->ring_stats.prev_rx_bytes = xsks[i]->ring_stats.rx_bytes;
+			xsks[i]->ring_stats.prev_tx_bytes = xsks[i]->ring_stats.tx_bytes;
+		}
+
+		if (opt_bench == BENCH_TXONLY && opt_size_profile != SIZE_PROFILE_FIXED &&
+		    xsks[i]->ring_stats.tx_npkts) {
+			int b;
+
+			printf("%-18s", "tx sizes");
+			for (b = 0; b < SIZE_BUCKETS; b++)
+				printf(" %s:%.1f%%", size_buckets[b].name,
+				       xsks[i]->ring_stats.tx_size_npkts[b] * 100.0 /
+				       xsks[i]->ring_stats.tx_npkts);
+			printf("\n");
+		}
+
 		if (opt_extra_stats) {
 			if (!xsk_get_xdp_stats(xsk_socket__fd(xsks[i]->xsk), xsks[i])) {
 				dropped_pps = (xsks[i]->ring_stats.rx_dropped_npkts -
@@ -575,8 +1890,185 @@ static void dump_stats(void)
 				printf("%-15s\n", "Error retrieving extra stats");
 			}
 		}
+
+		if (opt_bench == BENCH_LATENCY) {
+			struct xsk_latency_stats *lat = &xsks[i]->lat;
+
+			printf("%-18s %-10s %-10s %-10s %-10s %-10s %-10s %-10s\n", "",
+			       "probes", "replies", "lost", "p50", "p99", "p99.9", "max");
+			printf("%-18s %-10lu %-10lu %-10lu %-10llu %-10llu %-10llu %-10llu\n",
+			       "rtt (ns)", lat->probes, lat->replies,
+			       lat->lost,
+			       hist_percentile(&lat->rtt, 50.0),
+			       hist_percentile(&lat->rtt, 99.0),
+			       hist_percentile(&lat->rtt, 99.9), lat->rtt.max);
+			if (lat->unmatched || lat->rx_other)
+				printf("%-18s %-10lu %-10s %-10lu\n", "unmatched/other",
+				       lat->unmatched, "", lat->rx_other);
+		}
+
+		if (opt_rxcheck) {
+			struct xsk_rxcheck_stats *rc = &xsks[i]->rxcheck;
+
+			printf("%-18s %-10s %-10s %-10s %-10s %-10s %-10s %-10s\n", "",
+			       "pktgen", "other", "streams", "lost", "dups", "reorder", "late");
+			printf("%-18s %-10lu %-10lu %-10lu %-10lu %-10lu %-10lu %-10lu\n",
+			       "rxcheck", rc->pkts, rc->other, rc->streams, rc->lost,
+			       rc->dups, rc->reordered, rc->late);
+			if (rc->owd.total)
+				printf("%-18s %-10llu %-10llu %-10llu %-10llu\n", "owd p50/99/99.9/max",
+				       hist_percentile(&rc->owd, 50.0),
+				       hist_percentile(&rc->owd, 99.0),
+				       hist_percentile(&rc->owd, 99.9), rc->owd.max);
+			if (rc->untracked)
+				printf("%-18s %-10lu\n", "untracked streams", rc->untracked);
+		}
+
+		if (opt_num_rates) {
+			const struct rate_spec *spec = &opt_rates[opt_num_rates > 1 ? i : 0];
+			struct xsk_rate *r = &xsks[i]->rate;
+			double achieved = spec->bps ?
+				(r->bytes - r->prev_bytes) * 8000000000. / dt :
+				(r->pkts - r->prev_pkts) * 1000000000. / dt;
+
+			printf("%-18s %-14s %-14s %-10s %-10s %-10s\n", "", "target",
+			       "achieved", "jit p50", "jit p99", "jit max");
+			printf("%-18s %-14.0f %-14.0f %-10llu %-10llu %-10llu\n",
+			       spec->bps ? "rate (bps)" : "rate (pps)", spec->rate, achieved,
+			       hist_percentile(&r->jitter, 50.0),
+			       hist_percentile(&r->jitter, 99.0), r->jitter.max);
+			r->prev_pkts = r->pkts;
+			r->prev_bytes = r->bytes;
+		}
+
+		if (opt_perf_counters) {
+			struct xsk_perf_stats *perf = &xsks[i]->perf;
+			unsigned long pkts = opt_bench == BENCH_TXONLY ?
+				xsks[i]->ring_stats.tx_npkts : xsks[i]->ring_stats.rx_npkts;
+			double d[PERF_EVENTS], n = pkts - perf->prev_pkts;
+			int k;
+
+			for (k = 0; k < PERF_EVENTS; k++) {
+				u64 val = perf->val[k];
+
+				d[k] = val - perf->prev[k];
+				perf->prev[k] = val;
+			}
+			perf->prev_pkts = pkts;
+			if (!n)
+				n = NAN;
+
+			printf("%-18s %-10s %-10s %-10s %-10s %-10s %-10s\n", "",
+			       "cycles/pkt", "instr/pkt", "IPC", "LLC/pkt", "dTLB/pkt",
+			       "brmiss/pkt");
+			printf("%-18s %-10.1f %-10.1f %-10.2f %-10.3f %-10.3f %-10.3f\n", "perf",
+			       d[0] / n, d[1] / n, d[0] ? d[1] / d[0] : 0, d[2] / n, d[3] / n,
+			       d[4] / n);
+		}
+
+		if (opt_util) {
+			struct xsk_util_stats *u = &xsks[i]->util;
+			int k;
+
+			for (k = 0; k < UTIL_STATES; k++) {
+				u64 ticks = u->ticks[k];
+
+				u->pct[k] = tsc_to_ns(ticks - u->prev[k]) * 100. / dt;
+				u->prev[k] = ticks;
+			}
+			printf("%-18s %-10s %-10s %-10s %-10s %-10s %-10s\n", "",
+			       "busy", "empty", "syscall", "stall", "idle", "util");
+			printf("%-18s %-10.1f %-10.1f %-10.1f %-10.1f %-10.1f %-10.1f\n", "cpu (%)",
+			       u->pct[UTIL_BUSY], u->pct[UTIL_EMPTY], u->pct[UTIL_SYSCALL],
+			       u->pct[UTIL_STALL], u->pct[UTIL_IDLE],
+			       u->pct[UTIL_BUSY] + u->pct[UTIL_STALL]);
+		}
+
+		if (opt_batch_hist) {
+			static struct hist iv;
+
+			batch_hist_interval(xsks[i], &iv);
+			printf("%-18s %-10s %-10s %-10s %-10s %-10s\n", "",
+			       "batches", "p50", "p99", "p99.9", "max");
+			printf("%-18s %-10lu %-10llu %-10llu %-10llu %-10llu\n",
+			       "batch (ns)", iv.total,
+			       tsc_to_ns(hist_percentile(&iv, 50.0)),
+			       tsc_to_ns(hist_percentile(&iv, 99.0)),
+			       tsc_to_ns(hist_percentile(&iv, 99.9)), tsc_to_ns(iv.max));
+		}
+
+		if (opt_burst && opt_bench == BENCH_TXONLY) {
+			struct xsk_burst_stats *b = &xsks[i]->burst;
+
+			printf("%-18s %-14s %-14s %-14s\n", "", "bursts", "mean", "max");
+			printf("%-18s %-14lu %-14.1f %-14u\n", "tx bursts", b->bursts,
+			       b->bursts ? (double)b->pkts / b->bursts : 0, b->max);
+		}
+
+		if (opt_burst_detect_us) {
+			struct xsk_burst_stats *b = &xsks[i]->burst;
+
+			printf("%-18s %-10s %-10s %-10s %-10s %-10s %-10s %-10s\n", "",
+			       "bursts", "max", "lossy", "max clean", "min lossy",
+			       "full/lossy", "max full");
+			printf("%-18s %-10lu %-10u %-10lu %-10u %-10u %-10.1f %-10llu\n",
+			       "rx bursts", b->bursts, b->max, b->lossy, b->max_clean,
+			       b->min_lossy, b->lossy ? (double)b->rx_full / b->lossy : 0,
+			       b->max_full);
+			if (b->fill_empty)
+				printf("%-18s %-10lu\n", "fill empty pkts", b->fill_empty);
+		}
+
+		if (opt_bench == BENCH_L3FWD) {
+			struct xsk_l3fwd_stats *l3 = &xsks[i]->l3fwd;
+
+			printf("%-18s %-14s %-14s %-14s %-14s\n", "", "fwd", "no route",
+			       "ttl exceeded", "other");
+			printf("%-18s %-14lu %-14lu %-14lu %-14lu\n", "l3fwd", l3->fwd,
+			       l3->no_route, l3->ttl_exceeded, l3->other);
+		}
+
+		if (xsks[i]->cap) {
+			struct xsk_capture *cap = xsks[i]->cap;
+
+			printf("%-18s %-14s %-14s %-14s %-14s\n", "", "pps", "pkts",
+			       "MB", "drops");
+			printf("%-18s %-14.0f %-14lu %-14.1f %-14lu\n", "capture",
+			       (cap->pkts - cap->prev_pkts) * 1000000000. / dt, cap->pkts,
+			       cap->bytes / 1e6, cap->drops);
+			if (cap->drops != cap->prev_drops || cap->write_errors)
+				printf("%-18s %-14.0f %-14lu\n", "capture drops/errs",
+				       (cap->drops - cap->prev_drops) * 1000000000. / dt,
+				       cap->write_errors);
+			cap->prev_pkts = cap->pkts;
+			cap->prev_drops = cap->drops;
+		}
+
+		if (opt_batch_auto) {
+			struct xsk_batch_ctl *ctl = &xsks[i]->batch;
+			/* The interval saw the size it started with and each one set since */
+			u32 lo = __atomic_exchange_n(&ctl->lo, UINT32_MAX, __ATOMIC_RELAXED);
+			u32 hi = __atomic_exchange_n(&ctl->hi, 0, __ATOMIC_RELAXED);
+			u32 size = __atomic_load_n(&ctl->size, __ATOMIC_RELAXED);
+
+			if (ctl->dump_size < lo)
+				lo = ctl->dump_size;
+			if (ctl->dump_size > hi)
+				hi = ctl->dump_size;
+			ctl->dump_size = size;
+
+			printf("%-18s %-10s %-10s %-10s %-10s\n",
+			       "", "batch", "min", "max", "adjusts");
+			printf("%-18s %-10u %-10u %-10u %-10lu\n", "batch auto",
+			       size, lo, hi, ctl->adjusts);
+		}
 	}
 
+	if (i > 1)
+		dump_aggregate_stats(dt, rx_socks, tx_socks);
+
+	result_sample(now, rx_total, tx_total);
+
 	if (opt_app_stats)
 		dump_app_stats(dt);
 	if (irq_no)
@@ -622,6 +2114,120 @@ static void remove_xdp_program(void)
 		printf("program on interface changed, not removing\n");
 }
 
+/* An attribute of the interface in /sys/class/net/<if>/. */
+static int netdev_attr_path(char *path, size_t len, const char *name)
+{
+	return snprintf(path, len, "/sys/class/net/%s/%s", opt_if, name);
+}
+
+static int netdev_attr_read(const char *name, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	netdev_attr_path(path, sizeof(path), name);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -errno;
+
+	if (fgets(buf, len, f) == NULL) {
+		fclose(f);
+		return -EIO;
+	}
+	buf[strcspn(buf, "\n")] = '\0';
+
+	fclose(f);
+	return 0;
+}
+
+/* NAPI sysfs knobs we may touch, with their values before we did. */
+static struct napi_knob {
+	const char *name;
+	char orig[64];
+	bool saved;
+} napi_knobs[] = {
+	{ "napi_defer_hard_irqs" },
+	{ "gro_flush_timeout" },
+	{ "threaded" },
+	{ NULL }
+};
+
+/* NAPI kthreads we pinned, with their CPU affinity before we did. */
+#define NAPI_PINS_MAX	256
+
+static struct napi_pin {
+	pid_t pid;
+	cpu_set_t orig;
+} napi_pins[NAPI_PINS_MAX];
+static int napi_num_pins;
+
+static int napi_knob_write(const char *name, const char *val)
+{
+	char path[PATH_MAX];
+	int ret = 0;
+	FILE *f;
+
+	netdev_attr_path(path, sizeof(path), name);
+	f = fopen(path, "w");
+	if (f == NULL)
+		return -errno;
+
+	if (fputs(val, f) < 0)
+		ret = -EIO;
+	if (fclose(f))
+		ret = -errno;
+	return ret;
+}
+
+/* Save the original value of a knob the first time we change it. */
+static int napi_knob_set(const char *name, const char *val)
+{
+	struct napi_knob *knob;
+	int ret;
+
+	for (knob = napi_knobs; knob->name; knob++) {
+		if (strcmp(knob->name, name))
+			continue;
+
+		if (!knob->saved) {
+			ret = netdev_attr_read(name, knob->orig, sizeof(knob->orig));
+			if (ret)
+				return ret;
+			knob->saved = true;
+		}
+		return napi_knob_write(name, val);
+	}
+
+	return -ENOENT;
+}
+
+/* Safe to call more than once: it runs from every exit path and atexit(). */
+static void napi_knobs_restore(void)
+{
+	struct napi_knob *knob;
+
+	/* Unpin while the kthreads are still there. */
+	while (napi_num_pins) {
+		struct napi_pin *pin = &napi_pins[--napi_num_pins];
+
+		if (sched_setaffinity(pin->pid, sizeof(pin->orig), &pin->orig) && errno != ESRCH)
+			fprintf(stderr, "Failed to restore the affinity of pid %d: %s\n",
+				pin->pid, strerror(errno));
+	}
+
+	/* Restore in reverse, so threaded NAPI goes away first. */
+	for (knob = napi_knobs; knob->name; knob++)
+		;
+	while (knob-- != napi_knobs) {
+		if (!knob->saved)
+			continue;
+		if (napi_knob_write(knob->name, knob->orig))
+			fprintf(stderr, "Failed to restore %s=%s on %s\n",
+				knob->name, knob->orig, opt_if);
+		knob->saved = false;
+	}
+}
+
 static void int_exit(int sig)
 {
 	benchmark_done = true;
@@ -633,6 +2239,8 @@ static void __exit_with_error(int error, const char *file, const char *func,
 	fprintf(stderr, "%s:%s:%i: errno: %d/\"%s\"\n", file, func,
 		line, error, strerror(error));
 
+	napi_knobs_restore();
+
 #ifndef MULTI_FCQ
 	/* In single FCQ mode, we only have an XDP program laoded if num_xsks > 1. */
 	if (opt_num_xsks > 1)
@@ -643,77 +2251,439 @@ static void __exit_with_error(int error, const char *file, const char *func,
 
 #define exit_with_error(error) __exit_with_error(error, __FILE__, __func__, __LINE__)
 
-static void xdpsock_cleanup(void)
+static void *capture_writer(void *arg)
 {
-	struct xsk_umem *umem = xsks[0]->umem->umem;
-	int i, cmd = CLOSE_CONN;
-
-	dump_stats();
-	for (i = 0; i < num_socks; i++)
-		xsk_socket__delete(xsks[i]->xsk);
-	(void)xsk_umem__delete(umem);
+	struct xsk_capture *cap = arg;
+	bool stop = false;
+
+	while (!stop) {
+		u8 *buf;
+
+		pthread_mutex_lock(&cap->lock);
+		while (cap->written == __atomic_load_n(&cap->filled, __ATOMIC_ACQUIRE) &&
+		       !cap->stop)
+			pthread_cond_wait(&cap->cond, &cap->lock);
+		stop = cap->written == __atomic_load_n(&cap->filled, __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&cap->lock);
+		if (stop)
+			break;
 
-	if (opt_reduced_cap) {
-		if (write(sock, &cmd, sizeof(int)) < 0)
-			exit_with_error(errno);
+		buf = cap->bufs[cap->written % CAPTURE_BUFS];
+		if (write(cap->fd, buf, CAPTURE_BUF_SIZE) != CAPTURE_BUF_SIZE)
+			cap->write_errors++;
+		__atomic_store_n(&cap->written, cap->written + 1, __ATOMIC_RELEASE);
 	}
 
-#ifndef MULTI_FCQ
-	/* In single FCQ mode, we only have an XDP program laoded if num_xsks > 1. */
-	if (opt_num_xsks > 1)
-#endif
-		remove_xdp_program();
+	return NULL;
 }
 
-static void swap_mac_addresses(void *data)
+/* Append len bytes to the capture stream, continuing in the next buffer when
+ * the current one fills up.
+ */
+static void capture_put(struct xsk_capture *cap, const void *data, u32 len)
 {
-	struct ether_header *eth = (struct ether_header *)data;
-	struct ether_addr *src_addr = (struct ether_addr *)&eth->ether_shost;
-	struct ether_addr *dst_addr = (struct ether_addr *)&eth->ether_dhost;
-	struct ether_addr tmp;
-
-	tmp = *src_addr;
-	*src_addr = *dst_addr;
-	*dst_addr = tmp;
+	const u8 *src = data;
+
+	while (len) {
+		u32 n = CAPTURE_BUF_SIZE - cap->fill;
+
+		if (n > len)
+			n = len;
+		memcpy(cap->bufs[cap->filled % CAPTURE_BUFS] + cap->fill, src, n);
+		cap->fill += n;
+		src += n;
+		len -= n;
+
+		if (cap->fill == CAPTURE_BUF_SIZE) {
+			cap->fill = 0;
+			__atomic_store_n(&cap->filled, cap->filled + 1, __ATOMIC_RELEASE);
+			pthread_mutex_lock(&cap->lock);
+			pthread_cond_signal(&cap->cond);
+			pthread_mutex_unlock(&cap->lock);
+		}
+	}
 }
 
-static void hex_dump(void *pkt, size_t length, u64 addr)
+static void capture_pkt(struct xsk_capture *cap, const char *pkt, u32 len,
+			const struct timespec *ts)
 {
-	const unsigned char *address = (unsigned char *)pkt;
-	const unsigned char *line = address;
-	size_t line_size = 32;
-	unsigned char c;
-	char buf[32];
-	int i = 0;
+	static const u8 pad[4];
+	u32 caplen = len < opt_snaplen ? len : opt_snaplen;
+	u32 rec_len, spill;
 
-	if (!DEBUG_HEXDUMP)
+	if (opt_sample > 1 && cap->seen++ % opt_sample)
 		return;
 
-	sprintf(buf, "addr=%llu", addr);
-	printf("length = %zu\n", length);
-	printf("%s | ", buf);
-	while (length-- > 0) {
-		printf("%02X ", *address++);
-		if (!(++i % line_size) || (length == 0 && i % line_size)) {
-			if (length == 0) {
-				while (i++ % line_size)
-					printf("__ ");
-			}
-			printf(" | ");	/* right close */
-			while (line < address) {
-				c = *line++;
-				printf("%c", (c < 33 || c == 255) ? 0x2E : c);
-			}
-			printf("\n");
-			if (length > 0)
-				printf("%s | ", buf);
-		}
+	if (opt_capture_pcapng)
+		rec_len = sizeof(struct pcapng_epb) + ((caplen + 3) & ~3U) + sizeof(u32);
+	else
+		rec_len = sizeof(struct pcap_rec_hdr) + caplen;
+
+	/* The buffer we end up filling after this record must not still be
+	 * queued for the writer.
+	 */
+	spill = cap->fill + rec_len;
+	if (spill >= CAPTURE_BUF_SIZE &&
+	    cap->filled + spill / CAPTURE_BUF_SIZE -
+	    __atomic_load_n(&cap->written, __ATOMIC_ACQUIRE) >= CAPTURE_BUFS) {
+		cap->drops++;
+		return;
 	}
-	printf("\n");
-}
 
-static void *memset32_htonl(void *dest, u32 val, u32 size)
-{
+	if (opt_capture_pcapng) {
+		unsigned long ns = ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+		struct pcapng_epb epb = {
+			.type = PCAPNG_EPB,
+			.total_len = rec_len,
+			.ts_high = ns >> 32,
+			.ts_low = (u32)ns,
+			.caplen = caplen,
+			.len = len,
+		};
+
+		capture_put(cap, &epb, sizeof(epb));
+		capture_put(cap, pkt, caplen);
+		capture_put(cap, pad, ((caplen + 3) & ~3U) - caplen);
+		capture_put(cap, &rec_len, sizeof(rec_len));
+	} else {
+		struct pcap_rec_hdr rh = {
+			.ts_sec = ts->tv_sec,
+			.ts_frac = ts->tv_nsec,
+			.caplen = caplen,
+			.len = len,
+		};
+
+		capture_put(cap, &rh, sizeof(rh));
+		capture_put(cap, pkt, caplen);
+	}
+
+	cap->pkts++;
+	cap->bytes += rec_len;
+}
+
+static void capture_open(struct xsk_socket_info *xsk)
+{
+	struct xsk_capture *cap;
+	char path[PATH_MAX];
+	int i, ret;
+
+	cap = calloc(1, sizeof(*cap));
+	if (!cap)
+		exit_with_error(errno);
+
+	for (i = 0; i < CAPTURE_BUFS; i++) {
+		ret = posix_memalign((void **)&cap->bufs[i], CAPTURE_ALIGN, CAPTURE_BUF_SIZE);
+		if (ret)
+			exit_with_error(ret);
+	}
+
+	snprintf(path, sizeof(path), "%s-%s-q%u.%s", opt_capture, opt_if,
+		 xsk->channel_id, opt_capture_pcapng ? "pcapng" : "pcap");
+	cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (cap->fd < 0 && errno == EINVAL) /* e.g. tmpfs */
+		cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cap->fd < 0) {
+		fprintf(stderr, "ERROR: Can't create %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (opt_capture_pcapng) {
+		/* Host byte order blocks: SHB version 1.0 with unknown section
+		 * length, then an IDB with if_tsresol = 9 (nanoseconds).
+		 */
+		u32 shb[7] = { PCAPNG_SHB, sizeof(shb), PCAPNG_BYTE_ORDER, 1,
+			       0xffffffff, 0xffffffff, sizeof(shb) };
+		u32 idb[8] = { PCAPNG_IDB, sizeof(idb), PCAP_LINKTYPE_ETHERNET,
+			       opt_snaplen, PCAPNG_OPT_TSRESOL | 1 << 16, 9, 0,
+			       sizeof(idb) };
+
+		capture_put(cap, shb, sizeof(shb));
+		capture_put(cap, idb, sizeof(idb));
+	} else {
+		struct pcap_file_hdr fh = {
+			.magic = PCAP_MAGIC_NSEC,
+			.version_major = 2,
+			.version_minor = 4,
+			.snaplen = opt_snaplen,
+			.linktype = PCAP_LINKTYPE_ETHERNET,
+		};
+
+		capture_put(cap, &fh, sizeof(fh));
+	}
+
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->cond, NULL);
+	ret = pthread_create(&cap->writer, NULL, capture_writer, cap);
+	if (ret)
+		exit_with_error(ret);
+
+	xsk->cap = cap;
+	printf("XSK[%u] capturing to %s\n", xsk->xsk_index, path);
+}
+
+/* Drain the writer and write the partial last buffer. O_DIRECT is dropped
+ * for it since its length is not block aligned.
+ */
+static void capture_close(struct xsk_socket_info *xsk)
+{
+	struct xsk_capture *cap = xsk->cap;
+	int i;
+
+	pthread_mutex_lock(&cap->lock);
+	cap->stop = true;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_join(cap->writer, NULL);
+
+	fcntl(cap->fd, F_SETFL, fcntl(cap->fd, F_GETFL) & ~O_DIRECT);
+	if (cap->fill &&
+	    write(cap->fd, cap->bufs[cap->filled % CAPTURE_BUFS], cap->fill) != cap->fill)
+		cap->write_errors++;
+	close(cap->fd);
+
+	for (i = 0; i < CAPTURE_BUFS; i++)
+		free(cap->bufs[i]);
+}
+
+/* Opens the group for the calling thread, which must be the worker. */
+static void perf_open(void)
+{
+	struct perf_event_attr attr;
+	int k;
+
+	for (k = 0; k < PERF_EVENTS; k++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_counters[k].type;
+		attr.config = perf_counters[k].config;
+		attr.disabled = !k;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		perf_fds[k] = syscall(__NR_perf_event_open, &attr, 0, -1,
+				      k ? perf_fds[0] : -1, PERF_FLAG_FD_CLOEXEC);
+		if (perf_fds[k] < 0) {
+			int err = errno;
+
+			fprintf(stderr, "ERROR: perf_event_open() for %s failed, check "
+				"/proc/sys/kernel/perf_event_paranoid\n", perf_counters[k].name);
+			exit_with_error(err);
+		}
+
+		perf_pages[k] = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED,
+				     perf_fds[k], 0);
+		if (perf_pages[k] == MAP_FAILED)
+			perf_pages[k] = NULL;
+	}
+
+	if (ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP))
+		exit_with_error(errno);
+
+	perf_rdpmc = true;
+	for (k = 0; k < PERF_EVENTS; k++)
+		perf_rdpmc = perf_rdpmc && perf_pages[k] && perf_pages[k]->cap_user_rdpmc;
+#if !defined(__x86_64__) && !defined(__i386__)
+	perf_rdpmc = false;
+#endif
+	if (!perf_rdpmc)
+		printf("rdpmc not available, reading the perf counters with read()\n");
+}
+
+static void metrics_start(void)
+{
+	pthread_t pt;
+	int ret;
+
+	if (!strncmp(opt_metrics, "unix:", 5)) {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+		struct stat st;
+
+		metrics_path = opt_metrics + 5;
+		strncpy(sun.sun_path, metrics_path, sizeof(sun.sun_path) - 1);
+		/* Clear a socket left by an earlier run, never any other file */
+		if (!lstat(metrics_path, &st) && S_ISSOCK(st.st_mode))
+			unlink(metrics_path);
+		metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (metrics_fd < 0 || bind(metrics_fd, (struct sockaddr *)&sun, sizeof(sun)))
+			exit_with_error(errno);
+	} else {
+		struct sockaddr_in sin = {
+			.sin_family = AF_INET,
+			.sin_port = htons(opt_metrics_port),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+		int one = 1;
+
+		metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (metrics_fd < 0)
+			exit_with_error(errno);
+		setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(metrics_fd, (struct sockaddr *)&sin, sizeof(sin)))
+			exit_with_error(errno);
+	}
+	if (listen(metrics_fd, 8))
+		exit_with_error(errno);
+
+	ret = pthread_create(&pt, NULL, metrics_thread, NULL);
+	if (ret)
+		exit_with_error(ret);
+	pthread_detach(pt);
+}
+
+static void metrics_stop(void)
+{
+	if (metrics_fd < 0)
+		return;
+
+	pthread_mutex_lock(&metrics_lock);
+	metrics_stopped = true;
+	pthread_mutex_unlock(&metrics_lock);
+	if (metrics_path)
+		unlink(metrics_path);
+}
+
+static void xdpsock_cleanup(void)
+{
+	struct xsk_umem *umem = xsks[0]->umem->umem;
+	int i, cmd = CLOSE_CONN;
+
+	for (i = 0; i < num_socks; i++)
+		if (xsks[i]->cap)
+			capture_close(xsks[i]);
+
+	dump_stats();
+	if (opt_stats_format != STATS_TEXT)
+		stats_record("summary", get_nsecs(), 0);
+	result_final();
+	metrics_stop();
+	for (i = 0; i < num_socks; i++)
+		xsk_socket__delete(xsks[i]->xsk);
+	(void)xsk_umem__delete(umem);
+
+	if (opt_reduced_cap) {
+		if (write(sock, &cmd, sizeof(int)) < 0)
+			exit_with_error(errno);
+	}
+
+#ifndef MULTI_FCQ
+	/* In single FCQ mode, we only have an XDP program laoded if num_xsks > 1. */
+	if (opt_num_xsks > 1)
+#endif
+		remove_xdp_program();
+
+	napi_knobs_restore();
+}
+
+static void swap_mac_addresses(void *data)
+{
+	struct ether_header *eth = (struct ether_header *)data;
+	struct ether_addr *src_addr = (struct ether_addr *)&eth->ether_shost;
+	struct ether_addr *dst_addr = (struct ether_addr *)&eth->ether_dhost;
+	struct ether_addr tmp;
+
+	tmp = *src_addr;
+	*src_addr = *dst_addr;
+	*dst_addr = tmp;
+}
+
+/* Swap the two halves of an adjacent src/dst pair in one register. */
+static inline void swap_halves32(void *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	v = v >> 16 | v << 16;
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void swap_halves64(void *p)
+{
+	u64 v;
+
+	memcpy(&v, p, sizeof(v));
+	v = v >> 32 | v << 32;
+	memcpy(p, &v, sizeof(v));
+}
+
+/* --reflect: send the packet back where it came from, swapping MACs, IPv4 or
+ * IPv6 addresses and UDP/TCP ports. Checksums need no update: the one's
+ * complement sum is order independent and both the IP header and the L4
+ * pseudo-header still sum the same two addresses and ports.
+ */
+static void reflect_pkt(void *data, u32 len)
+{
+	u8 *pkt = data, *l3 = pkt + sizeof(struct ethhdr), *end = pkt + len, *l4 = NULL;
+	u16 proto = ((struct ethhdr *)pkt)->h_proto;
+	u8 l4proto = 0;
+
+	swap_mac_addresses(pkt);
+
+	if (proto == htons(ETH_P_8021Q) && l3 + 4 <= end) {
+		proto = ((struct vlan_ethhdr *)pkt)->h_vlan_encapsulated_proto;
+		l3 += 4;
+	}
+
+	if (proto == htons(ETH_P_IP) && l3 + sizeof(struct iphdr) <= end) {
+		struct iphdr *iph = (struct iphdr *)l3;
+
+		swap_halves64(&iph->saddr);
+		/* Only the first fragment carries the ports */
+		if (!(iph->frag_off & htons(0x1fff))) {
+			l4proto = iph->protocol;
+			l4 = l3 + iph->ihl * 4;
+		}
+	} else if (proto == htons(ETH_P_IPV6) && l3 + 40 <= end) {
+		u8 tmp[16];
+
+		memcpy(tmp, l3 + 8, 16);
+		memcpy(l3 + 8, l3 + 24, 16);
+		memcpy(l3 + 24, tmp, 16);
+		l4proto = l3[6];
+		l4 = l3 + 40;
+	}
+
+	if ((l4proto == IPPROTO_UDP || l4proto == IPPROTO_TCP) && l4 + 4 <= end)
+		swap_halves32(l4);
+}
+
+static void hex_dump(void *pkt, size_t length, u64 addr)
+{
+	const unsigned char *address = (unsigned char *)pkt;
+	const unsigned char *line = address;
+	size_t line_size = 32;
+	unsigned char c;
+	char buf[32];
+	int i = 0;
+
+	if (!DEBUG_HEXDUMP)
+		return;
+
+	sprintf(buf, "addr=%llu", addr);
+	printf("length = %zu\n", length);
+	printf("%s | ", buf);
+	while (length-- > 0) {
+		printf("%02X ", *address++);
+		if (!(++i % line_size) || (length == 0 && i % line_size)) {
+			if (length == 0) {
+				while (i++ % line_size)
+					printf("__ ");
+			}
+			printf(" | ");	/* right close */
+			while (line < address) {
+				c = *line++;
+				printf("%c", (c < 33 || c == 255) ? 0x2E : c);
+			}
+			printf("\n");
+			if (length > 0)
+				printf("%s | ", buf);
+		}
+	}
+	printf("\n");
+}
+
+static void *memset32_htonl(void *dest, u32 val, u32 size)
+{
 	u32 *ptr = (u32 *)dest;
 	int i;
 
@@ -873,58 +2843,284 @@ csum_tcpudp_magic(__be32 saddr, __be32 daddr, __u32 len,
 	return csum_fold(csum_tcpudp_nofold(saddr, daddr, len, proto, sum));
 }
 
+/* One's complement sum kernels. Each returns the same folded 16 bit sum as
+ * do_csum(), summing 32 bit words into 64 bit lanes so carries can wait for
+ * the final fold. An odd address needs no special case: the sum only depends
+ * on the pairing of the bytes, which the unaligned loads keep.
+ */
+static inline u64 csum_tail(const unsigned char *buff, int len, u64 sum)
+{
+	u32 w;
+	u16 h;
+
+	for (; len >= 4; len -= 4, buff += 4) {
+		memcpy(&w, buff, 4);
+		sum += w;
+	}
+	if (len & 2) {
+		memcpy(&h, buff, 2);
+		sum += h;
+		buff += 2;
+	}
+	if (len & 1)
+		sum += *buff;
+	return sum;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.1")))
+static unsigned int csum_sse4(const unsigned char *buff, int len)
+{
+	__m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+	u64 lanes[2];
+	int i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buff + i));
+
+		acc0 = _mm_add_epi64(acc0, _mm_cvtepu32_epi64(v));
+		acc1 = _mm_add_epi64(acc1, _mm_cvtepu32_epi64(_mm_srli_si128(v, 8)));
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+
+	return from32to16(from64to32(csum_tail(buff + i, len - i, lanes[0] + lanes[1])));
+}
+
+__attribute__((target("avx2")))
+static unsigned int csum_avx2(const unsigned char *buff, int len)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+	u64 lanes[4];
+	int i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(buff + i));
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(buff + i + 32));
+
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+		acc2 = _mm256_add_epi64(acc2, _mm256_unpacklo_epi32(v1, zero));
+		acc3 = _mm256_add_epi64(acc3, _mm256_unpackhi_epi32(v1, zero));
+	}
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buff + i));
+
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+	}
+	acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1), _mm256_add_epi64(acc2, acc3));
+	_mm256_storeu_si256((__m256i *)lanes, acc0);
+
+	return from32to16(from64to32(csum_tail(buff + i, len - i,
+						lanes[0] + lanes[1] + lanes[2] + lanes[3])));
+}
+
+__attribute__((target("avx512f")))
+static unsigned int csum_avx512(const unsigned char *buff, int len)
+{
+	__m512i zero = _mm512_setzero_si512();
+	__m512i acc0 = zero, acc1 = zero;
+	int i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m512i v = _mm512_loadu_si512((const void *)(buff + i));
+
+		acc0 = _mm512_add_epi64(acc0, _mm512_unpacklo_epi32(v, zero));
+		acc1 = _mm512_add_epi64(acc1, _mm512_unpackhi_epi32(v, zero));
+	}
+
+	return from32to16(from64to32(csum_tail(buff + i, len - i,
+						_mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1)))));
+}
+#endif
+
+static const struct csum_kernel {
+	const char *name;
+	unsigned int (*sum)(const unsigned char *buff, int len);
+} csum_kernels[] = {
+	{ "scalar",	do_csum },
+#if defined(__x86_64__)
+	{ "sse4",	csum_sse4 },
+	{ "avx2",	csum_avx2 },
+	{ "avx512",	csum_avx512 },
+#endif
+};
+
+#define CSUM_KERNELS	(int)(sizeof(csum_kernels) / sizeof(csum_kernels[0]))
+
+static unsigned int (*csum_sum)(const unsigned char *buff, int len) = do_csum;
+
+static bool csum_kernel_supported(int k)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (!strcmp(csum_kernels[k].name, "sse4"))
+		return __builtin_cpu_supports("sse4.1");
+	if (!strcmp(csum_kernels[k].name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	if (!strcmp(csum_kernels[k].name, "avx512"))
+		return __builtin_cpu_supports("avx512f");
+#endif
+	return true;
+}
+
+/* The widest kernel the CPU has, or --csum */
+static void csum_init(void)
+{
+	int k;
+
+	for (k = CSUM_KERNELS - 1; k > 0; k--) {
+		if (opt_csum_kernel && strcmp(opt_csum_kernel, csum_kernels[k].name))
+			continue;
+		if (csum_kernel_supported(k))
+			break;
+	}
+
+	if (opt_csum_kernel && strcmp(opt_csum_kernel, csum_kernels[k].name)) {
+		fprintf(stderr, "ERROR: Checksum kernel %s is not available\n", opt_csum_kernel);
+		exit(EXIT_FAILURE);
+	}
+	csum_sum = csum_kernels[k].sum;
+}
+
 static inline u16 udp_csum(u32 saddr, u32 daddr, u32 len,
 			   u8 proto, u16 *udp_pkt)
 {
-	u32 csum = 0;
-	u32 cnt = 0;
-
 	/* udp hdr and data */
-	for (; cnt < len; cnt += 2)
-		csum += udp_pkt[cnt >> 1];
+	return csum_tcpudp_magic(saddr, daddr, len, proto,
+				 csum_sum((const unsigned char *)udp_pkt, len));
+}
 
-	return csum_tcpudp_magic(saddr, daddr, len, proto, csum);
+/* RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m') */
+static inline u16 csum_replace2(u16 check, u16 old, u16 new)
+{
+	u32 sum = (u16)~check + (u16)~old + new;
+
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
 }
 
 #define ETH_FCS_SIZE 4
 
+#define VXLAN_PORT		4789
+#define GTPU_PORT		2152
+#define GRE_KEY_PRESENT		0x2000
+#define GTPU_FLAGS		0x30	/* Version 1, protocol type GTP */
+#define GTPU_TYPE_GPDU		0xff
+
+/* Outer IPv4 plus tunnel headers in front of the inner IPv4/UDP: VXLAN
+ * carries an inner Ethernet header, GRE (with key) and GTP-U carry IP.
+ */
+#define ENCAP_HDR_SIZE (opt_encap == ENCAP_VXLAN ? sizeof(struct iphdr) + 8 + 8 + ETH_HLEN : \
+			opt_encap == ENCAP_GRE ? sizeof(struct iphdr) + 8 : \
+			opt_encap == ENCAP_GTPU ? sizeof(struct iphdr) + 8 + 8 : 0)
+
 #define ETH_HDR_SIZE (opt_vlan_tag ? sizeof(struct vlan_ethhdr) : \
 		      sizeof(struct ethhdr))
 #define PKTGEN_HDR_SIZE (opt_tstamp ? sizeof(struct pktgen_hdr) : 0)
-#define PKT_HDR_SIZE (ETH_HDR_SIZE + sizeof(struct iphdr) + \
+#define PKT_HDR_SIZE (ETH_HDR_SIZE + ENCAP_HDR_SIZE + sizeof(struct iphdr) + \
 		      sizeof(struct udphdr) + PKTGEN_HDR_SIZE)
-#define PKTGEN_HDR_OFFSET (ETH_HDR_SIZE + sizeof(struct iphdr) + \
+#define PKTGEN_HDR_OFFSET (ETH_HDR_SIZE + ENCAP_HDR_SIZE + sizeof(struct iphdr) + \
 			   sizeof(struct udphdr))
 #define PKTGEN_SIZE_MIN (PKTGEN_HDR_OFFSET + sizeof(struct pktgen_hdr) + \
 			 ETH_FCS_SIZE)
 
 #define PKT_SIZE		(opt_pkt_size - ETH_FCS_SIZE)
-#define IP_PKT_SIZE		(PKT_SIZE - ETH_HDR_SIZE)
-#define UDP_PKT_SIZE		(IP_PKT_SIZE - sizeof(struct iphdr))
-#define UDP_PKT_DATA_SIZE	(UDP_PKT_SIZE - \
-				 (sizeof(struct udphdr) + PKTGEN_HDR_SIZE))
 
 static u8 pkt_data[XSK_UMEM__DEFAULT_FRAME_SIZE];
 
-static void gen_eth_hdr_data(void)
+/* Outer UDP source port of a flow, from its inner tuple like a tunnel
+ * endpoint would (RFC 7348 section 5), so outer RSS spreads the flows.
+ */
+static inline u16 encap_sport(const struct tx_flow *flow)
+{
+	u32 h = flow->saddr * 0x9e3779b1;
+
+	h = (h ^ flow->daddr) * 0x9e3779b1;
+	h = (h ^ ((u32)flow->sport << 16 | flow->dport)) * 0x9e3779b1;
+	return 49152 + (h >> 18);
+}
+
+/* Outer IPv4 and tunnel headers, in front of an inner packet of inner_len
+ * bytes from its IP header on.
+ */
+static void gen_encap_hdr(u8 *outer, const struct tx_flow *flow, u32 inner_len)
+{
+	struct iphdr *ip_hdr = (struct iphdr *)outer;
+	struct udphdr *udp_hdr = (struct udphdr *)(ip_hdr + 1);
+	u8 *tun = (u8 *)(udp_hdr + 1);
+	u32 tot_len = inner_len + ENCAP_HDR_SIZE;
+
+	ip_hdr->version = IPVERSION;
+	ip_hdr->ihl = 0x5;
+	ip_hdr->tos = 0x0;
+	ip_hdr->tot_len = htons(tot_len);
+	ip_hdr->id = 0;
+	ip_hdr->frag_off = 0;
+	ip_hdr->ttl = IPDEFTTL;
+	ip_hdr->protocol = opt_encap == ENCAP_GRE ? IPPROTO_GRE : IPPROTO_UDP;
+	ip_hdr->saddr = htonl(opt_encap_sip);
+	ip_hdr->daddr = htonl(opt_encap_dip);
+	ip_hdr->check = 0;
+	ip_hdr->check = ip_fast_csum((const void *)ip_hdr, ip_hdr->ihl);
+
+	switch (opt_encap) {
+	case ENCAP_GRE: {
+		u8 *gre = (u8 *)(ip_hdr + 1);
+
+		*(u16 *)gre = htons(GRE_KEY_PRESENT);
+		*(u16 *)(gre + 2) = htons(ETH_P_IP);
+		*(u32 *)(gre + 4) = htonl(opt_tunnel_id);
+		return;
+	}
+	case ENCAP_VXLAN: {
+		struct ethhdr *eth_hdr = (struct ethhdr *)(tun + 8);
+
+		/* I flag, then the VNI in the upper 24 bits of the second word */
+		*(u32 *)tun = htonl(0x08000000);
+		*(u32 *)(tun + 4) = htonl(opt_tunnel_id << 8);
+		memcpy(eth_hdr->h_dest, &opt_txdmac, ETH_ALEN);
+		memcpy(eth_hdr->h_source, &opt_txsmac, ETH_ALEN);
+		eth_hdr->h_proto = htons(ETH_P_IP);
+		udp_hdr->dest = htons(VXLAN_PORT);
+		break;
+	}
+	case ENCAP_GTPU:
+		/* Length counts what follows the mandatory 8 byte header */
+		tun[0] = GTPU_FLAGS;
+		tun[1] = GTPU_TYPE_GPDU;
+		*(u16 *)(tun + 2) = htons(inner_len);
+		*(u32 *)(tun + 4) = htonl(opt_tunnel_id);
+		udp_hdr->dest = htons(GTPU_PORT);
+		break;
+	default:
+		return;
+	}
+
+	/* A zero outer UDP checksum is allowed over IPv4 for both tunnels */
+	udp_hdr->source = htons(encap_sport(flow));
+	udp_hdr->len = htons(tot_len - sizeof(*ip_hdr));
+	udp_hdr->check = 0;
+}
+
+/* Build a complete frame of the given size (including FCS, like -s) for
+ * a flow.
+ */
+static void gen_eth_hdr(u8 *pkt, const struct tx_flow *flow, u16 size)
 {
+	u32 ip_pkt_size = size - ETH_FCS_SIZE - ETH_HDR_SIZE - ENCAP_HDR_SIZE;
+	u32 udp_pkt_size = ip_pkt_size - sizeof(struct iphdr);
+	u32 udp_pkt_data_size = udp_pkt_size - (sizeof(struct udphdr) + PKTGEN_HDR_SIZE);
 	struct pktgen_hdr *pktgen_hdr;
 	struct udphdr *udp_hdr;
 	struct iphdr *ip_hdr;
 
 	if (opt_vlan_tag) {
-		struct vlan_ethhdr *veth_hdr = (struct vlan_ethhdr *)pkt_data;
+		struct vlan_ethhdr *veth_hdr = (struct vlan_ethhdr *)pkt;
 		u16 vlan_tci = 0;
 
-		udp_hdr = (struct udphdr *)(pkt_data +
-					    sizeof(struct vlan_ethhdr) +
-					    sizeof(struct iphdr));
-		ip_hdr = (struct iphdr *)(pkt_data +
-					  sizeof(struct vlan_ethhdr));
-		pktgen_hdr = (struct pktgen_hdr *)(pkt_data +
-						   sizeof(struct vlan_ethhdr) +
-						   sizeof(struct iphdr) +
-						   sizeof(struct udphdr));
 		/* ethernet & VLAN header */
 		memcpy(veth_hdr->h_dest, &opt_txdmac, ETH_ALEN);
 		memcpy(veth_hdr->h_source, &opt_txsmac, ETH_ALEN);
@@ -934,694 +3130,4041 @@ static void gen_eth_hdr_data(void)
 		veth_hdr->h_vlan_TCI = htons(vlan_tci);
 		veth_hdr->h_vlan_encapsulated_proto = htons(ETH_P_IP);
 	} else {
-		struct ethhdr *eth_hdr = (struct ethhdr *)pkt_data;
-
-		udp_hdr = (struct udphdr *)(pkt_data +
-					    sizeof(struct ethhdr) +
-					    sizeof(struct iphdr));
-		ip_hdr = (struct iphdr *)(pkt_data +
-					  sizeof(struct ethhdr));
-		pktgen_hdr = (struct pktgen_hdr *)(pkt_data +
-						   sizeof(struct ethhdr) +
-						   sizeof(struct iphdr) +
-						   sizeof(struct udphdr));
+		struct ethhdr *eth_hdr = (struct ethhdr *)pkt;
+
 		/* ethernet header */
 		memcpy(eth_hdr->h_dest, &opt_txdmac, ETH_ALEN);
 		memcpy(eth_hdr->h_source, &opt_txsmac, ETH_ALEN);
 		eth_hdr->h_proto = htons(ETH_P_IP);
 	}
 
+	/* Inner packet, after any tunnel headers */
+	ip_hdr = (struct iphdr *)(pkt + ETH_HDR_SIZE + ENCAP_HDR_SIZE);
+	udp_hdr = (struct udphdr *)(ip_hdr + 1);
+	pktgen_hdr = (struct pktgen_hdr *)(udp_hdr + 1);
+	if (opt_encap)
+		gen_encap_hdr(pkt + ETH_HDR_SIZE, flow, ip_pkt_size);
 
 	/* IP header */
 	ip_hdr->version = IPVERSION;
 	ip_hdr->ihl = 0x5; /* 20 byte header */
 	ip_hdr->tos = 0x0;
-	ip_hdr->tot_len = htons(IP_PKT_SIZE);
+	ip_hdr->tot_len = htons(ip_pkt_size);
 	ip_hdr->id = 0;
 	ip_hdr->frag_off = 0;
 	ip_hdr->ttl = IPDEFTTL;
 	ip_hdr->protocol = IPPROTO_UDP;
-	ip_hdr->saddr = htonl(0x0a0a0a10);
-	ip_hdr->daddr = htonl(0x0a0a0a20);
+	ip_hdr->saddr = htonl(flow->saddr);
+	ip_hdr->daddr = htonl(flow->daddr);
 
 	/* IP header checksum */
 	ip_hdr->check = 0;
 	ip_hdr->check = ip_fast_csum((const void *)ip_hdr, ip_hdr->ihl);
 
 	/* UDP header */
-	udp_hdr->source = htons(0x1000);
-	udp_hdr->dest = htons(0x1000);
-	udp_hdr->len = htons(UDP_PKT_SIZE);
+	udp_hdr->source = htons(flow->sport);
+	udp_hdr->dest = htons(flow->dport);
+	udp_hdr->len = htons(udp_pkt_size);
 
 	if (opt_tstamp)
 		pktgen_hdr->pgh_magic = htonl(PKTGEN_MAGIC);
 
 	/* UDP data */
-	memset32_htonl(pkt_data + PKT_HDR_SIZE, opt_pkt_fill_pattern,
-		       UDP_PKT_DATA_SIZE);
+	memset32_htonl(pkt + PKT_HDR_SIZE, opt_pkt_fill_pattern,
+		       udp_pkt_data_size);
 
 	/* UDP header checksum */
 	udp_hdr->check = 0;
-	udp_hdr->check = udp_csum(ip_hdr->saddr, ip_hdr->daddr, UDP_PKT_SIZE,
+	udp_hdr->check = udp_csum(ip_hdr->saddr, ip_hdr->daddr, udp_pkt_size,
 				  IPPROTO_UDP, (u16 *)udp_hdr);
 }
 
+static void gen_eth_hdr_data(void)
+{
+	gen_eth_hdr(pkt_data, &tx_flows[0], opt_pkt_size);
+}
+
 static void gen_eth_frame(struct xsk_umem_info *umem, u64 addr)
 {
 	memcpy(xsk_umem__get_data(umem->buffer, addr), pkt_data,
 	       PKT_SIZE);
 }
 
-static struct xsk_umem_info *xsk_configure_umem(void *buffer, u64 size)
+/* xorshift64*, good enough for picking flows and deterministic across runs. */
+static u64 prng_state = 0x2545f4914f6cdd1dULL;
+
+static inline u64 prng_next(void)
 {
-	struct xsk_umem_info *umem;
-	struct xsk_umem_config cfg = {
-		/* We recommend that you set the fill ring size >= HW RX ring size +
-		 * AF_XDP RX ring size. Make sure you fill up the fill ring
-		 * with buffers at regular intervals, and you will with this setting
-		 * avoid allocation failures in the driver. These are usually quite
-		 * expensive since drivers have not been written to assume that
-		 * allocation failures are common. For regular sockets, kernel
-		 * allocated memory is used that only runs out in OOM situations
-		 * that should be rare.
-		 */
-		.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS * 2,
-		.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
-		.frame_size = opt_xsk_frame_size,
-		.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
-		.flags = opt_umem_flags
-	};
-	int ret;
+	prng_state ^= prng_state >> 12;
+	prng_state ^= prng_state << 25;
+	prng_state ^= prng_state >> 27;
+	return prng_state * 0x2545f4914f6cdd1dULL;
+}
 
-	umem = calloc(1, sizeof(*umem));
-	if (!umem)
-		exit_with_error(errno);
+/* Uniform in [0, 1) */
+static inline double prng_double(void)
+{
+	return (prng_next() >> 11) * (1.0 / (1ULL << 53));
+}
 
-	ret = xsk_umem__create(&umem->umem, buffer, size, &umem->fq, &umem->cq,
-			       &cfg);
-	if (ret)
-		exit_with_error(-ret);
+#define CSUM_BENCH_MAX		9216
 
-	umem->buffer = buffer;
-	return umem;
+/* --csum-bench: check every kernel the CPU has against do_csum() on random
+ * lengths and misalignments, then time them over 20 byte to 9 KB buffers.
+ */
+static void csum_bench(void)
+{
+	static const int sizes[] = { 20, 64, 128, 256, 576, 1500, 4096, 9000 };
+	volatile unsigned int sink = 0;
+	unsigned long bad = 0, kbad, start, ns;
+	u8 *buf;
+	int k, i, n;
+
+	buf = aligned_alloc(64, CSUM_BENCH_MAX + 64);
+	if (!buf)
+		exit_with_error(ENOMEM);
+
+	for (k = 0; k < CSUM_KERNELS; k++) {
+		if (!csum_kernel_supported(k))
+			continue;
+
+		kbad = 0;
+		for (i = 0; i < 200000; i++) {
+			int off = prng_next() % 64, len = prng_next() % (CSUM_BENCH_MAX + 1);
+
+			/* All ones every so often, for the worst case carries */
+			if (!(i & 0x3ff))
+				memset(buf, 0xff, CSUM_BENCH_MAX + 64);
+			else if (!(i & 0x3f))
+				for (n = 0; n < CSUM_BENCH_MAX + 64; n++)
+					buf[n] = prng_next();
+
+			if (csum_kernels[k].sum(buf + off, len) != do_csum(buf + off, len))
+				kbad++;
+		}
+		printf("%-8s %lu mismatches\n", csum_kernels[k].name, kbad);
+		bad += kbad;
+	}
+
+	for (n = 0; n < CSUM_BENCH_MAX + 64; n++)
+		buf[n] = prng_next();
+
+	printf("\n%-8s", "bytes");
+	for (k = 0; k < CSUM_KERNELS; k++)
+		if (csum_kernel_supported(k))
+			printf(" %12s", csum_kernels[k].name);
+	printf("   (ns per call / GB/s)\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int iters = 200000000 / (sizes[i] + 64);
+
+		printf("%-8d", sizes[i]);
+		for (k = 0; k < CSUM_KERNELS; k++) {
+			if (!csum_kernel_supported(k))
+				continue;
+
+			start = get_nsecs();
+			for (n = 0; n < iters; n++)
+				sink += csum_kernels[k].sum(buf + (n & 1), sizes[i]);
+			ns = get_nsecs() - start;
+			printf(" %6.1f/%5.1f", (double)ns / iters, (double)sizes[i] * iters / ns);
+		}
+		printf("\n");
+	}
+
+	free(buf);
+	exit(bad ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
-static void xsk_populate_fill_ring(struct xsk_umem_info *umem, struct xsk_socket_info *xsk)
+static void pkt_layout_parse(const u8 *pkt, u32 len, struct pkt_layout *l)
 {
-	int ret, i;
-	u32 idx;
+	u16 off = ETH_HLEN, proto;
+	u8 l4_proto = 0;
 
-#ifdef MULTI_FCQ
-	if (umem == NULL || xsk == NULL)
-		exit_with_error(-EINVAL);
+	memset(l, 0, sizeof(*l));
+	if (len < ETH_HLEN)
+		return;
 
-	fprintf(stdout, "Filling multi-FCQ XSK[%u] from umem_offset:%llu\n",
-		xsk->xsk_index, xsk->umem_offset);
+	proto = pkt[12] << 8 | pkt[13];
+	while ((proto == ETH_P_8021Q || proto == ETH_P_8021AD) && off + VLAN_HLEN <= len) {
+		if (!l->vlan)
+			l->vlan = off;
+		proto = pkt[off + 2] << 8 | pkt[off + 3];
+		off += VLAN_HLEN;
+	}
 
-	/* Multi FCQ mode, we fill the xsk->fq. */
-	struct xsk_ring_prod *fq_ptr = &xsk->fq;
+	if (proto == ETH_P_IP && off + sizeof(struct iphdr) <= len) {
+		l->l3 = off;
+		l->l3_end = off + (pkt[off] & 0xf) * 4;
+		l->ip_csum = off + 10;
+		l->pseudo[0] = off + 12;
+		l->pseudo[1] = off + 20;
+		/* Non-first fragments have no L4 header */
+		if (!((pkt[off + 6] << 8 | pkt[off + 7]) & 0x1fff)) {
+			l4_proto = pkt[off + 9];
+			l->l4 = l->l3_end;
+		}
+	} else if (proto == ETH_P_IPV6 && off + 40 <= len) {
+		l->l3 = off;
+		l->ipv6 = true;
+		l->pseudo[0] = off + 8;
+		l->pseudo[1] = off + 40;
+		l4_proto = pkt[off + 6];
+		l->l4 = off + 40;
+	}
 
-	/* In a multi-FCQ setup, umem size is multiplied by the number of XSK sockets we have. That
-	 * means our umem offset for each descriptor is not uniform - and is different on a per-FQ/CQ
-	 * basis. */
-	int offset = xsk->umem_offset;
+	if (l4_proto == IPPROTO_UDP && l->l4 + 8 <= len) {
+		l->udp = true;
+		l->l4_csum = l->l4 + 6;
+		/* A zero UDP checksum over IPv4 means none, leave it so */
+		if (!l->ipv6 && !pkt[l->l4_csum] && !pkt[l->l4_csum + 1])
+			l->l4_csum = 0;
+	} else if (l4_proto == IPPROTO_TCP && l->l4 + 20 <= len) {
+		l->l4_csum = l->l4 + 16;
+	} else {
+		l->l4 = 0;
+	}
+}
 
-#else
-	if (umem == NULL || xsk != NULL)
-		exit_with_error(-EINVAL);
+/* Write the bits of a field and patch the IPv4 header and L4 checksums for
+ * every 16 bit word that changed, per RFC 1624, rather than summing the frame
+ * again.
+ */
+static void pkt_field_write(u8 *pkt, const struct pkt_layout *l, u16 off, u8 width,
+			    u32 mask, u8 shift, u32 val)
+{
+	u16 lo = off & ~1, hi = (off + width + 1) & ~1;
+	u16 old[3], new, w;
+	u32 cur = 0;
+	int i;
 
-	fprintf(stdout, "Filling single-FCQ XSK\n");
-	
-	/* Single MCQ mode, so we fill the umem->fq. */
-	struct xsk_ring_prod *fq_ptr = &umem->fq;
+	memcpy(old, pkt + lo, hi - lo);
 
-	/* Single MCQ mode, no per-xsk offset needed. */
-	int offset = 0;
+	for (i = 0; i < width; i++)
+		cur = cur << 8 | pkt[off + i];
+	cur = (cur & ~mask) | ((val << shift) & mask);
+	for (i = width - 1; i >= 0; i--, cur >>= 8)
+		pkt[off + i] = cur;
 
-#endif /* MULTI_FCQ */
+	for (w = lo; w < hi; w += 2) {
+		u16 check;
 
-	ret = xsk_ring_prod__reserve(fq_ptr,
-				     XSK_RING_PROD__DEFAULT_NUM_DESCS * 2, &idx);
-	if (ret != XSK_RING_PROD__DEFAULT_NUM_DESCS * 2)
-		exit_with_error(-ret);
-	for (i = 0; i < XSK_RING_PROD__DEFAULT_NUM_DESCS * 2; i++)
-		*xsk_ring_prod__fill_addr(fq_ptr, idx++) =
-			offset + (i * opt_xsk_frame_size);
-	xsk_ring_prod__submit(fq_ptr, XSK_RING_PROD__DEFAULT_NUM_DESCS * 2);
+		memcpy(&new, pkt + w, 2);
+		if (new == old[(w - lo) / 2])
+			continue;
+
+		if (l->ip_csum && w >= l->l3 && w < l->l3_end && w != l->ip_csum) {
+			memcpy(&check, pkt + l->ip_csum, 2);
+			check = csum_replace2(check, old[(w - lo) / 2], new);
+			memcpy(pkt + l->ip_csum, &check, 2);
+		}
+
+		if (l->l4_csum && w != l->l4_csum &&
+		    ((w >= l->pseudo[0] && w < l->pseudo[1]) || w >= l->l4)) {
+			memcpy(&check, pkt + l->l4_csum, 2);
+			check = csum_replace2(check, old[(w - lo) / 2], new);
+			/* RFC 768: a computed zero is sent as all ones */
+			if (l->udp && !check)
+				check = 0xffff;
+			memcpy(pkt + l->l4_csum, &check, 2);
+		}
+	}
 }
 
-/* Original xsk_configure_socket() always binds to the same Channel ID, which is not multi-core.
- *
- * Revised API includes an xsk_index, so we can apply this as an offset from Channel ID,
- * allowing us to bind one XSK socket to each Channel. This also means we can support zero
- * copy queue offset via --queue=n, n being the offset.
+static const struct mutator_field_def {
+	const char *name;
+	u8 width;
+	u32 mask;
+	u8 shift;
+} mutator_fields[MUT_FIELD_NUM] = {
+	[MUT_FIELD_SIP]		= { "sip",	4, 0xffffffff,	0 },
+	[MUT_FIELD_DIP]		= { "dip",	4, 0xffffffff,	0 },
+	[MUT_FIELD_SPORT]	= { "sport",	2, 0xffff,	0 },
+	[MUT_FIELD_DPORT]	= { "dport",	2, 0xffff,	0 },
+	[MUT_FIELD_VLAN]	= { "vlan",	2, VLAN_VID_MASK, 0 },
+	[MUT_FIELD_PCP]		= { "pcp",	2, VLAN_PRIO_MASK, VLAN_PRIO_SHIFT },
+	[MUT_FIELD_DSCP]	= { "dscp",	1, 0xfc,	2 },
+	[MUT_FIELD_TTL]		= { "ttl",	1, 0xff,	0 },
+	[MUT_FIELD_IPID]	= { "ipid",	2, 0xffff,	0 },
+};
+
+/* Place named fields in the template. IPv6 addresses are mutated in their
+ * low 32 bits, and its DSCP straddles the first two bytes.
  */
-static struct xsk_socket_info *xsk_configure_socket(struct xsk_umem_info *umem,
-						    bool rx, bool tx, int xsk_index)
+static void mutators_resolve(const struct pkt_layout *l)
 {
-	struct xsk_socket_config cfg;
-	struct xsk_socket_info *xsk;
-	struct xsk_ring_cons *rxr;
-	struct xsk_ring_prod *txr;
-	int ret;
+	int i;
 
-	xsk = calloc(1, sizeof(*xsk));
-	if (!xsk)
-		exit_with_error(errno);
+	for (i = 0; i < opt_num_mutators; i++) {
+		struct tx_mutator *m = &opt_mutators[i];
+		const struct mutator_field_def *def = &mutator_fields[m->field];
+		int off = -1;
 
-	xsk->umem = umem;
-	cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
-	cfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+		if (m->field == MUT_FIELD_RAW)
+			continue;
 
-#ifdef MULTI_FCQ
+		m->width = def->width;
+		m->mask = def->mask;
+		m->shift = def->shift;
 
-	/* We don't want to use dispatcher - we always want to load our kernel. */
-	cfg.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
+		switch (m->field) {
+		case MUT_FIELD_SIP:
+			if (l->l3)
+				off = l->l3 + (l->ipv6 ? 20 : 12);
+			break;
+		case MUT_FIELD_DIP:
+			if (l->l3)
+				off = l->l3 + (l->ipv6 ? 36 : 16);
+			break;
+		case MUT_FIELD_SPORT:
+			if (l->l4)
+				off = l->l4;
+			break;
+		case MUT_FIELD_DPORT:
+			if (l->l4)
+				off = l->l4 + 2;
+			break;
+		case MUT_FIELD_VLAN:
+		case MUT_FIELD_PCP:
+			if (l->vlan)
+				off = l->vlan;
+			break;
+		case MUT_FIELD_DSCP:
+			if (l->l3 && l->ipv6) {
+				off = l->l3;
+				m->width = 2;
+				m->mask = 0x0fc0;
+				m->shift = 6;
+			} else if (l->l3) {
+				off = l->l3 + 1;
+			}
+			break;
+		case MUT_FIELD_TTL:
+			if (l->l3)
+				off = l->l3 + (l->ipv6 ? 7 : 8);
+			break;
+		case MUT_FIELD_IPID:
+			if (l->l3 && !l->ipv6)
+				off = l->l3 + 4;
+			break;
+		default:
+			break;
+		}
 
-#else
+		if (off < 0) {
+			fprintf(stderr, "ERROR: TX template has no %s field\n", def->name);
+			exit(EXIT_FAILURE);
+		}
+		m->off = off;
+	}
+}
 
-	/* Original code */
-	if (opt_num_xsks > 1 || opt_reduced_cap)
-		cfg.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
-	else
-		cfg.libbpf_flags = 0;
+static inline u32 mutator_value(const struct tx_mutator *m, u64 seq)
+{
+	u64 span = (u64)m->max - m->min + 1;
+
+	switch (m->kind) {
+	case MUT_RAND:
+		return m->min + prng_next() % span;
+	case MUT_LIST:
+		return m->list[seq % m->nlist];
+	default:
+		return m->min + (seq * m->step) % span;
+	}
+}
 
-#endif /* MULTI_FCQ */
+/* Apply every --mutate to a frame about to be sent. Increments all advance
+ * with the one sequence, so co-prime ranges walk their full cross product.
+ */
+static inline void tx_mutate(u8 *pkt, u32 len)
+{
+	u64 seq = tx_mut_seq++;
+	int i;
 
-	cfg.xdp_flags = opt_xdp_flags;
-	cfg.bind_flags = opt_xdp_bind_flags;
+	for (i = 0; i < opt_num_mutators; i++) {
+		const struct tx_mutator *m = &opt_mutators[i];
 
-	rxr = rx ? &xsk->rx : NULL;
-	txr = tx ? &xsk->tx : NULL;
+		if (m->off + m->width <= len)
+			pkt_field_write(pkt, &tx_layout, m->off, m->width, m->mask,
+					m->shift, mutator_value(m, seq));
+	}
+}
 
-	/* Save our position in xsks array and map. */
-	xsk->xsk_index = xsk_index;
+/* --template: hex byte pairs (any separators, '#' comments) or the first packet
+ * of an Ethernet pcap. IPv4 checksums are fixed up once here, frames after
+ * that are only patched.
+ */
+static void tmpl_load(const char *path)
+{
+	const struct pcap_file_hdr *fh;
+	struct stat st;
+	u8 *data, *pkt;
+	u32 len = 0, i;
+	int fd, hi = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "ERROR: Can't open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 
-#ifdef MULTI_FCQ
+	data = malloc(st.st_size + 1);
+	pkt = malloc(opt_xsk_frame_size + 1);
+	if (!data || !pkt)
+		exit_with_error(ENOMEM);
+	if (read(fd, data, st.st_size) != st.st_size) {
+		fprintf(stderr, "ERROR: Can't read %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	fh = (const struct pcap_file_hdr *)data;
+	if (st.st_size >= sizeof(*fh) + sizeof(struct pcap_rec_hdr) &&
+	    (fh->magic == PCAP_MAGIC_USEC || fh->magic == PCAP_MAGIC_NSEC ||
+	     fh->magic == bswap_32(PCAP_MAGIC_USEC) || fh->magic == bswap_32(PCAP_MAGIC_NSEC))) {
+		const struct pcap_rec_hdr *rh = (const void *)(data + sizeof(*fh));
+		bool swapped = fh->magic != PCAP_MAGIC_USEC && fh->magic != PCAP_MAGIC_NSEC;
+
+		len = swapped ? bswap_32(rh->caplen) : rh->caplen;
+		if ((swapped ? bswap_32(fh->linktype) : fh->linktype) != PCAP_LINKTYPE_ETHERNET ||
+		    sizeof(*fh) + sizeof(*rh) + len > st.st_size || len > opt_xsk_frame_size) {
+			fprintf(stderr, "ERROR: No usable Ethernet packet in %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		memcpy(pkt, rh + 1, len);
+	} else {
+		data[st.st_size] = '\0';
+		for (i = 0; i < st.st_size; i++) {
+			int c = data[i], v;
 
-	/* In a multi-FCQ setup we need to store a umem offset, telling us where the umem descriptors
-	 * for this XSK are. This is so each channel does not hit the same memory space.
-	 *
-	 * Logic here is xsk[0] gets the first batch of descriptors, xsk[1] gets the next batch,
-	 * and so on. */
+			if (c == '#') {
+				while (i < st.st_size && data[i] != '\n')
+					i++;
+				continue;
+			}
+			if (c >= '0' && c <= '9')
+				v = c - '0';
+			else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+				v = (c | 0x20) - 'a' + 10;
+			else
+				continue;
 
-	xsk->umem_offset = xsk_index * (NUM_FRAMES * opt_xsk_frame_size);
+			if (hi < 0) {
+				hi = v;
+				continue;
+			}
+			if (len == opt_xsk_frame_size) {
+				fprintf(stderr, "ERROR: Template %s exceeds the frame size\n", path);
+				exit(EXIT_FAILURE);
+			}
+			pkt[len++] = hi << 4 | v;
+			hi = -1;
+		}
+	}
+	free(data);
 
-	/* In a multi-FCQ setup, we bind to multiple channel IDs, so we calculate this via the
-	 * queue number + the xsk index. Mellanox cards will need to have --queue=n for zero copy. */
+	if (len + ETH_FCS_SIZE < MIN_PKT_SIZE) {
+		fprintf(stderr, "ERROR: Template %s is shorter than %d bytes\n", path,
+			MIN_PKT_SIZE - ETH_FCS_SIZE);
+		exit(EXIT_FAILURE);
+	}
 
-	xsk->channel_id = opt_queue + xsk_index;
+	pkt_layout_parse(pkt, len, &tx_layout);
+	if (tx_layout.l3 && !tx_layout.ipv6) {
+		struct iphdr *iph = (struct iphdr *)(pkt + tx_layout.l3);
+		u32 l4_len = len - tx_layout.l4;
+
+		iph->check = 0;
+		iph->check = ip_fast_csum((const void *)iph, iph->ihl);
+		if (tx_layout.l4_csum) {
+			if (ntohs(iph->tot_len) - iph->ihl * 4 < l4_len)
+				l4_len = ntohs(iph->tot_len) - iph->ihl * 4;
+			memset(pkt + tx_layout.l4_csum, 0, 2);
+			*(u16 *)(pkt + tx_layout.l4_csum) =
+				udp_csum(iph->saddr, iph->daddr, l4_len, iph->protocol,
+					 (u16 *)(pkt + tx_layout.l4));
+			if (tx_layout.udp && !*(u16 *)(pkt + tx_layout.l4_csum))
+				*(u16 *)(pkt + tx_layout.l4_csum) = 0xffff;
+		}
+	}
 
-	/* In a multi-FCQ setup we use the xsk_socket__create_shared() API which lets us pass
-	 * in pointers to dedicated Fill/Completion queue per XSK. */
+	tmpl_data = pkt;
+	tmpl_len = len;
+	opt_pkt_size = len + ETH_FCS_SIZE;
+}
 
-	fprintf(stdout, "Opening multi-FCQ XSK[%u] to %s channel %u...\n",
-		xsk->xsk_index, opt_if, xsk->channel_id);
-	ret = xsk_socket__create_shared(&xsk->xsk, opt_if, xsk->channel_id, umem->umem,
-	 			rxr, txr, &xsk->fq, &xsk->cq, &cfg);
+/* Flow tuples are the flow index in mixed radix over the configured ranges,
+ * source port varying fastest, then destination port, source IP and
+ * destination IP.
+ */
+static void tx_flows_init(void)
+{
+	u64 nsport = opt_flow_sport[1] - opt_flow_sport[0] + 1;
+	u64 ndport = opt_flow_dport[1] - opt_flow_dport[0] + 1;
+	u64 nsip = (u64)opt_flow_sip[1] - opt_flow_sip[0] + 1;
+	u64 ndip = (u64)opt_flow_dip[1] - opt_flow_dip[0] + 1;
+	double distinct = (double)nsport * ndport * nsip * ndip;
+	u32 f;
+
+	tx_flows = calloc(opt_flow_count, sizeof(*tx_flows));
+	if (!tx_flows)
+		exit_with_error(errno);
 
-#else /* MULTI_FCQ */
+	for (f = 0; f < opt_flow_count; f++) {
+		u64 k = f;
 
-	/* In a single-FCQ setup we stick to the original design of xdpsock_user.c, and so our channel
-	 * ID will only ever be a single queue. */
+		tx_flows[f].sport = opt_flow_sport[0] + k % nsport;
+		k /= nsport;
+		tx_flows[f].dport = opt_flow_dport[0] + k % ndport;
+		k /= ndport;
+		tx_flows[f].saddr = opt_flow_sip[0] + k % nsip;
+		k /= nsip;
+		tx_flows[f].daddr = opt_flow_dip[0] + k % ndip;
+	}
 
-	xsk->channel_id = opt_queue;
-	
-	fprintf(stdout, "Opening single-FCQ XSK[%u] to %s channel %u...\n",
-		xsk->xsk_index, opt_if, opt_queue);
-	ret = xsk_socket__create(&xsk->xsk, opt_if, opt_queue, umem->umem,
-				 rxr, txr, &cfg);
+	if (distinct < opt_flow_count)
+		fprintf(stderr, "WARNING: %u flows requested but ranges only give %.0f distinct\n",
+			opt_flow_count, distinct);
+}
 
-#endif /* MULTI_FCQ */
+/* Pick the flow for each of the NUM_FRAMES TX frames, so the distribution is
+ * baked into UMEM up front and tx_only() only has to post descriptors.
+ */
+static void tx_flows_distribute(void)
+{
+	double *cdf = NULL, sum = 0.0;
+	u32 i, f;
 
-	if (ret)
-		exit_with_error(-ret);
+	if (opt_flow_dist == FLOW_DIST_ZIPF) {
+		cdf = calloc(opt_flow_count, sizeof(*cdf));
+		if (!cdf)
+			exit_with_error(errno);
+		for (f = 0; f < opt_flow_count; f++) {
+			sum += 1.0 / pow(f + 1, opt_flow_zipf_s);
+			cdf[f] = sum;
+		}
+	}
 
-	ret = bpf_xdp_query_id(opt_ifindex, opt_xdp_flags, &prog_id);
-	if (ret)
-		exit_with_error(-ret);
+	for (i = 0; i < NUM_FRAMES; i++) {
+		switch (opt_flow_dist) {
+		case FLOW_DIST_UNIFORM:
+			f = prng_next() % opt_flow_count;
+			break;
+		case FLOW_DIST_ZIPF: {
+			double u = prng_double() * sum;
+			u32 lo = 0, hi = opt_flow_count - 1;
 
-	xsk->app_stats.rx_empty_polls = 0;
-	xsk->app_stats.fill_fail_polls = 0;
-	xsk->app_stats.copy_tx_sendtos = 0;
-	xsk->app_stats.tx_wakeup_sendtos = 0;
-	xsk->app_stats.opt_polls = 0;
-	xsk->app_stats.prev_rx_empty_polls = 0;
-	xsk->app_stats.prev_fill_fail_polls = 0;
-	xsk->app_stats.prev_copy_tx_sendtos = 0;
-	xsk->app_stats.prev_tx_wakeup_sendtos = 0;
-	xsk->app_stats.prev_opt_polls = 0;
+			while (lo < hi) {
+				u32 mid = (lo + hi) / 2;
 
-	return xsk;
+				if (cdf[mid] <= u)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			f = lo;
+			break;
+		}
+		default:
+			f = i % opt_flow_count;
+		}
+		tx_frame_flow[i] = f;
+	}
+
+	free(cdf);
 }
 
-static struct option long_options[] = {
-	{"rxdrop", no_argument, 0, 'r'},
-	{"txonly", no_argument, 0, 't'},
-	{"l2fwd", no_argument, 0, 'l'},
-	{"interface", required_argument, 0, 'i'},
-	{"queue", required_argument, 0, 'q'},
-	{"poll", no_argument, 0, 'p'},
-	{"xdp-skb", no_argument, 0, 'S'},
-	{"xdp-native", no_argument, 0, 'N'},
-	{"interval", required_argument, 0, 'n'},
-	{"retries", required_argument, 0, 'O'},
-	{"zero-copy", no_argument, 0, 'z'},
-	{"copy", no_argument, 0, 'c'},
-	{"frame-size", required_argument, 0, 'f'},
-	{"no-need-wakeup", no_argument, 0, 'm'},
-	{"unaligned", no_argument, 0, 'u'},
-#ifdef MULTI_FCQ
-	{"channels", required_argument, 0, 'M'},
-#else
-	{"shared-umem", no_argument, 0, 'M'},
-#endif
-	{"force", no_argument, 0, 'F'},
-	{"duration", required_argument, 0, 'd'},
-	{"clock", required_argument, 0, 'w'},
-	{"batch-size", required_argument, 0, 'b'},
-	{"tx-pkt-count", required_argument, 0, 'C'},
-	{"tx-pkt-size", required_argument, 0, 's'},
-	{"tx-pkt-pattern", required_argument, 0, 'P'},
-	{"tx-vlan", no_argument, 0, 'V'},
-	{"tx-vlan-id", required_argument, 0, 'J'},
-	{"tx-vlan-pri", required_argument, 0, 'K'},
-	{"tx-dmac", required_argument, 0, 'G'},
-	{"tx-smac", required_argument, 0, 'H'},
-	{"tx-cycle", required_argument, 0, 'T'},
-	{"tstamp", no_argument, 0, 'y'},
-	{"policy", required_argument, 0, 'W'},
-	{"schpri", required_argument, 0, 'U'},
-	{"extra-stats", no_argument, 0, 'x'},
-	{"quiet", no_argument, 0, 'Q'},
-	{"app-stats", no_argument, 0, 'a'},
-	{"irq-string", no_argument, 0, 'I'},
-	{"busy-poll", no_argument, 0, 'B'},
-	{"reduce-cap", no_argument, 0, 'R'},
-	{0, 0, 0, 0}
-};
+static inline int size_bucket(u32 size)
+{
+	int b = 0;
 
-static void usage(const char *prog)
+	while (size > size_buckets[b].max)
+		b++;
+	return b;
+}
+
+/* Pick the size of each TX frame. List profiles are laid out with smooth
+ * weighted round robin, which hits the exact weights every cycle while
+ * interleaving the sizes rather than sending them in runs.
+ */
+static void tx_sizes_distribute(void)
+{
+	long cur[SIZE_LIST_MAX] = {}, total = 0;
+	u32 i;
+	int n;
+
+	for (n = 0; n < opt_num_sizes; n++)
+		total += opt_sizes[n].weight;
+
+	for (i = 0; i < NUM_FRAMES; i++) {
+		u32 size = opt_pkt_size;
+
+		if (opt_size_profile == SIZE_PROFILE_RANGE) {
+			size = opt_size_range[0] +
+			       prng_next() % (opt_size_range[1] - opt_size_range[0] + 1);
+		} else if (opt_size_profile != SIZE_PROFILE_FIXED) {
+			int best = 0;
+
+			for (n = 0; n < opt_num_sizes; n++) {
+				cur[n] += opt_sizes[n].weight;
+				if (cur[n] > cur[best])
+					best = n;
+			}
+			cur[best] -= total;
+			size = opt_sizes[best].size;
+		}
+
+		tx_frame_size[i] = size;
+		tx_frame_bucket[i] = size_bucket(size);
+	}
+}
+
+/* UMEM frames a socket may transmit from without aliasing another socket: its
+ * own partition with Multi-FCQ, an equal slice of the shared one otherwise.
+ */
+static void xsk_tx_area(const struct xsk_socket_info *xsk, u64 *base, u32 *nframes)
 {
-	const char *str =
-		"  Usage: %s [OPTIONS]\n"
-		"  Options:\n"
-		"  -r, --rxdrop		Discard all incoming packets (default)\n"
-		"  -t, --txonly		Only send packets\n"
-		"  -l, --l2fwd		MAC swap L2 forwarding\n"
-		"  -i, --interface=n	Run on interface n\n"
-#ifdef MULTI_FCQ
-		"  -q, --queue=n	Start at queue n (default 0), this can be used for ZC queue offsets (looking at you mlx...)\n"
-#else
-		"  -q, --queue=n	Use queue n (default 0)\n"
-#endif
-		"  -p, --poll		Use poll syscall\n"
-		"  -S, --xdp-skb=n	Use XDP skb-mod\n"
-		"  -N, --xdp-native=n	Enforce XDP native mode\n"
-		"  -n, --interval=n	Specify statistics update interval (default 1 sec).\n"
-		"  -O, --retries=n	Specify time-out retries (1s interval) attempt (default 3).\n"
-		"  -z, --zero-copy      Force zero-copy mode.\n"
-		"  -c, --copy           Force copy mode.\n"
-		"  -m, --no-need-wakeup Turn off use of driver need wakeup flag.\n"
-		"  -f, --frame-size=n   Set the frame size (must be a power of two in aligned mode, default is %d).\n"
-		"  -u, --unaligned	Enable unaligned chunk placement\n"
-#ifdef MULTI_FCQ
-		"  -M, --channels=n		Open n number of channels. Also enables XDP_SHARED_UMEM (cannot be used with -R).\n"
-#else
-		"  -M, --shared-umem	Enable XDP_SHARED_UMEM (cannot be used with -R)\n"
-#endif
-		"  -F, --force		Force loading the XDP prog\n"
-		"  -d, --duration=n	Duration in secs to run command.\n"
-		"			Default: forever.\n"
-		"  -w, --clock=CLOCK	Clock NAME (default MONOTONIC).\n"
-		"  -b, --batch-size=n	Batch size for sending or receiving\n"
-		"			packets. Default: %d\n"
-		"  -C, --tx-pkt-count=n	Number of packets to send.\n"
-		"			Default: Continuous packets.\n"
-		"  -s, --tx-pkt-size=n	Transmit packet size.\n"
-		"			(Default: %d bytes)\n"
-		"			Min size: %d, Max size %d.\n"
-		"  -P, --tx-pkt-pattern=nPacket fill pattern. Default: 0x%x\n"
-		"  -V, --tx-vlan        Send VLAN tagged  packets (For -t|--txonly)\n"
-		"  -J, --tx-vlan-id=n   Tx VLAN ID [1-4095]. Default: %d (For -V|--tx-vlan)\n"
-		"  -K, --tx-vlan-pri=n  Tx VLAN Priority [0-7]. Default: %d (For -V|--tx-vlan)\n"
-		"  -G, --tx-dmac=<MAC>  Dest MAC addr of TX frame in aa:bb:cc:dd:ee:ff format (For -V|--tx-vlan)\n"
-		"  -H, --tx-smac=<MAC>  Src MAC addr of TX frame in aa:bb:cc:dd:ee:ff format (For -V|--tx-vlan)\n"
-		"  -T, --tx-cycle=n     Tx cycle time in micro-seconds (For -t|--txonly).\n"
-		"  -y, --tstamp         Add time-stamp to packet (For -t|--txonly).\n"
-		"  -W, --policy=POLICY  Schedule policy. Default: SCHED_OTHER\n"
-		"  -U, --schpri=n       Schedule priority. Default: %d\n"
-		"  -x, --extra-stats	Display extra statistics.\n"
-		"  -Q, --quiet          Do not display any stats.\n"
-		"  -a, --app-stats	Display application (syscall) statistics.\n"
-		"  -I, --irq-string	Display driver interrupt statistics for interface associated with irq-string.\n"
-		"  -B, --busy-poll      Busy poll.\n"
-		"  -R, --reduce-cap	Use reduced capabilities (cannot be used with -M)\n"
-		"\nMAX_SOCKS:%d MULTI_FCQ:%s KRNL:%s DEBUGMODE:%s\n"
-		"\n";
-	fprintf(stderr, str, prog, XSK_UMEM__DEFAULT_FRAME_SIZE,
-		opt_batch_size, MIN_PKT_SIZE, MIN_PKT_SIZE,
-		XSK_UMEM__DEFAULT_FRAME_SIZE, opt_pkt_fill_pattern,
-		VLAN_VID__DEFAULT, VLAN_PRI__DEFAULT,
-		SCHED_PRI__DEFAULT,
-		MAX_SOCKS,
 #ifdef MULTI_FCQ
-		"Yes",
-#else
-		"No",
-#endif
-		xdpsock_krnl,
-#ifdef USE_DEBUGMODE
-		"Yes"
+	*base = xsk->umem_offset;
+	*nframes = NUM_FRAMES;
 #else
-		"No"
+	*nframes = NUM_FRAMES / opt_num_xsks;
+	*base = (u64)xsk->xsk_index * *nframes * opt_xsk_frame_size;
 #endif
-		);
+}
 
-	exit(EXIT_FAILURE);
+/* Rewrite a frame built for one flow into another, patching the checksums. */
+static void tx_flow_patch(u8 *pkt, const struct tx_flow *from, const struct tx_flow *to)
+{
+	const struct pkt_layout *l = &tx_layout;
+
+	if (to->saddr != from->saddr)
+		pkt_field_write(pkt, l, l->l3 + 12, 4, 0xffffffff, 0, to->saddr);
+	if (to->daddr != from->daddr)
+		pkt_field_write(pkt, l, l->l3 + 16, 4, 0xffffffff, 0, to->daddr);
+	if (to->sport != from->sport)
+		pkt_field_write(pkt, l, l->l4, 2, 0xffff, 0, to->sport);
+	if (to->dport != from->dport)
+		pkt_field_write(pkt, l, l->l4 + 2, 2, 0xffff, 0, to->dport);
 }
 
-static void parse_command_line(int argc, char **argv)
+/* Bake a socket's TX image into its own UMEM area: a descriptor for every
+ * slot of the flow/size pattern, so tx_only() only copies descriptors. Unless
+ * slots are written at send time (-y, --mutate), all slots of one flow/size
+ * combination share a frame, which keeps the frames the NIC reads few and
+ * cache hot. Only the first frame of each size is built and checksummed in
+ * full, the others are copies of it with their flow patched in.
+ */
+static void tx_image_bake(struct xsk_umem_info *umem, struct xsk_socket_info *xsk)
 {
-	int option_index, c;
+	bool shared = !opt_tstamp && !opt_num_mutators;
+	u32 nframes, used = 0, hsize, h, j, *first_flow;
+	u64 base, *first, *hkey, *haddr;
+
+	xsk_tx_area(xsk, &base, &nframes);
+	if (nframes > NUM_FRAMES)
+		nframes = NUM_FRAMES;
+
+	for (hsize = 1; hsize < 2 * nframes; hsize <<= 1)
+		;
+	xsk->tx_img = calloc(nframes, sizeof(*xsk->tx_img));
+	first = calloc(opt_xsk_frame_size + 1, sizeof(*first));
+	first_flow = calloc(opt_xsk_frame_size + 1, sizeof(*first_flow));
+	hkey = calloc(hsize, sizeof(*hkey));
+	haddr = calloc(hsize, sizeof(*haddr));
+	if (!xsk->tx_img || !first || !first_flow || !hkey || !haddr)
+		exit_with_error(ENOMEM);
+	xsk->tx_img_frames = nframes;
+
+	for (j = 0; j < nframes; j++) {
+		u16 size = tx_frame_size[j];
+		u32 flow = tx_frame_flow[j];
+		u64 key = ((u64)flow << 16 | size) + 1, addr;
+		u8 *pkt;
+
+		h = (key * 0x9e3779b97f4a7c15ULL) >> 32 & (hsize - 1);
+		while (hkey[h] && hkey[h] != key)
+			h = (h + 1) & (hsize - 1);
+
+		if (shared && hkey[h]) {
+			addr = haddr[h];
+		} else {
+			addr = base + (u64)used++ * opt_xsk_frame_size;
+			pkt = xsk_umem__get_data(umem->buffer, addr);
+
+			if (tmpl_data) {
+				memcpy(pkt, tmpl_data, tmpl_len);
+			} else if (!first[size] || opt_encap) {
+				/* Tunnel frames are built whole, their outer port
+				 * follows the flow
+				 */
+				gen_eth_hdr(pkt, &tx_flows[flow], size);
+				if (!tx_layout.l3)
+					pkt_layout_parse(pkt, size - ETH_FCS_SIZE, &tx_layout);
+				first[size] = addr + 1;
+				first_flow[size] = flow;
+			} else {
+				memcpy(pkt, xsk_umem__get_data(umem->buffer, first[size] - 1),
+				       size - ETH_FCS_SIZE);
+				tx_flow_patch(pkt, &tx_flows[first_flow[size]], &tx_flows[flow]);
+			}
+			hkey[h] = key;
+			haddr[h] = addr;
+		}
 
-	opterr = 0;
+		xsk->tx_img[j].addr = addr;
+		xsk->tx_img[j].len = size - ETH_FCS_SIZE;
+	}
 
-	for (;;) {
-		c = getopt_long(argc, argv,
-#ifdef MULTI_FCQ
-				"Frtli:q:pSNn:w:O:czf:muM:d:b:C:s:P:VJ:K:G:H:T:yW:U:xQaI:BR",
-#else
-				"Frtli:q:pSNn:w:O:czf:muMd:b:C:s:P:VJ:K:G:H:T:yW:U:xQaI:BR",
-#endif
-				long_options, &option_index);
-		if (c == -1)
-			break;
+	free(first);
+	free(first_flow);
+	free(hkey);
+	free(haddr);
 
-		switch (c) {
-		case 'r':
-			opt_bench = BENCH_RXDROP;
-			break;
-		case 't':
-			opt_bench = BENCH_TXONLY;
-			break;
-		case 'l':
-			opt_bench = BENCH_L2FWD;
-			break;
-		case 'i':
-			opt_if = optarg;
-			break;
-		case 'q':
-			opt_queue = atoi(optarg);
-			break;
-		case 'p':
-			opt_poll = 1;
-			break;
-		case 'S':
-			opt_xdp_flags |= XDP_FLAGS_SKB_MODE;
-			opt_xdp_bind_flags |= XDP_COPY;
-			break;
-		case 'N':
-			/* default, set below */
-			break;
-		case 'n':
-			opt_interval = atoi(optarg);
+	fprintf(stdout, "XSK[%u] TX image: %u slots over %u frames\n", xsk->xsk_index,
+		nframes, used);
+}
+
+static void gen_tx_frames(struct xsk_umem_info *umem)
+{
+	int i;
+
+	if (tmpl_data) {
+		for (i = 0; i < NUM_FRAMES; i++) {
+			tx_frame_size[i] = opt_pkt_size;
+			tx_frame_bucket[i] = size_bucket(opt_pkt_size);
+		}
+	} else {
+		tx_flows_distribute();
+		tx_sizes_distribute();
+	}
+
+	for (i = 0; i < num_socks; i++)
+		tx_image_bake(umem, xsks[i]);
+	mutators_resolve(&tx_layout);
+
+	if (tmpl_data)
+		fprintf(stdout, "TX template %s: %u bytes, %d mutators\n", opt_template,
+			tmpl_len, opt_num_mutators);
+	if (opt_flow_count > 1)
+		fprintf(stdout, "Generated %u flows (%s) over %d frames\n", opt_flow_count,
+			opt_flow_dist == FLOW_DIST_ZIPF ? "zipf" :
+			opt_flow_dist == FLOW_DIST_UNIFORM ? "uniform" : "round-robin",
+			NUM_FRAMES);
+}
+
+/* Hash of the IPv4/IPv6 5-tuple (or the MACs for anything else), used to
+ * keep each flow of a capture on one channel.
+ */
+static u32 pkt_flow_hash(const u8 *pkt, u32 len)
+{
+	const struct ethhdr *eth = (const struct ethhdr *)pkt;
+	const u8 *l3 = pkt + sizeof(*eth), *l4 = NULL, *end = pkt + len;
+	u32 hash = 2166136261u; /* FNV-1a */
+	const u8 *key = pkt;
+	u32 key_len = 2 * ETH_ALEN, i;
+	u16 proto = eth->h_proto;
+	u8 l4proto = 0;
+
+	if (proto == htons(ETH_P_8021Q) && l3 + 4 <= end) {
+		proto = *(const u16 *)(l3 + 2);
+		l3 += 4;
+	}
+
+	if (proto == htons(ETH_P_IP) && l3 + sizeof(struct iphdr) <= end) {
+		const struct iphdr *iph = (const struct iphdr *)l3;
+
+		key = (const u8 *)&iph->saddr;
+		key_len = 8;
+		l4proto = iph->protocol;
+		l4 = l3 + iph->ihl * 4;
+	} else if (proto == htons(ETH_P_IPV6) && l3 + 40 <= end) {
+		key = l3 + 8;
+		key_len = 32;
+		l4proto = l3[6];
+		l4 = l3 + 40;
+	}
+
+	for (i = 0; i < key_len; i++)
+		hash = (hash ^ key[i]) * 16777619u;
+
+	if ((l4proto == IPPROTO_UDP || l4proto == IPPROTO_TCP) && l4 + 4 <= end) {
+		for (i = 0; i < 4; i++)
+			hash = (hash ^ l4[i]) * 16777619u;
+		hash = (hash ^ l4proto) * 16777619u;
+	}
+
+	return hash;
+}
+
+static struct replay_pkt {
+	const u8 *data;
+	u32 len;
+	u8 bucket;		/**< size_buckets[] index */
+	unsigned long ts_ns;	/**< Relative to the first packet */
+} *replay_pkts;
+static u32 replay_npkts;
+static unsigned long replay_span_ns; /**< Capture duration plus one mean gap */
+static unsigned long replay_start_ns;
+
+/* mmap the capture and index its records. The mapping stays for the whole
+ * run, packets are copied straight out of it.
+ */
+static void replay_load(const char *path)
+{
+	const struct pcap_file_hdr *fh;
+	unsigned long first_ts = 0;
+	u32 skipped = 0, alloc = 0;
+	const u8 *data, *pos, *end;
+	bool swapped, nsec;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "ERROR: Can't open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED || st.st_size < sizeof(*fh)) {
+		fprintf(stderr, "ERROR: Can't map %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	fh = (const struct pcap_file_hdr *)data;
+	swapped = fh->magic == bswap_32(PCAP_MAGIC_USEC) ||
+		  fh->magic == bswap_32(PCAP_MAGIC_NSEC);
+	nsec = fh->magic == PCAP_MAGIC_NSEC || fh->magic == bswap_32(PCAP_MAGIC_NSEC);
+	if ((!swapped && fh->magic != PCAP_MAGIC_USEC && fh->magic != PCAP_MAGIC_NSEC) ||
+	    (swapped ? bswap_32(fh->linktype) : fh->linktype) != PCAP_LINKTYPE_ETHERNET) {
+		fprintf(stderr, "ERROR: %s is not an Ethernet pcap (pcapng is not supported)\n",
+			path);
+		exit(EXIT_FAILURE);
+	}
+
+	pos = data + sizeof(*fh);
+	end = data + st.st_size;
+	while (pos + sizeof(struct pcap_rec_hdr) <= end) {
+		const struct pcap_rec_hdr *rh = (const struct pcap_rec_hdr *)pos;
+		u32 caplen = swapped ? bswap_32(rh->caplen) : rh->caplen;
+		u32 ts_sec = swapped ? bswap_32(rh->ts_sec) : rh->ts_sec;
+		u32 ts_frac = swapped ? bswap_32(rh->ts_frac) : rh->ts_frac;
+		unsigned long ts = ts_sec * NSEC_PER_SEC + ts_frac * (nsec ? 1UL : 1000UL);
+		struct replay_pkt *pkt;
+
+		pos += sizeof(*rh);
+		if (pos + caplen > end)
 			break;
-		case 'w':
-			if (get_clockid(&opt_clock, optarg)) {
-				fprintf(stderr,
-					"ERROR: Invalid clock %s. Default to CLOCK_MONOTONIC.\n",
-					optarg);
-				opt_clock = CLOCK_MONOTONIC;
+
+		if (caplen < ETH_HLEN || caplen > opt_xsk_frame_size) {
+			skipped++;
+			pos += caplen;
+			continue;
+		}
+
+		if (replay_npkts == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			replay_pkts = realloc(replay_pkts, alloc * sizeof(*replay_pkts));
+			if (!replay_pkts)
+				exit_with_error(errno);
+		}
+
+		if (!replay_npkts)
+			first_ts = ts;
+
+		pkt = &replay_pkts[replay_npkts++];
+		pkt->data = pos;
+		pkt->len = caplen;
+		pkt->bucket = size_bucket(caplen + ETH_FCS_SIZE);
+		pkt->ts_ns = ts > first_ts ? ts - first_ts : 0;
+		pos += caplen;
+	}
+
+	if (!replay_npkts) {
+		fprintf(stderr, "ERROR: No usable packets in %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	replay_span_ns = replay_pkts[replay_npkts - 1].ts_ns;
+	replay_span_ns += replay_npkts > 1 ? replay_span_ns / (replay_npkts - 1) : NSEC_PER_USEC;
+	if (!replay_span_ns)
+		replay_span_ns = NSEC_PER_USEC;
+
+	fprintf(stdout, "Loaded %u packets (%u skipped) spanning %.6fs from %s\n",
+		replay_npkts, skipped, replay_span_ns / 1e9, path);
+}
+
+/* Spread the capture over the sockets by flow hash, and preload each
+ * socket's packets into its TX area when they fit.
+ */
+static void replay_setup(struct xsk_umem_info *umem)
+{
+	u32 i, n;
+	int x;
+
+	for (x = 0; x < num_socks; x++) {
+		struct xsk_replay *rp = &xsks[x]->replay;
+
+		xsk_tx_area(xsks[x], &rp->base, &rp->nframes);
+		rp->pkts = calloc(replay_npkts, sizeof(*rp->pkts));
+		if (!rp->pkts)
+			exit_with_error(errno);
+	}
+
+	for (i = 0; i < replay_npkts; i++) {
+		struct xsk_replay *rp;
+
+		x = num_socks > 1 ?
+			pkt_flow_hash(replay_pkts[i].data, replay_pkts[i].len) % num_socks : 0;
+		rp = &xsks[x]->replay;
+		rp->pkts[rp->npkts++] = i;
+	}
+
+	for (x = 0; x < num_socks; x++) {
+		struct xsk_replay *rp = &xsks[x]->replay;
+
+		rp->preloaded = rp->npkts <= rp->nframes;
+		if (rp->preloaded) {
+			for (n = 0; n < rp->npkts; n++) {
+				const struct replay_pkt *pkt = &replay_pkts[rp->pkts[n]];
+
+				memcpy(xsk_umem__get_data(umem->buffer,
+							  rp->base + (u64)n * opt_xsk_frame_size),
+				       pkt->data, pkt->len);
 			}
+		}
+
+		fprintf(stdout, "XSK[%u] replays %u packets (%s)\n", xsks[x]->xsk_index,
+			rp->npkts, rp->preloaded ? "preloaded" : "copied at send");
+	}
+}
+
+static inline unsigned long replay_due_ns(const struct xsk_replay *rp, u32 pos,
+					  unsigned long loops)
+{
+	const struct replay_pkt *pkt = &replay_pkts[rp->pkts[pos]];
+
+	return replay_start_ns +
+	       (unsigned long)((pkt->ts_ns + loops * replay_span_ns) / opt_replay_speed);
+}
+
+/* How much of batch this socket can send now: packets already due when
+ * following capture timing, and never more than the frames it can copy into
+ * without overwriting ones still in flight.
+ */
+static int replay_batch(struct xsk_socket_info *xsk, int batch, unsigned long now)
+{
+	struct xsk_replay *rp = &xsk->replay;
+	unsigned long loops = rp->loops;
+	u32 pos = rp->pos;
+	int n;
+
+	if (!rp->npkts)
+		return 0;
+
+	if (!rp->preloaded && xsk->outstanding_tx + batch > rp->nframes)
+		batch = rp->nframes > xsk->outstanding_tx ?
+			rp->nframes - xsk->outstanding_tx : 0;
+
+	if (!opt_replay_speed)
+		return batch;
+
+	for (n = 0; n < batch; n++) {
+		if (replay_due_ns(rp, pos, loops) > now)
+			break;
+		if (++pos == rp->npkts) {
+			pos = 0;
+			loops++;
+		}
+	}
+
+	return n;
+}
+
+static unsigned long replay_next_due_ns(void)
+{
+	unsigned long next = ~0UL;
+	int i;
+
+	for (i = 0; i < num_socks; i++) {
+		struct xsk_replay *rp = &xsks[i]->replay;
+
+		if (rp->npkts && replay_due_ns(rp, rp->pos, rp->loops) < next)
+			next = replay_due_ns(rp, rp->pos, rp->loops);
+	}
+
+	return next;
+}
+
+static inline void replay_desc(struct xsk_socket_info *xsk, struct xdp_desc *desc)
+{
+	struct xsk_replay *rp = &xsk->replay;
+	const struct replay_pkt *pkt = &replay_pkts[rp->pkts[rp->pos]];
+
+	if (rp->preloaded) {
+		desc->addr = rp->base + (u64)rp->pos * opt_xsk_frame_size;
+	} else {
+		desc->addr = rp->base + (u64)rp->frame_nb * opt_xsk_frame_size;
+		memcpy(xsk_umem__get_data(xsk->umem->buffer, desc->addr), pkt->data, pkt->len);
+		rp->frame_nb = (rp->frame_nb + 1) % rp->nframes;
+	}
+	desc->len = pkt->len;
+
+	xsk->ring_stats.tx_bytes += pkt->len;
+	xsk->ring_stats.tx_size_npkts[pkt->bucket]++;
+
+	if (++rp->pos == rp->npkts) {
+		rp->pos = 0;
+		rp->loops++;
+	}
+}
+
+static struct xsk_umem_info *xsk_configure_umem(void *buffer, u64 size)
+{
+	struct xsk_umem_info *umem;
+	struct xsk_umem_config cfg = {
+		/* We recommend that you set the fill ring size >= HW RX ring size +
+		 * AF_XDP RX ring size. Make sure you fill up the fill ring
+		 * with buffers at regular intervals, and you will with this setting
+		 * avoid allocation failures in the driver. These are usually quite
+		 * expensive since drivers have not been written to assume that
+		 * allocation failures are common. For regular sockets, kernel
+		 * allocated memory is used that only runs out in OOM situations
+		 * that should be rare.
+		 */
+		.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS * 2,
+		.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.frame_size = opt_xsk_frame_size,
+		.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+		.flags = opt_umem_flags
+	};
+	int ret;
+
+	umem = calloc(1, sizeof(*umem));
+	if (!umem)
+		exit_with_error(errno);
+
+	ret = xsk_umem__create(&umem->umem, buffer, size, &umem->fq, &umem->cq,
+			       &cfg);
+	if (ret)
+		exit_with_error(-ret);
+
+	umem->buffer = buffer;
+	return umem;
+}
+
+/* Frames handed to the fill ring. In latency mode the fill ring only gets the
+ * first half of the frames, the rest is kept back for probes.
+ */
+static u32 fill_ring_frames(void)
+{
+	if (opt_bench == BENCH_LATENCY || opt_bench == BENCH_RFC2544)
+		return NUM_FRAMES / 2;
+
+	return XSK_RING_PROD__DEFAULT_NUM_DESCS * 2;
+}
+
+/* Probe frames for --latency and --rfc2544. Each socket owns a private slice
+ * of the frames kept out of the fill ring, so probes never alias RX buffers or
+ * each other.
+ */
+static u32 probe_tx_frames(void)
+{
+#ifdef MULTI_FCQ
+	return NUM_FRAMES - fill_ring_frames();
+#else
+	return (NUM_FRAMES - fill_ring_frames()) / opt_num_xsks;
+#endif
+}
+
+static u64 probe_tx_addr(struct xsk_socket_info *xsk, u32 n)
+{
+#ifdef MULTI_FCQ
+	return xsk->umem_offset + (u64)(fill_ring_frames() + n) * opt_xsk_frame_size;
+#else
+	return (u64)(fill_ring_frames() + xsk->xsk_index * probe_tx_frames() + n) *
+		opt_xsk_frame_size;
+#endif
+}
+
+static void xsk_populate_fill_ring(struct xsk_umem_info *umem, struct xsk_socket_info *xsk)
+{
+	int ret, i;
+	u32 idx;
+
+#ifdef MULTI_FCQ
+	if (umem == NULL || xsk == NULL)
+		exit_with_error(-EINVAL);
+
+	fprintf(stdout, "Filling multi-FCQ XSK[%u] from umem_offset:%llu\n",
+		xsk->xsk_index, xsk->umem_offset);
+
+	/* Multi FCQ mode, we fill the xsk->fq. */
+	struct xsk_ring_prod *fq_ptr = &xsk->fq;
+
+	/* In a multi-FCQ setup, umem size is multiplied by the number of XSK sockets we have. That
+	 * means our umem offset for each descriptor is not uniform - and is different on a per-FQ/CQ
+	 * basis. */
+	int offset = xsk->umem_offset;
+
+#else
+	if (umem == NULL || xsk != NULL)
+		exit_with_error(-EINVAL);
+
+	fprintf(stdout, "Filling single-FCQ XSK\n");
+	
+	/* Single MCQ mode, so we fill the umem->fq. */
+	struct xsk_ring_prod *fq_ptr = &umem->fq;
+
+	/* Single MCQ mode, no per-xsk offset needed. */
+	int offset = 0;
+
+#endif /* MULTI_FCQ */
+
+	ret = xsk_ring_prod__reserve(fq_ptr, fill_ring_frames(), &idx);
+	if (ret != fill_ring_frames())
+		exit_with_error(-ret);
+	for (i = 0; i < fill_ring_frames(); i++)
+		*xsk_ring_prod__fill_addr(fq_ptr, idx++) =
+			offset + (i * opt_xsk_frame_size);
+	xsk_ring_prod__submit(fq_ptr, fill_ring_frames());
+}
+
+/* Original xsk_configure_socket() always binds to the same Channel ID, which is not multi-core.
+ *
+ * Revised API includes an xsk_index, so we can apply this as an offset from Channel ID,
+ * allowing us to bind one XSK socket to each Channel. This also means we can support zero
+ * copy queue offset via --queue=n, n being the offset.
+ */
+static struct xsk_socket_info *xsk_configure_socket(struct xsk_umem_info *umem,
+						    bool rx, bool tx, int xsk_index)
+{
+	struct xsk_socket_config cfg;
+	struct xsk_socket_info *xsk;
+	struct xsk_ring_cons *rxr;
+	struct xsk_ring_prod *txr;
+	int ret;
+
+	xsk = calloc(1, sizeof(*xsk));
+	if (!xsk)
+		exit_with_error(errno);
+
+	xsk->umem = umem;
+	cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+	cfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+
+#ifdef MULTI_FCQ
+
+	/* We don't want to use dispatcher - we always want to load our kernel. */
+	cfg.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
+
+#else
+
+	/* Original code */
+	if (opt_num_xsks > 1 || opt_reduced_cap)
+		cfg.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
+	else
+		cfg.libbpf_flags = 0;
+
+#endif /* MULTI_FCQ */
+
+	cfg.xdp_flags = opt_xdp_flags;
+	cfg.bind_flags = opt_xdp_bind_flags;
+
+	rxr = rx ? &xsk->rx : NULL;
+	txr = tx ? &xsk->tx : NULL;
+
+	/* Save our position in xsks array and map. */
+	xsk->xsk_index = xsk_index;
+
+#ifdef MULTI_FCQ
+
+	/* In a multi-FCQ setup we need to store a umem offset, telling us where the umem descriptors
+	 * for this XSK are. This is so each channel does not hit the same memory space.
+	 *
+	 * Logic here is xsk[0] gets the first batch of descriptors, xsk[1] gets the next batch,
+	 * and so on. */
+
+	xsk->umem_offset = xsk_index * (NUM_FRAMES * opt_xsk_frame_size);
+
+	/* In a multi-FCQ setup, we bind to multiple channel IDs, so we calculate this via the
+	 * queue number + the xsk index. Mellanox cards will need to have --queue=n for zero copy. */
+
+	xsk->channel_id = opt_queue + xsk_index;
+
+	/* In a multi-FCQ setup we use the xsk_socket__create_shared() API which lets us pass
+	 * in pointers to dedicated Fill/Completion queue per XSK. */
+
+	fprintf(stdout, "Opening multi-FCQ XSK[%u] to %s channel %u...\n",
+		xsk->xsk_index, opt_if, xsk->channel_id);
+	ret = xsk_socket__create_shared(&xsk->xsk, opt_if, xsk->channel_id, umem->umem,
+	 			rxr, txr, &xsk->fq, &xsk->cq, &cfg);
+
+#else /* MULTI_FCQ */
+
+	/* In a single-FCQ setup we stick to the original design of xdpsock_user.c, and so our channel
+	 * ID will only ever be a single queue. */
+
+	xsk->channel_id = opt_queue;
+	
+	fprintf(stdout, "Opening single-FCQ XSK[%u] to %s channel %u...\n",
+		xsk->xsk_index, opt_if, opt_queue);
+	ret = xsk_socket__create(&xsk->xsk, opt_if, opt_queue, umem->umem,
+				 rxr, txr, &cfg);
+
+#endif /* MULTI_FCQ */
+
+	if (ret)
+		exit_with_error(-ret);
+
+	ret = bpf_xdp_query_id(opt_ifindex, opt_xdp_flags, &prog_id);
+	if (ret)
+		exit_with_error(-ret);
+
+	xsk->app_stats.rx_empty_polls = 0;
+	xsk->app_stats.fill_fail_polls = 0;
+	xsk->app_stats.copy_tx_sendtos = 0;
+	xsk->app_stats.tx_wakeup_sendtos = 0;
+	xsk->app_stats.opt_polls = 0;
+	xsk->app_stats.prev_rx_empty_polls = 0;
+	xsk->app_stats.prev_fill_fail_polls = 0;
+	xsk->app_stats.prev_copy_tx_sendtos = 0;
+	xsk->app_stats.prev_tx_wakeup_sendtos = 0;
+	xsk->app_stats.prev_opt_polls = 0;
+
+	xsk->batch.size = opt_batch_size;
+	xsk->batch.lo = UINT32_MAX;
+	xsk->batch.hi = 0;
+	xsk->batch.dump_size = opt_batch_size;
+
+	return xsk;
+}
+
+/* Long-only options, we've run out of sensible short ones. */
+enum {
+	OPT_BATCH_AUTO = 256,
+	OPT_BP_PROFILE,
+	OPT_NAPI_CPU,
+	OPT_LATENCY,
+	OPT_LATENCY_RATE,
+	OPT_RXCHECK,
+	OPT_FLOWS,
+	OPT_FLOW_SRC_IP,
+	OPT_FLOW_DST_IP,
+	OPT_FLOW_SRC_PORT,
+	OPT_FLOW_DST_PORT,
+	OPT_FLOW_DIST,
+	OPT_SIZE_PROFILE,
+	OPT_REPLAY,
+	OPT_REPLAY_SPEED,
+	OPT_CAPTURE,
+	OPT_SNAPLEN,
+	OPT_SAMPLE,
+	OPT_CAPTURE_FORMAT,
+	OPT_L3FWD,
+	OPT_ROUTES,
+	OPT_NEIGH,
+	OPT_RATE,
+	OPT_RATE_BURST,
+	OPT_RFC2544,
+	OPT_TRIAL_TIME,
+	OPT_LOSS_TOLERANCE,
+	OPT_TESTBED,
+	OPT_SWEEP,
+	OPT_SWEEP_FORMAT,
+	OPT_WARMUP,
+	OPT_RESULT_FD,
+	OPT_REFLECT,
+	OPT_BURST,
+	OPT_BURST_IDLE,
+	OPT_BURST_SYNC,
+	OPT_BURST_DETECT,
+	OPT_TEMPLATE,
+	OPT_MUTATE,
+	OPT_CSUM,
+	OPT_CSUM_BENCH,
+	OPT_ENCAP,
+	OPT_ENCAP_SRC_IP,
+	OPT_ENCAP_DST_IP,
+	OPT_TUNNEL_ID,
+	OPT_BATCH_HIST,
+	OPT_STATS_FORMAT,
+	OPT_METRICS,
+	OPT_PERF_COUNTERS,
+	OPT_UTIL,
+};
+
+static struct option long_options[] = {
+	{"rxdrop", no_argument, 0, 'r'},
+	{"txonly", no_argument, 0, 't'},
+	{"l2fwd", no_argument, 0, 'l'},
+	{"interface", required_argument, 0, 'i'},
+	{"queue", required_argument, 0, 'q'},
+	{"poll", no_argument, 0, 'p'},
+	{"xdp-skb", no_argument, 0, 'S'},
+	{"xdp-native", no_argument, 0, 'N'},
+	{"interval", required_argument, 0, 'n'},
+	{"retries", required_argument, 0, 'O'},
+	{"zero-copy", no_argument, 0, 'z'},
+	{"copy", no_argument, 0, 'c'},
+	{"frame-size", required_argument, 0, 'f'},
+	{"no-need-wakeup", no_argument, 0, 'm'},
+	{"unaligned", no_argument, 0, 'u'},
+#ifdef MULTI_FCQ
+	{"channels", required_argument, 0, 'M'},
+#else
+	{"shared-umem", no_argument, 0, 'M'},
+#endif
+	{"force", no_argument, 0, 'F'},
+	{"duration", required_argument, 0, 'd'},
+	{"clock", required_argument, 0, 'w'},
+	{"batch-size", required_argument, 0, 'b'},
+	{"tx-pkt-count", required_argument, 0, 'C'},
+	{"tx-pkt-size", required_argument, 0, 's'},
+	{"tx-pkt-pattern", required_argument, 0, 'P'},
+	{"tx-vlan", no_argument, 0, 'V'},
+	{"tx-vlan-id", required_argument, 0, 'J'},
+	{"tx-vlan-pri", required_argument, 0, 'K'},
+	{"tx-dmac", required_argument, 0, 'G'},
+	{"tx-smac", required_argument, 0, 'H'},
+	{"tx-cycle", required_argument, 0, 'T'},
+	{"tstamp", no_argument, 0, 'y'},
+	{"policy", required_argument, 0, 'W'},
+	{"schpri", required_argument, 0, 'U'},
+	{"extra-stats", no_argument, 0, 'x'},
+	{"quiet", no_argument, 0, 'Q'},
+	{"app-stats", no_argument, 0, 'a'},
+	{"irq-string", no_argument, 0, 'I'},
+	{"busy-poll", no_argument, 0, 'B'},
+	{"reduce-cap", no_argument, 0, 'R'},
+	{"batch-auto", required_argument, 0, OPT_BATCH_AUTO},
+	{"busy-poll-profile", required_argument, 0, OPT_BP_PROFILE},
+	{"napi-cpu", required_argument, 0, OPT_NAPI_CPU},
+	{"latency", no_argument, 0, OPT_LATENCY},
+	{"latency-rate", required_argument, 0, OPT_LATENCY_RATE},
+	{"rxcheck", no_argument, 0, OPT_RXCHECK},
+	{"flows", required_argument, 0, OPT_FLOWS},
+	{"flow-src-ip", required_argument, 0, OPT_FLOW_SRC_IP},
+	{"flow-dst-ip", required_argument, 0, OPT_FLOW_DST_IP},
+	{"flow-src-port", required_argument, 0, OPT_FLOW_SRC_PORT},
+	{"flow-dst-port", required_argument, 0, OPT_FLOW_DST_PORT},
+	{"flow-dist", required_argument, 0, OPT_FLOW_DIST},
+	{"tx-size-profile", required_argument, 0, OPT_SIZE_PROFILE},
+	{"replay", required_argument, 0, OPT_REPLAY},
+	{"replay-speed", required_argument, 0, OPT_REPLAY_SPEED},
+	{"capture", required_argument, 0, OPT_CAPTURE},
+	{"snaplen", required_argument, 0, OPT_SNAPLEN},
+	{"sample", required_argument, 0, OPT_SAMPLE},
+	{"capture-format", required_argument, 0, OPT_CAPTURE_FORMAT},
+	{"l3fwd", no_argument, 0, OPT_L3FWD},
+	{"routes", required_argument, 0, OPT_ROUTES},
+	{"neigh", required_argument, 0, OPT_NEIGH},
+	{"rate", required_argument, 0, OPT_RATE},
+	{"rate-burst", required_argument, 0, OPT_RATE_BURST},
+	{"rfc2544", optional_argument, 0, OPT_RFC2544},
+	{"trial-time", required_argument, 0, OPT_TRIAL_TIME},
+	{"loss-tolerance", required_argument, 0, OPT_LOSS_TOLERANCE},
+	{"testbed", optional_argument, 0, OPT_TESTBED},
+	{"sweep", required_argument, 0, OPT_SWEEP},
+	{"sweep-format", required_argument, 0, OPT_SWEEP_FORMAT},
+	{"warmup", required_argument, 0, OPT_WARMUP},
+	{"result-fd", required_argument, 0, OPT_RESULT_FD},
+	{"reflect", no_argument, 0, OPT_REFLECT},
+	{"burst", required_argument, 0, OPT_BURST},
+	{"burst-idle", required_argument, 0, OPT_BURST_IDLE},
+	{"burst-sync", no_argument, 0, OPT_BURST_SYNC},
+	{"burst-detect", required_argument, 0, OPT_BURST_DETECT},
+	{"template", required_argument, 0, OPT_TEMPLATE},
+	{"mutate", required_argument, 0, OPT_MUTATE},
+	{"csum", required_argument, 0, OPT_CSUM},
+	{"csum-bench", no_argument, 0, OPT_CSUM_BENCH},
+	{"encap", required_argument, 0, OPT_ENCAP},
+	{"encap-src-ip", required_argument, 0, OPT_ENCAP_SRC_IP},
+	{"encap-dst-ip", required_argument, 0, OPT_ENCAP_DST_IP},
+	{"tunnel-id", required_argument, 0, OPT_TUNNEL_ID},
+	{"batch-hist", no_argument, 0, OPT_BATCH_HIST},
+	{"stats-format", required_argument, 0, OPT_STATS_FORMAT},
+	{"metrics", required_argument, 0, OPT_METRICS},
+	{"perf-counters", no_argument, 0, OPT_PERF_COUNTERS},
+	{"util", no_argument, 0, OPT_UTIL},
+	{0, 0, 0, 0}
+};
+
+static void usage(const char *prog)
+{
+	const char *str =
+		"  Usage: %s [OPTIONS]\n"
+		"  Options:\n"
+		"  -r, --rxdrop		Discard all incoming packets (default)\n"
+		"  -t, --txonly		Only send packets\n"
+		"  -l, --l2fwd		MAC swap L2 forwarding\n"
+		"  --reflect		Like -l, also swapping IPv4/IPv6 addresses and UDP/TCP\n"
+		"			ports, to loop traffic back to an L3 tester.\n"
+		"  --burst=DIST		txonly in bursts of N back-to-back frames, N being\n"
+		"			N, MIN-MAX (uniform) or expMEAN (exponential).\n"
+		"  --burst-idle=USECS	Idle time after each burst. Default: 1000.\n"
+		"  --burst-sync		Same burst size on all channels, sent together.\n"
+		"  --burst-detect=USECS	rxdrop: split RX into bursts at idle gaps of USECS\n"
+		"			and charge each with its ring full/fill empty drops.\n"
+		"  --template=FILE	txonly frame from a hex dump or the first packet of a\n"
+		"			pcap, instead of the built-in UDP frame.\n"
+		"  --mutate=F=K:ARGS	Rewrite field F of every frame sent, checksums patched.\n"
+		"			F: sip, dip, sport, dport, vlan, pcp, dscp, ttl, ipid\n"
+		"			or @OFFSET.WIDTH (WIDTH 1, 2 or 4 bytes).\n"
+		"			K:ARGS: inc:A-B[/STEP], rand:A-B or list:V,V,...\n"
+		"			Up to 8, e.g. --mutate=sip=inc:10.0.0.1-10.0.0.99\n"
+		"  --csum=K		Checksum kernel: scalar, sse4, avx2 or avx512.\n"
+		"			Default: the widest the CPU supports.\n"
+		"  --csum-bench		Verify and time the checksum kernels, then exit.\n"
+		"  --encap=T		Tunnel generated frames: vxlan, gre or gtpu. --flow-*\n"
+		"			set the inner tuples, the outer UDP source port\n"
+		"			follows them. Receivers need it too for -y/--rxcheck.\n"
+		"  --encap-src-ip=A	Outer source IP. Default: 10.10.20.16\n"
+		"  --encap-dst-ip=A	Outer destination IP. Default: 10.10.20.32\n"
+		"  --tunnel-id=N		VXLAN VNI, GRE key or GTP-U TEID. Default: 1\n"
+		"  --batch-hist		Time every rxdrop, l2fwd and txonly batch with the TSC\n"
+		"			and report p50/p99/p99.9/max per socket each interval.\n"
+		"  --perf-counters	Count cycles, instructions, LLC, dTLB and branch misses\n"
+		"			per socket and report them per packet each interval.\n"
+		"  --util		Split the worker's time per socket into busy, empty\n"
+		"			polls, wakeup syscalls, ring stalls and -p poll()\n"
+		"			idle, with busy plus stall as utilisation.\n"
+		"  --stats-format=F	text (default), json (one line per interval) or csv\n"
+		"			(one row per socket and an \"all\" row), ending with a\n"
+		"			summary record.\n"
+		"  --metrics=P		Serve Prometheus counters on 127.0.0.1:P, or on a\n"
+		"			unix socket with unix:PATH, for any request path.\n"
+		"  --latency		Send timestamped probes and measure their RTT when a\n"
+		"			peer (e.g. -l on the far port) reflects them back\n"
+		"  -i, --interface=n	Run on interface n\n"
+#ifdef MULTI_FCQ
+		"  -q, --queue=n	Start at queue n (default 0), this can be used for ZC queue offsets (looking at you mlx...)\n"
+#else
+		"  -q, --queue=n	Use queue n (default 0)\n"
+#endif
+		"  -p, --poll		Use poll syscall\n"
+		"  -S, --xdp-skb=n	Use XDP skb-mod\n"
+		"  -N, --xdp-native=n	Enforce XDP native mode\n"
+		"  -n, --interval=n	Specify statistics update interval (default 1 sec).\n"
+		"  -O, --retries=n	Specify time-out retries (1s interval) attempt (default 3).\n"
+		"  -z, --zero-copy      Force zero-copy mode.\n"
+		"  -c, --copy           Force copy mode.\n"
+		"  -m, --no-need-wakeup Turn off use of driver need wakeup flag.\n"
+		"  -f, --frame-size=n   Set the frame size (must be a power of two in aligned mode, default is %d).\n"
+		"  -u, --unaligned	Enable unaligned chunk placement\n"
+#ifdef MULTI_FCQ
+		"  -M, --channels=n		Open n number of channels. Also enables XDP_SHARED_UMEM (cannot be used with -R).\n"
+#else
+		"  -M, --shared-umem	Enable XDP_SHARED_UMEM (cannot be used with -R)\n"
+#endif
+		"  -F, --force		Force loading the XDP prog\n"
+		"  -d, --duration=n	Duration in secs to run command.\n"
+		"			Default: forever.\n"
+		"  -w, --clock=CLOCK	Clock NAME (default MONOTONIC).\n"
+		"  -b, --batch-size=n	Batch size for sending or receiving\n"
+		"			packets. Default: %d\n"
+		"  -C, --tx-pkt-count=n	Number of packets to send.\n"
+		"			Default: Continuous packets.\n"
+		"  -s, --tx-pkt-size=n	Transmit packet size.\n"
+		"			(Default: %d bytes)\n"
+		"			Min size: %d, Max size %d.\n"
+		"  -P, --tx-pkt-pattern=nPacket fill pattern. Default: 0x%x\n"
+		"  -V, --tx-vlan        Send VLAN tagged  packets (For -t|--txonly)\n"
+		"  -J, --tx-vlan-id=n   Tx VLAN ID [1-4095]. Default: %d (For -V|--tx-vlan)\n"
+		"  -K, --tx-vlan-pri=n  Tx VLAN Priority [0-7]. Default: %d (For -V|--tx-vlan)\n"
+		"  -G, --tx-dmac=<MAC>  Dest MAC addr of TX frame in aa:bb:cc:dd:ee:ff format (For -V|--tx-vlan)\n"
+		"  -H, --tx-smac=<MAC>  Src MAC addr of TX frame in aa:bb:cc:dd:ee:ff format (For -V|--tx-vlan)\n"
+		"  -T, --tx-cycle=n     Tx cycle time in micro-seconds (For -t|--txonly).\n"
+		"  -y, --tstamp         Add time-stamp to packet (For -t|--txonly).\n"
+		"  -W, --policy=POLICY  Schedule policy. Default: SCHED_OTHER\n"
+		"  -U, --schpri=n       Schedule priority. Default: %d\n"
+		"  -x, --extra-stats	Display extra statistics.\n"
+		"  -Q, --quiet          Do not display any stats.\n"
+		"  -a, --app-stats	Display application (syscall) statistics.\n"
+		"  -I, --irq-string	Display driver interrupt statistics for interface associated with irq-string.\n"
+		"  -B, --busy-poll      Busy poll.\n"
+		"  -R, --reduce-cap	Use reduced capabilities (cannot be used with -M)\n"
+		"  --batch-auto=MIN:MAX	Autotune each socket's batch size between MIN and MAX\n"
+		"			from ring occupancy and empty polls (overrides -b).\n"
+		"  --busy-poll-profile=P[,P...]\n"
+		"			Busy poll (implies -B) with profile default, latency, balanced\n"
+		"			or throughput, one per socket (the last one repeats).\n"
+		"  --napi-cpu=n		First CPU to pin threaded NAPI kthreads to. Default: 0\n"
+		"  --latency-rate=n	Probes per second per socket (For --latency).\n"
+		"			Default: 0, ping-pong with one probe in flight.\n"
+		"  --rxcheck		Verify pktgen headers of received packets: count sequence\n"
+		"			gaps, duplicates and reordering per stream, and one-way\n"
+		"			latency if the sender shares our clock (For -r|--rxdrop).\n"
+		"  --flows=n		Number of UDP flows to generate (For -t|--txonly). Default: 1\n"
+		"  --flow-src-ip=A[-B]	Source IP range of generated flows. Default: 10.10.10.16\n"
+		"  --flow-dst-ip=A[-B]	Destination IP range. Default: 10.10.10.32\n"
+		"  --flow-src-port=P[-Q]	Source UDP port range. Default: 4096\n"
+		"  --flow-dst-port=P[-Q]	Destination UDP port range. Default: 4096\n"
+		"  --flow-dist=DIST	Flow distribution over frames: rr, uniform or zipf[:s].\n"
+		"			Default: rr\n"
+		"  --tx-size-profile=P	Vary TX frame sizes (For -t|--txonly), P is one of:\n"
+		"			imix            simple IMIX, 64/594/1518 at 7:4:1\n"
+		"			SIZE@W,...      weighted list, e.g. 64@7,594@4,1518@1\n"
+		"			range:MIN-MAX   uniform over MIN..MAX\n"
+		"  --replay=FILE		Transmit the packets of an Ethernet pcap in a loop, spread\n"
+		"			over channels by flow hash (implies -t|--txonly).\n"
+		"  --replay-speed=S	line (default, as fast as possible or -T paced), orig\n"
+		"			(capture timing) or a capture timing multiplier.\n"
+		"  --capture=PREFIX	Write received frames to PREFIX-<if>-q<queue>.pcap, one\n"
+		"			file per channel (implies -r|--rxdrop).\n"
+		"  --snaplen=N		Truncate captured frames to N bytes. Default: 65535.\n"
+		"  --sample=N		Capture one in N received frames. Default: 1.\n"
+		"  --capture-format=F	pcap (default) or pcapng.\n"
+		"  --l3fwd		IPv4/IPv6 LPM routing, needs --routes and --neigh.\n"
+		"  --routes=FILE		Route file, lines of \"<prefix>/<len> <next hop>\".\n"
+		"  --neigh=FILE		Neighbour file, lines of \"<next hop> <mac> [<xsk>]\";\n"
+		"			frames are forwarded on socket <xsk> (default 0).\n"
+		"  --rate=R[,R...]	Pace txonly with a token bucket per channel. R is a\n"
+		"			number with optional k/M/G and a pps or bps unit\n"
+		"			(frame bits incl. FCS), e.g. 1.5Mpps or 10Gbps. One R\n"
+		"			applies to all channels, otherwise one per channel.\n"
+		"  --rate-burst=N	Bucket depth in frames. Default: -b batch size.\n"
+		"  --rfc2544[=S,S...]	Search the highest rate within --loss-tolerance for\n"
+		"			each frame size S, sending and receiving pktgen frames\n"
+		"			on every channel. Default: 64,128,256,512,1024,1280,1518\n"
+		"  --trial-time=SECS	Duration of one --rfc2544 trial. Default: 5.\n"
+		"  --loss-tolerance=PCT	Loss accepted by --rfc2544, in percent. Default: 0.\n"
+		"  --testbed[=MODE]	Ignore -i and run against a veth pair in two new netns:\n"
+		"			txonly on one end, MODE (rxdrop, l2fwd) on the other,\n"
+		"			or latency against l2fwd. Default MODE: rxdrop.\n"
+		"  --sweep=SPEC		Run once per cell of a matrix and print a result row per\n"
+		"			cell. SPEC is dim=v,v;dim=v,... over fcq (multi,single),\n"
+		"			channels, bind (zc,copy), mode (poll,busy-poll,wakeup,\n"
+		"			no-wakeup), batch and size. Other options apply to all.\n"
+		"  --sweep-format=F	csv (default) or json (one object per line).\n"
+		"  --warmup=SECS		Seconds excluded from --sweep results, added to -d\n"
+		"			(default 10s per cell).\n"
+		"\nMAX_SOCKS:%d MULTI_FCQ:%s KRNL:%s DEBUGMODE:%s\n"
+		"\n";
+	fprintf(stderr, str, prog, XSK_UMEM__DEFAULT_FRAME_SIZE,
+		opt_batch_size, MIN_PKT_SIZE, MIN_PKT_SIZE,
+		XSK_UMEM__DEFAULT_FRAME_SIZE, opt_pkt_fill_pattern,
+		VLAN_VID__DEFAULT, VLAN_PRI__DEFAULT,
+		SCHED_PRI__DEFAULT,
+		MAX_SOCKS,
+#ifdef MULTI_FCQ
+		"Yes",
+#else
+		"No",
+#endif
+		xdpsock_krnl,
+#ifdef USE_DEBUGMODE
+		"Yes"
+#else
+		"No"
+#endif
+		);
+
+	exit(EXIT_FAILURE);
+}
+
+/* "A" or "A-B", B >= A, results in host order. */
+static int parse_ip_range(const char *str, u32 *range)
+{
+	char buf[64], *dash;
+	struct in_addr a, b;
+
+	snprintf(buf, sizeof(buf), "%s", str);
+	dash = strchr(buf, '-');
+	if (dash)
+		*dash++ = '\0';
+
+	if (inet_pton(AF_INET, buf, &a) != 1)
+		return -EINVAL;
+	if (dash == NULL)
+		b = a;
+	else if (inet_pton(AF_INET, dash, &b) != 1)
+		return -EINVAL;
+
+	if (ntohl(b.s_addr) < ntohl(a.s_addr))
+		return -EINVAL;
+
+	range[0] = ntohl(a.s_addr);
+	range[1] = ntohl(b.s_addr);
+	return 0;
+}
+
+static int parse_port_range(const char *str, u16 *range)
+{
+	unsigned int lo, hi;
+	int n = sscanf(str, "%u-%u", &lo, &hi);
+
+	if (n == 1)
+		hi = lo;
+	else if (n != 2)
+		return -EINVAL;
+
+	if (hi < lo || hi > 0xffff)
+		return -EINVAL;
+
+	range[0] = lo;
+	range[1] = hi;
+	return 0;
+}
+
+/* A dotted quad or a number, 0x for hex */
+static int parse_mutator_value(const char *str, u32 *val)
+{
+	struct in_addr a;
+	char *end;
+
+	if (inet_pton(AF_INET, str, &a) == 1) {
+		*val = ntohl(a.s_addr);
+		return 0;
+	}
+
+	errno = 0;
+	*val = strtoul(str, &end, 0);
+	return errno || end == str || *end ? -EINVAL : 0;
+}
+
+/* "FIELD=inc:A-B[/STEP]", "FIELD=rand:A-B" or "FIELD=list:V,V,..." */
+static int parse_mutator(char *spec)
+{
+	struct tx_mutator *m = &opt_mutators[opt_num_mutators];
+	char *kind, *args, *tok, *save;
+	unsigned int off, width;
+	u32 limit;
+	int f;
+
+	if (opt_num_mutators == MUTATORS_MAX)
+		return -E2BIG;
+
+	kind = strchr(spec, '=');
+	if (!kind)
+		return -EINVAL;
+	*kind++ = '\0';
+	args = strchr(kind, ':');
+	if (!args)
+		return -EINVAL;
+	*args++ = '\0';
+
+	memset(m, 0, sizeof(*m));
+	if (sscanf(spec, "@%u.%u", &off, &width) == 2) {
+		if ((width != 1 && width != 2 && width != 4) || off + width > opt_xsk_frame_size)
+			return -EINVAL;
+		m->field = MUT_FIELD_RAW;
+		m->off = off;
+		m->width = width;
+		m->mask = width == 4 ? 0xffffffff : (1U << (width * 8)) - 1;
+	} else {
+		for (f = MUT_FIELD_RAW + 1; f < MUT_FIELD_NUM; f++)
+			if (!strcmp(spec, mutator_fields[f].name))
+				break;
+		if (f == MUT_FIELD_NUM)
+			return -EINVAL;
+		m->field = f;
+		m->mask = mutator_fields[f].mask;
+		m->shift = mutator_fields[f].shift;
+	}
+	limit = m->mask >> m->shift;
+
+	if (!strcmp(kind, "list")) {
+		m->kind = MUT_LIST;
+		for (tok = strtok_r(args, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			if (m->nlist == MUTATOR_LIST_MAX ||
+			    parse_mutator_value(tok, &m->list[m->nlist]) ||
+			    m->list[m->nlist] > limit)
+				return -EINVAL;
+			m->nlist++;
+		}
+		if (!m->nlist)
+			return -EINVAL;
+	} else if (!strcmp(kind, "inc") || !strcmp(kind, "rand")) {
+		char *dash, *slash;
+
+		m->kind = kind[0] == 'i' ? MUT_INC : MUT_RAND;
+		m->step = 1;
+		slash = strchr(args, '/');
+		if (slash) {
+			*slash++ = '\0';
+			if (m->kind != MUT_INC || parse_mutator_value(slash, &m->step) || !m->step)
+				return -EINVAL;
+		}
+		dash = strchr(args, '-');
+		if (!dash)
+			return -EINVAL;
+		*dash++ = '\0';
+		if (parse_mutator_value(args, &m->min) || parse_mutator_value(dash, &m->max) ||
+		    m->max < m->min || m->max > limit)
+			return -EINVAL;
+	} else {
+		return -EINVAL;
+	}
+
+	opt_num_mutators++;
+	return 0;
+}
+
+/* --sweep: run this benchmark once per cell of a parameter matrix, each in a
+ * fresh child process, and print one result row per cell.
+ */
+#define SWEEP_DIMS		6
+#define SWEEP_MAX_VALS		16
+
+enum { SWEEP_FCQ, SWEEP_CHANNELS, SWEEP_BIND, SWEEP_MODE, SWEEP_BATCH, SWEEP_SIZE };
+
+static const char *const sweep_dim_names[SWEEP_DIMS] = {
+	"fcq", "channels", "bind", "mode", "batch", "size"
+};
+static char *sweep_vals[SWEEP_DIMS][SWEEP_MAX_VALS];
+static int sweep_nvals[SWEEP_DIMS];
+
+static int parse_sweep(char *spec)
+{
+	char *dim, *val, *save_dim, *save_val, *eq;
+	int d;
+
+	for (dim = strtok_r(spec, ";", &save_dim); dim; dim = strtok_r(NULL, ";", &save_dim)) {
+		eq = strchr(dim, '=');
+		if (!eq)
+			return -EINVAL;
+		*eq = '\0';
+
+		for (d = 0; d < SWEEP_DIMS; d++)
+			if (!strcmp(dim, sweep_dim_names[d]))
+				break;
+		if (d == SWEEP_DIMS || sweep_nvals[d])
+			return -EINVAL;
+
+		for (val = strtok_r(eq + 1, ",", &save_val); val;
+		     val = strtok_r(NULL, ",", &save_val)) {
+			if (sweep_nvals[d] == SWEEP_MAX_VALS)
+				return -EINVAL;
+			if ((d == SWEEP_FCQ && strcmp(val, "multi") && strcmp(val, "single")) ||
+			    (d == SWEEP_BIND && strcmp(val, "zc") && strcmp(val, "copy")) ||
+			    (d == SWEEP_MODE && strcmp(val, "poll") && strcmp(val, "busy-poll") &&
+			     strcmp(val, "wakeup") && strcmp(val, "no-wakeup")) ||
+			    (d != SWEEP_FCQ && d != SWEEP_BIND && d != SWEEP_MODE && !atoi(val)))
+				return -EINVAL;
+			sweep_vals[d][sweep_nvals[d]++] = val;
+		}
+	}
+
+	return 0;
+}
+
+/* "<number>[k|M|G]<pps|bps>", e.g. 1.5Mpps or 10Gbps. */
+static int parse_rate(const char *str, struct rate_spec *spec)
+{
+	char *end;
+
+	spec->rate = strtod(str, &end);
+	switch (*end) {
+	case 'k': case 'K':
+		spec->rate *= 1e3;
+		end++;
+		break;
+	case 'm': case 'M':
+		spec->rate *= 1e6;
+		end++;
+		break;
+	case 'g': case 'G':
+		spec->rate *= 1e9;
+		end++;
+		break;
+	}
+
+	if (!strcasecmp(end, "pps"))
+		spec->bps = false;
+	else if (!strcasecmp(end, "bps"))
+		spec->bps = true;
+	else
+		return -EINVAL;
+
+	return spec->rate > 0 ? 0 : -EINVAL;
+}
+
+static int parse_size_profile(const char *str)
+{
+	char buf[256], *tok, *save;
+	unsigned int lo, hi;
+
+	if (!strcasecmp(str, "imix")) {
+		opt_sizes[0] = (struct size_weight){ 64, 7 };
+		opt_sizes[1] = (struct size_weight){ 594, 4 };
+		opt_sizes[2] = (struct size_weight){ 1518, 1 };
+		opt_num_sizes = 3;
+		opt_size_profile = SIZE_PROFILE_IMIX;
+		return 0;
+	}
+
+	if (sscanf(str, "range:%u-%u", &lo, &hi) == 2) {
+		if (lo > hi || lo < MIN_PKT_SIZE || hi > XSK_UMEM__DEFAULT_FRAME_SIZE)
+			return -EINVAL;
+		opt_size_range[0] = lo;
+		opt_size_range[1] = hi;
+		opt_size_profile = SIZE_PROFILE_RANGE;
+		return 0;
+	}
+
+	snprintf(buf, sizeof(buf), "%s", str);
+	opt_num_sizes = 0;
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		unsigned int size, weight = 1;
+
+		if (opt_num_sizes == SIZE_LIST_MAX ||
+		    sscanf(tok, "%u@%u", &size, &weight) < 1 || !weight ||
+		    size < MIN_PKT_SIZE || size > XSK_UMEM__DEFAULT_FRAME_SIZE)
+			return -EINVAL;
+		opt_sizes[opt_num_sizes++] = (struct size_weight){ size, weight };
+	}
+	if (!opt_num_sizes)
+		return -EINVAL;
+
+	opt_size_profile = SIZE_PROFILE_LIST;
+	return 0;
+}
+
+static void parse_command_line(int argc, char **argv)
+{
+	int option_index, c, i;
+	char *token;
+
+	opterr = 0;
+
+	for (;;) {
+		c = getopt_long(argc, argv,
+#ifdef MULTI_FCQ
+				"Frtli:q:pSNn:w:O:czf:muM:d:b:C:s:P:VJ:K:G:H:T:yW:U:xQaI:BR",
+#else
+				"Frtli:q:pSNn:w:O:czf:muMd:b:C:s:P:VJ:K:G:H:T:yW:U:xQaI:BR",
+#endif
+				long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'r':
+			opt_bench = BENCH_RXDROP;
+			break;
+		case 't':
+			opt_bench = BENCH_TXONLY;
+			break;
+		case 'l':
+			opt_bench = BENCH_L2FWD;
+			break;
+		case 'i':
+			opt_if = optarg;
+			break;
+		case 'q':
+			opt_queue = atoi(optarg);
+			break;
+		case 'p':
+			opt_poll = 1;
+			break;
+		case 'S':
+			opt_xdp_flags |= XDP_FLAGS_SKB_MODE;
+			opt_xdp_bind_flags |= XDP_COPY;
+			break;
+		case 'N':
+			/* default, set below */
+			break;
+		case 'n':
+			opt_interval = atoi(optarg);
+			break;
+		case 'w':
+			if (get_clockid(&opt_clock, optarg)) {
+				fprintf(stderr,
+					"ERROR: Invalid clock %s. Default to CLOCK_MONOTONIC.\n",
+					optarg);
+				opt_clock = CLOCK_MONOTONIC;
+			}
+			break;
+		case 'O':
+			opt_retries = atoi(optarg);
+			break;
+		case 'z':
+			opt_xdp_bind_flags |= XDP_ZEROCOPY;
+			break;
+		case 'c':
+			opt_xdp_bind_flags |= XDP_COPY;
+			break;
+		case 'u':
+			opt_umem_flags |= XDP_UMEM_UNALIGNED_CHUNK_FLAG;
+			opt_unaligned_chunks = 1;
+			opt_mmap_flags = MAP_HUGETLB;
+			break;
+		case 'F':
+			opt_xdp_flags &= ~XDP_FLAGS_UPDATE_IF_NOEXIST;
+			break;
+		case 'f':
+			opt_xsk_frame_size = atoi(optarg);
 			break;
-		case 'O':
-			opt_retries = atoi(optarg);
-			break;
-		case 'z':
-			opt_xdp_bind_flags |= XDP_ZEROCOPY;
-			break;
-		case 'c':
-			opt_xdp_bind_flags |= XDP_COPY;
-			break;
-		case 'u':
-			opt_umem_flags |= XDP_UMEM_UNALIGNED_CHUNK_FLAG;
-			opt_unaligned_chunks = 1;
-			opt_mmap_flags = MAP_HUGETLB;
-			break;
-		case 'F':
-			opt_xdp_flags &= ~XDP_FLAGS_UPDATE_IF_NOEXIST;
-			break;
-		case 'f':
-			opt_xsk_frame_size = atoi(optarg);
-			break;
 		case 'm':
 			opt_need_wakeup = false;
 			opt_xdp_bind_flags &= ~XDP_USE_NEED_WAKEUP;
 			break;
-		case 'M':
+		case 'M':
+#ifdef MULTI_FCQ
+			opt_num_xsks = atoi(optarg);
+			if (opt_num_xsks == 0 || opt_num_xsks > MAX_SOCKS)
+			{
+				fprintf(stderr, "ERROR: Invalid number of XSK sockets: %d (Min: 1 Max: %d)\n",
+					opt_num_xsks, MAX_SOCKS);
+				usage(basename(argv[0]));
+			}
+#else
+			opt_num_xsks = MAX_SOCKS;
+#endif
+			break;
+		case 'd':
+			opt_duration = atoi(optarg);
+			opt_duration *= 1000000000;
+			break;
+		case 'b':
+			opt_batch_size = atoi(optarg);
+			break;
+		case 'C':
+			opt_pkt_count = atoi(optarg);
+			break;
+		case 's':
+			opt_pkt_size = atoi(optarg);
+			if (opt_pkt_size > (XSK_UMEM__DEFAULT_FRAME_SIZE) ||
+			    opt_pkt_size < MIN_PKT_SIZE) {
+				fprintf(stderr,
+					"ERROR: Invalid frame size %d\n",
+					opt_pkt_size);
+				usage(basename(argv[0]));
+			}
+			break;
+		case 'P':
+			opt_pkt_fill_pattern = strtol(optarg, NULL, 16);
+			break;
+		case 'V':
+			opt_vlan_tag = true;
+			break;
+		case 'J':
+			opt_pkt_vlan_id = atoi(optarg);
+			break;
+		case 'K':
+			opt_pkt_vlan_pri = atoi(optarg);
+			break;
+		case 'G':
+			if (!ether_aton_r(optarg,
+					  (struct ether_addr *)&opt_txdmac)) {
+				fprintf(stderr, "Invalid dmac address:%s\n",
+					optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case 'H':
+			if (!ether_aton_r(optarg,
+					  (struct ether_addr *)&opt_txsmac)) {
+				fprintf(stderr, "Invalid smac address:%s\n",
+					optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case 'T':
+			opt_tx_cycle_ns = atoi(optarg);
+			opt_tx_cycle_ns *= NSEC_PER_USEC;
+			break;
+		case 'y':
+			opt_tstamp = 1;
+			break;
+		case 'W':
+			if (get_schpolicy(&opt_schpolicy, optarg)) {
+				fprintf(stderr,
+					"ERROR: Invalid policy %s. Default to SCHED_OTHER.\n",
+					optarg);
+				opt_schpolicy = SCHED_OTHER;
+			}
+			break;
+		case 'U':
+			opt_schprio = atoi(optarg);
+			break;
+		case 'x':
+			opt_extra_stats = 1;
+			break;
+		case 'Q':
+			opt_quiet = 1;
+			break;
+		case 'a':
+			opt_app_stats = 1;
+			break;
+		case 'I':
+			opt_irq_str = optarg;
+			if (get_interrupt_number())
+				irqs_at_init = get_irqs();
+			if (irqs_at_init < 0) {
+				fprintf(stderr, "ERROR: Failed to get irqs for %s\n", opt_irq_str);
+				usage(basename(argv[0]));
+			}
+			break;
+		case 'B':
+			opt_busy_poll = 1;
+			break;
+		case 'R':
+			opt_reduced_cap = true;
+			break;
+		case OPT_BATCH_AUTO:
+			if (sscanf(optarg, "%u:%u", &opt_batch_min, &opt_batch_max) != 2 ||
+			    !opt_batch_min || opt_batch_min > opt_batch_max ||
+			    opt_batch_max > XSK_RING_PROD__DEFAULT_NUM_DESCS) {
+				fprintf(stderr, "ERROR: Invalid --batch-auto %s (1 <= MIN <= MAX <= %d)\n",
+					optarg, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+				usage(basename(argv[0]));
+			}
+			opt_batch_auto = true;
+			break;
+		case OPT_BP_PROFILE: {
+			char *list = strdup(optarg), *name, *save;
+
+			opt_bp_num_profiles = 0;
+			for (name = strtok_r(list, ",", &save); name;
+			     name = strtok_r(NULL, ",", &save)) {
+				const struct busy_poll_profile *prof = get_bp_profile(name);
+
+				if (!prof || opt_bp_num_profiles == MAX_SOCKS) {
+					fprintf(stderr, "ERROR: Invalid busy poll profile %s\n", name);
+					usage(basename(argv[0]));
+				}
+				opt_bp_profiles[opt_bp_num_profiles++] = prof;
+			}
+			free(list);
+			opt_busy_poll = 1;
+			break;
+		}
+		case OPT_NAPI_CPU:
+			opt_napi_cpu = atoi(optarg);
+			break;
+		case OPT_LATENCY:
+			opt_bench = BENCH_LATENCY;
+			break;
+		case OPT_LATENCY_RATE:
+			opt_lat_rate = strtoul(optarg, NULL, 0);
+			if (opt_lat_rate > NSEC_PER_SEC) {
+				fprintf(stderr, "ERROR: Invalid latency rate %s (Max: %lu)\n",
+					optarg, NSEC_PER_SEC);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_RXCHECK:
+			opt_rxcheck = true;
+			break;
+		case OPT_FLOWS:
+			opt_flow_count = atoi(optarg);
+			if (!opt_flow_count || opt_flow_count > NUM_FRAMES) {
+				fprintf(stderr, "ERROR: Invalid number of flows %s (Min: 1 Max: %d)\n",
+					optarg, NUM_FRAMES);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_FLOW_SRC_IP:
+		case OPT_FLOW_DST_IP:
+			if (parse_ip_range(optarg, c == OPT_FLOW_SRC_IP ?
+					   opt_flow_sip : opt_flow_dip)) {
+				fprintf(stderr, "ERROR: Invalid IP range %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_FLOW_SRC_PORT:
+		case OPT_FLOW_DST_PORT:
+			if (parse_port_range(optarg, c == OPT_FLOW_SRC_PORT ?
+					     opt_flow_sport : opt_flow_dport)) {
+				fprintf(stderr, "ERROR: Invalid port range %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_FLOW_DIST:
+			if (!strcasecmp(optarg, "rr")) {
+				opt_flow_dist = FLOW_DIST_RR;
+			} else if (!strcasecmp(optarg, "uniform")) {
+				opt_flow_dist = FLOW_DIST_UNIFORM;
+			} else if (!strncasecmp(optarg, "zipf", 4) &&
+				   (optarg[4] == '\0' || optarg[4] == ':')) {
+				opt_flow_dist = FLOW_DIST_ZIPF;
+				if (optarg[4] == ':')
+					opt_flow_zipf_s = atof(optarg + 5);
+			} else {
+				fprintf(stderr, "ERROR: Invalid flow distribution %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_SIZE_PROFILE:
+			if (parse_size_profile(optarg)) {
+				fprintf(stderr, "ERROR: Invalid size profile %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_REPLAY:
+			opt_replay = optarg;
+			opt_bench = BENCH_TXONLY;
+			break;
+		case OPT_REPLAY_SPEED:
+			if (!strcasecmp(optarg, "line")) {
+				opt_replay_speed = 0;
+			} else if (!strcasecmp(optarg, "orig")) {
+				opt_replay_speed = 1;
+			} else {
+				opt_replay_speed = atof(optarg);
+				if (opt_replay_speed <= 0) {
+					fprintf(stderr, "ERROR: Invalid replay speed %s\n", optarg);
+					usage(basename(argv[0]));
+				}
+			}
+			break;
+		case OPT_CAPTURE:
+			opt_capture = optarg;
+			opt_bench = BENCH_RXDROP;
+			break;
+		case OPT_SNAPLEN:
+			opt_snaplen = atoi(optarg);
+			if (!opt_snaplen) {
+				fprintf(stderr, "ERROR: Invalid snaplen %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_SAMPLE:
+			opt_sample = atoi(optarg);
+			if (!opt_sample) {
+				fprintf(stderr, "ERROR: Invalid sample rate %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_CAPTURE_FORMAT:
+			if (!strcasecmp(optarg, "pcapng")) {
+				opt_capture_pcapng = true;
+			} else if (strcasecmp(optarg, "pcap")) {
+				fprintf(stderr, "ERROR: Unknown capture format %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_L3FWD:
+			opt_bench = BENCH_L3FWD;
+			break;
+		case OPT_ROUTES:
+			opt_routes = optarg;
+			break;
+		case OPT_NEIGH:
+			opt_neigh = optarg;
+			break;
+		case OPT_RATE: {
+			char *list = strdup(optarg), *save;
+
+			for (token = strtok_r(list, ",", &save); token;
+			     token = strtok_r(NULL, ",", &save)) {
+				if (opt_num_rates == MAX_SOCKS ||
+				    parse_rate(token, &opt_rates[opt_num_rates])) {
+					fprintf(stderr, "ERROR: Invalid rate %s\n", token);
+					usage(basename(argv[0]));
+				}
+				opt_num_rates++;
+			}
+			free(list);
+			break;
+		}
+		case OPT_RATE_BURST:
+			opt_rate_burst = atoi(optarg);
+			break;
+		case OPT_RFC2544: {
+			char *list, *save;
+
+			opt_bench = BENCH_RFC2544;
+			if (!optarg)
+				break;
+			list = strdup(optarg);
+			opt_rfc2544_num_sizes = 0;
+			for (token = strtok_r(list, ",", &save); token;
+			     token = strtok_r(NULL, ",", &save)) {
+				if (opt_rfc2544_num_sizes == SIZE_LIST_MAX || !atoi(token)) {
+					fprintf(stderr, "ERROR: Invalid --rfc2544 frame sizes\n");
+					usage(basename(argv[0]));
+				}
+				opt_rfc2544_sizes[opt_rfc2544_num_sizes++] = atoi(token);
+			}
+			free(list);
+			break;
+		}
+		case OPT_TRIAL_TIME:
+			opt_trial_time = atoi(optarg);
+			if (!opt_trial_time) {
+				fprintf(stderr, "ERROR: Invalid trial time %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_LOSS_TOLERANCE:
+			opt_loss_tolerance = atof(optarg);
+			break;
+		case OPT_TESTBED:
+			opt_testbed = true;
+			if (!optarg || !strcmp(optarg, "rxdrop")) {
+				opt_testbed_mode = BENCH_RXDROP;
+			} else if (!strcmp(optarg, "l2fwd")) {
+				opt_testbed_mode = BENCH_L2FWD;
+			} else if (!strcmp(optarg, "latency")) {
+				opt_testbed_mode = BENCH_LATENCY;
+			} else {
+				fprintf(stderr, "ERROR: Unknown testbed mode %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_SWEEP:
+			opt_sweep = strdup(optarg);
+			if (parse_sweep(opt_sweep)) {
+				fprintf(stderr, "ERROR: Invalid --sweep spec %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_SWEEP_FORMAT:
+			if (!strcmp(optarg, "json")) {
+				opt_sweep_json = true;
+			} else if (strcmp(optarg, "csv")) {
+				fprintf(stderr, "ERROR: Unknown sweep format %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_WARMUP:
+			opt_warmup = atoi(optarg);
+			break;
+		case OPT_RESULT_FD:
+			opt_result_fd = atoi(optarg);
+			break;
+		case OPT_REFLECT:
+			opt_bench = BENCH_L2FWD;
+			opt_reflect = true;
+			break;
+		case OPT_BURST:
+			opt_bench = BENCH_TXONLY;
+			if (sscanf(optarg, "exp%u", &opt_burst_size[0]) == 1) {
+				opt_burst = BURST_EXP;
+			} else if (sscanf(optarg, "%u-%u", &opt_burst_size[0],
+					  &opt_burst_size[1]) == 2) {
+				opt_burst = BURST_UNIFORM;
+			} else {
+				opt_burst_size[0] = atoi(optarg);
+				opt_burst = BURST_FIXED;
+			}
+			if (!opt_burst_size[0] ||
+			    (opt_burst == BURST_UNIFORM && opt_burst_size[1] < opt_burst_size[0])) {
+				fprintf(stderr, "ERROR: Invalid burst size %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_BURST_IDLE:
+			opt_burst_idle_us = atoi(optarg);
+			break;
+		case OPT_BURST_SYNC:
+			opt_burst_sync = true;
+			break;
+		case OPT_BURST_DETECT:
+			opt_burst_detect_us = atoi(optarg);
+			break;
+		case OPT_TEMPLATE:
+			opt_template = optarg;
+			opt_bench = BENCH_TXONLY;
+			break;
+		case OPT_MUTATE:
+			if (parse_mutator(optarg)) {
+				fprintf(stderr, "ERROR: Invalid mutator %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_CSUM:
+			opt_csum_kernel = optarg;
+			break;
+		case OPT_CSUM_BENCH:
+			opt_csum_bench = true;
+			break;
+		case OPT_ENCAP:
+			if (!strcasecmp(optarg, "vxlan")) {
+				opt_encap = ENCAP_VXLAN;
+			} else if (!strcasecmp(optarg, "gre")) {
+				opt_encap = ENCAP_GRE;
+			} else if (!strcasecmp(optarg, "gtpu")) {
+				opt_encap = ENCAP_GTPU;
+			} else {
+				fprintf(stderr, "ERROR: Invalid encapsulation %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_ENCAP_SRC_IP:
+		case OPT_ENCAP_DST_IP: {
+			struct in_addr a;
+
+			if (inet_pton(AF_INET, optarg, &a) != 1) {
+				fprintf(stderr, "ERROR: Invalid IP %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			*(c == OPT_ENCAP_SRC_IP ? &opt_encap_sip : &opt_encap_dip) = ntohl(a.s_addr);
+			break;
+		}
+		case OPT_TUNNEL_ID:
+			opt_tunnel_id = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_BATCH_HIST:
+			opt_batch_hist = true;
+			break;
+		case OPT_STATS_FORMAT:
+			if (!strcasecmp(optarg, "text")) {
+				opt_stats_format = STATS_TEXT;
+			} else if (!strcasecmp(optarg, "json")) {
+				opt_stats_format = STATS_JSON;
+			} else if (!strcasecmp(optarg, "csv")) {
+				opt_stats_format = STATS_CSV;
+			} else {
+				fprintf(stderr, "ERROR: Invalid stats format %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			break;
+		case OPT_METRICS: {
+			char *end;
+			long port;
+
+			opt_metrics = optarg;
+			if (!strncmp(optarg, "unix:", 5)) {
+				if (!optarg[5] || strlen(optarg + 5) >=
+				    sizeof(((struct sockaddr_un *)0)->sun_path)) {
+					fprintf(stderr, "ERROR: Invalid --metrics socket path\n");
+					usage(basename(argv[0]));
+				}
+				break;
+			}
+			port = strtol(optarg, &end, 10);
+			if (*end || port < 1 || port > 65535) {
+				fprintf(stderr, "ERROR: Invalid --metrics port %s\n", optarg);
+				usage(basename(argv[0]));
+			}
+			opt_metrics_port = port;
+			break;
+		}
+		case OPT_PERF_COUNTERS:
+			opt_perf_counters = true;
+			break;
+		case OPT_UTIL:
+			opt_util = true;
+			break;
+		default:
+			usage(basename(argv[0]));
+		}
+	}
+
+	if (!(opt_xdp_flags & XDP_FLAGS_SKB_MODE))
+		opt_xdp_flags |= XDP_FLAGS_DRV_MODE;
+
+	/* --testbed creates its interfaces later, --csum-bench needs none */
+	opt_ifindex = opt_testbed || opt_csum_bench ? 0 : if_nametoindex(opt_if);
+	if (!opt_ifindex && !opt_testbed && !opt_csum_bench) {
+		fprintf(stderr, "ERROR: interface \"%s\" does not exist\n",
+			opt_if);
+		usage(basename(argv[0]));
+	}
+
+	if ((opt_xsk_frame_size & (opt_xsk_frame_size - 1)) &&
+	    !opt_unaligned_chunks) {
+		fprintf(stderr, "--frame-size=%d is not a power of two\n",
+			opt_xsk_frame_size);
+		usage(basename(argv[0]));
+	}
+
+	if (opt_reduced_cap && opt_num_xsks > 1) {
+		fprintf(stderr, "ERROR: -M and -R cannot be used together\n");
+		usage(basename(argv[0]));
+	}
+
+	if (opt_size_profile != SIZE_PROFILE_FIXED) {
+		u32 max = opt_size_range[1];
+
+		for (i = 0; i < opt_num_sizes; i++)
+			if (opt_sizes[i].size > max)
+				max = opt_sizes[i].size;
+		if (max > opt_xsk_frame_size) {
+			fprintf(stderr, "ERROR: --tx-size-profile size %u exceeds --frame-size=%d\n",
+				max, opt_xsk_frame_size);
+			usage(basename(argv[0]));
+		}
+	}
+
+	if ((opt_template || opt_num_mutators) &&
+	    (opt_bench != BENCH_TXONLY || opt_replay || opt_tstamp)) {
+		fprintf(stderr, "ERROR: --template and --mutate are for -t|--txonly, without --replay or -y\n");
+		usage(basename(argv[0]));
+	}
+
+	if (opt_template && (opt_flow_count > 1 || opt_size_profile != SIZE_PROFILE_FIXED)) {
+		fprintf(stderr, "ERROR: --template fixes the frame, --flows and --tx-size-profile don't apply\n");
+		usage(basename(argv[0]));
+	}
+
+#ifndef MULTI_FCQ
+	/* Each socket's TX image holds only the first slots of the flow pattern */
+	if (opt_flow_count > NUM_FRAMES / opt_num_xsks) {
+		fprintf(stderr, "ERROR: --flows %u exceeds the %u TX slots of each of the %u sockets sharing the UMEM\n",
+			opt_flow_count, NUM_FRAMES / opt_num_xsks, opt_num_xsks);
+		usage(basename(argv[0]));
+	}
+#endif
+
+	if (opt_encap && (opt_bench == BENCH_LATENCY || opt_bench == BENCH_RFC2544 ||
+			  opt_replay || opt_template)) {
+		fprintf(stderr, "ERROR: --encap is for the built-in txonly frame and its receivers\n");
+		usage(basename(argv[0]));
+	}
+
+	if (opt_encap == ENCAP_VXLAN && opt_tunnel_id > 0xffffff) {
+		fprintf(stderr, "ERROR: VXLAN VNIs are 24 bits\n");
+		usage(basename(argv[0]));
+	}
+
+	if (opt_perf_counters && (opt_bench == BENCH_LATENCY || opt_bench == BENCH_RFC2544 ||
+				  opt_burst)) {
+		fprintf(stderr, "ERROR: --perf-counters is for rxdrop, txonly, l2fwd and l3fwd\n");
+		usage(basename(argv[0]));
+	}
+
+	if (opt_util && (opt_bench == BENCH_LATENCY || opt_bench == BENCH_RFC2544 || opt_burst)) {
+		fprintf(stderr, "ERROR: --util is for rxdrop, txonly, l2fwd and l3fwd\n");
+		usage(basename(argv[0]));
+	}
+
+	if (opt_burst && (opt_replay || opt_num_rates || opt_tx_cycle_ns)) {
+		fprintf(stderr, "ERROR: --burst can't be combined with --replay, --rate or --tx-cycle\n");
+		usage(basename(argv[0]));
+	}
+
+	if (opt_num_rates && (opt_bench != BENCH_TXONLY || opt_replay || opt_tx_cycle_ns)) {
+		fprintf(stderr, "ERROR: --rate applies to txonly, without --replay or --tx-cycle\n");
+		usage(basename(argv[0]));
+	}
+	if (opt_num_rates > 1 && opt_num_rates != opt_num_xsks) {
+		fprintf(stderr, "ERROR: --rate lists %d rates for %d channels\n",
+			opt_num_rates, opt_num_xsks);
+		usage(basename(argv[0]));
+	}
+
+	if (opt_bench == BENCH_L3FWD && (!opt_routes || !opt_neigh)) {
+		fprintf(stderr, "ERROR: --l3fwd needs --routes and --neigh\n");
+		usage(basename(argv[0]));
+	}
+
+	/* Latency probes carry a pktgen header. */
+	if (opt_bench == BENCH_LATENCY)
+		opt_tstamp = true;
+
+	/* --rfc2544 counts loss and delay with the pktgen receive check. */
+	if (opt_bench == BENCH_RFC2544) {
+		opt_tstamp = true;
+		opt_rxcheck = true;
+		if (opt_flow_count > RXCHECK_STREAMS) {
+			fprintf(stderr, "ERROR: --rfc2544 tracks at most %d --flows\n",
+				RXCHECK_STREAMS);
+			usage(basename(argv[0]));
+		}
+	}
+
+	/* Autotuning starts from -b, clamped into its bounds. */
+	if (opt_batch_auto) {
+		if (opt_batch_size < opt_batch_min)
+			opt_batch_size = opt_batch_min;
+		if (opt_batch_size > opt_batch_max)
+			opt_batch_size = opt_batch_max;
+	}
+}
+
+static void kick_tx(struct xsk_socket_info *xsk)
+{
+	int ret;
+
+	util_charge(util_cat);
+	ret = sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+	util_charge(UTIL_SYSCALL);
+	if (ret >= 0 || errno == ENOBUFS || errno == EAGAIN ||
+	    errno == EBUSY || errno == ENETDOWN)
+		return;
+	exit_with_error(errno);
+}
+
+/* The recvfrom() that has the driver fill or poll the RX ring. */
+static inline void rx_wakeup(struct xsk_socket_info *xsk)
+{
+	util_charge(util_cat);
+	recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+	util_charge(UTIL_SYSCALL);
+}
+
+/* AIMD batch size controller, called once per ring poll with the number of
+ * descriptors that poll returned. Every BATCH_AUTO_WINDOW polls we look back:
+ * if most polls came back empty the channel is lightly loaded, so halve the
+ * batch in favour of latency; if the polls that did return were (nearly) full
+ * the ring is backing up, so grow the batch additively for amortisation.
+ */
+static inline void batch_tune(struct xsk_socket_info *xsk, u32 used)
+{
+	struct xsk_batch_ctl *ctl = &xsk->batch;
+	u32 size = ctl->size;
+
+	if (!opt_batch_auto)
+		return;
+
+	ctl->used += used;
+	if (!used)
+		ctl->empty_polls++;
+	if (++ctl->polls < BATCH_AUTO_WINDOW)
+		return;
+
+	if (ctl->empty_polls * 2 > ctl->polls)
+		size /= 2;
+	else if (ctl->used * 4 >= (ctl->polls - ctl->empty_polls) * size * 3)
+		size += BATCH_AUTO_INC;
+
+	if (size < opt_batch_min)
+		size = opt_batch_min;
+	if (size > opt_batch_max)
+		size = opt_batch_max;
+
+	if (size != ctl->size) {
+		u32 lo = __atomic_load_n(&ctl->lo, __ATOMIC_RELAXED);
+		u32 hi = __atomic_load_n(&ctl->hi, __ATOMIC_RELAXED);
+
+		__atomic_store_n(&ctl->size, size, __ATOMIC_RELAXED);
+		ctl->adjusts++;
+		while (size < lo && !__atomic_compare_exchange_n(&ctl->lo, &lo, size, false,
+								 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+		while (size > hi && !__atomic_compare_exchange_n(&ctl->hi, &hi, size, false,
+								 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+
+	ctl->polls = 0;
+	ctl->empty_polls = 0;
+	ctl->used = 0;
+}
+
+static inline void complete_tx_l2fwd(struct xsk_socket_info *xsk)
+{
+	u32 idx_cq = 0, idx_fq = 0;
+	unsigned int rcvd;
+	size_t ndescs;
+
+	if (!xsk->outstanding_tx)
+		return;
+
+	/* In copy mode, Tx is driven by a syscall so we need to use e.g. sendto() to
+	 * really send the packets. In zero-copy mode we do not have to do this, since Tx
+	 * is driven by the NAPI loop. So as an optimization, we do not have to call
+	 * sendto() all the time in zero-copy mode for l2fwd.
+	 */
+	if (opt_xdp_bind_flags & XDP_COPY) {
+		xsk->app_stats.copy_tx_sendtos++;
+		kick_tx(xsk);
+	}
+
+	ndescs = (xsk->outstanding_tx > xsk->batch.size) ? xsk->batch.size :
+		xsk->outstanding_tx;
+
+#ifdef MULTI_FCQ
+	struct xsk_ring_prod *fq_ptr = &xsk->fq;
+	struct xsk_ring_cons *cq_ptr = &xsk->cq;
+#else
+	struct xsk_umem_info *umem = xsk->umem;
+	struct xsk_ring_prod *fq_ptr = &umem->fq;
+	struct xsk_ring_cons *cq_ptr = &umem->cq;
+#endif
+
+	/* re-add completed Tx buffers */
+	rcvd = xsk_ring_cons__peek(cq_ptr, ndescs, &idx_cq);
+	if (rcvd > 0) {
+		unsigned int i;
+		int ret;
+
+		ret = xsk_ring_prod__reserve(fq_ptr, rcvd, &idx_fq);
+		while (ret != rcvd) {
+			if (ret < 0)
+				exit_with_error(-ret);
+			util_stall_begin();
+			if (opt_busy_poll || xsk_ring_prod__needs_wakeup(fq_ptr)) {
+				xsk->app_stats.fill_fail_polls++;
+				rx_wakeup(xsk);
+			}
+			ret = xsk_ring_prod__reserve(fq_ptr, rcvd, &idx_fq);
+		}
+		util_stall_end();
+
+		for (i = 0; i < rcvd; i++)
+			*xsk_ring_prod__fill_addr(fq_ptr, idx_fq++) =
+				*xsk_ring_cons__comp_addr(cq_ptr, idx_cq++);
+
+		xsk_ring_prod__submit(fq_ptr, rcvd);
+		xsk_ring_cons__release(cq_ptr, rcvd);
+		xsk->outstanding_tx -= rcvd;
+	}
+}
+
+static inline void complete_tx_only(struct xsk_socket_info *xsk,
+				    int batch_size)
+{
+	unsigned int rcvd;
+	u32 idx;
+
+	if (!xsk->outstanding_tx)
+		return;
+
+	if (!opt_need_wakeup || xsk_ring_prod__needs_wakeup(&xsk->tx)) {
+		xsk->app_stats.tx_wakeup_sendtos++;
+		kick_tx(xsk);
+	}
+
 #ifdef MULTI_FCQ
-			opt_num_xsks = atoi(optarg);
-			if (opt_num_xsks == 0 || opt_num_xsks > MAX_SOCKS)
+	struct xsk_ring_cons *cq_ptr = &xsk->cq;
+#else
+	struct xsk_ring_cons *cq_ptr = &xsk->umem->cq;
+#endif
+
+	rcvd = xsk_ring_cons__peek(cq_ptr, batch_size, &idx);
+	if (rcvd > 0) {
+		xsk_ring_cons__release(cq_ptr, rcvd);
+		xsk->outstanding_tx -= rcvd;
+	}
+}
+
+/* The stream of a 4-tuple in network byte order, added if create is set. */
+static struct rxcheck_stream *rxcheck_stream_get(struct xsk_rxcheck_stats *rc, u32 saddr,
+						   u32 daddr, u16 sport, u16 dport, bool create)
+{
+	u32 hash = saddr ^ daddr ^ ((u32)sport << 16 | dport);
+	struct rxcheck_stream *st;
+	u32 i, n;
+
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+
+	for (n = 0; n < RXCHECK_STREAMS; n++) {
+		i = (hash + n) & (RXCHECK_STREAMS - 1);
+		st = &rc->stream[i];
+
+		if (!st->used) {
+			if (!create)
+				return NULL;
+			st->used = true;
+			st->saddr = saddr;
+			st->daddr = daddr;
+			st->sport = sport;
+			st->dport = dport;
+			return st;
+		}
+		if (st->saddr == saddr && st->daddr == daddr &&
+		    st->sport == sport && st->dport == dport)
+			return st;
+	}
+
+	return NULL;
+}
+
+static void rxcheck_pkt(struct xsk_socket_info *xsk, char *pkt, u32 len,
+			unsigned long now)
+{
+	struct xsk_rxcheck_stats *rc = &xsk->rxcheck;
+	struct ethhdr *eth = (struct ethhdr *)pkt;
+	char *end = pkt + len, *l3 = (char *)(eth + 1);
+	struct pktgen_hdr *pktgen_hdr;
+	struct rxcheck_stream *st;
+	struct udphdr *udph;
+	struct iphdr *iph;
+	unsigned long sent;
+	u16 proto;
+	u32 seq;
+	int d;
+
+	if (l3 > end)
+		goto other;
+
+	proto = eth->h_proto;
+	if (proto == htons(ETH_P_8021Q)) {
+		struct vlan_ethhdr *veth = (struct vlan_ethhdr *)pkt;
+
+		l3 = (char *)(veth + 1);
+		if (l3 > end)
+			goto other;
+		proto = veth->h_vlan_encapsulated_proto;
+	}
+
+	iph = (struct iphdr *)l3;
+	if (proto != htons(ETH_P_IP) || l3 + sizeof(*iph) > end ||
+	    iph->protocol != IPPROTO_UDP)
+		goto other;
+
+	udph = (struct udphdr *)(l3 + iph->ihl * 4);
+	pktgen_hdr = (struct pktgen_hdr *)(udph + 1);
+	if ((char *)(pktgen_hdr + 1) > end ||
+	    pktgen_hdr->pgh_magic != htonl(PKTGEN_MAGIC))
+		goto other;
+
+	rc->pkts++;
+
+	/* txonly only fills in the stamp with --tstamp. */
+	sent = ntohl(pktgen_hdr->tv_sec) * NSEC_PER_SEC +
+	       ntohl(pktgen_hdr->tv_usec) * 1000UL;
+	if (sent && now >= sent)
+		hist_record(&rc->owd, now - sent);
+
+	st = rxcheck_stream_get(rc, iph->saddr, iph->daddr, udph->source, udph->dest, true);
+	if (st == NULL) {
+		rc->untracked++;
+		return;
+	}
+
+	seq = ntohl(pktgen_hdr->seq_num);
+	if (!st->window) {
+		rc->streams++;
+		st->first_seq = seq;
+		st->next_seq = seq + 1;
+		st->window = 1;
+		return;
+	}
+
+	d = (int)(seq - st->next_seq);
+	if (d >= 0) {
+		/* New highest, anything skipped over is lost until it shows up. */
+		rc->lost += d;
+		st->window = (d + 1 >= RXCHECK_WINDOW) ? 0 : st->window << (d + 1);
+		st->window |= 1;
+		st->next_seq = seq + 1;
+		return;
+	}
+
+	/* Arrivals from before the stream started were never counted lost. */
+	d = -d - 1;
+	if (d >= RXCHECK_WINDOW || (int)(seq - st->first_seq) < 0) {
+		rc->late++;
+	} else if (st->window & (1ULL << d)) {
+		rc->dups++;
+	} else {
+		st->window |= 1ULL << d;
+		rc->reordered++;
+		rc->lost--;
+	}
+	return;
+
+other:
+	rc->other++;
+}
+
+/* Close the RX burst in progress once the link has been idle for the gap,
+ * and charge it with the kernel's ring drop deltas since the previous one.
+ */
+static void burst_rx(struct xsk_socket_info *xsk, unsigned int rcvd)
+{
+	struct xsk_burst_stats *b = &xsk->burst;
+	struct xsk_ring_stats *rs = &xsk->ring_stats;
+	unsigned long now = get_nsecs();
+	u64 full, fill_empty;
+
+	if (rcvd) {
+		/* A new burst: drops from before it are not its own */
+		if (!b->cur && !xsk_get_xdp_stats(xsk_socket__fd(xsk->xsk), xsk)) {
+			b->prev_full = rs->rx_full_npkts;
+			b->prev_fill_empty = rs->rx_fill_empty_npkts;
+		}
+		b->cur += rcvd;
+		b->last_rx = now;
+		return;
+	}
+
+	if (!b->cur || now - b->last_rx < opt_burst_detect_us * NSEC_PER_USEC)
+		return;
+
+	if (xsk_get_xdp_stats(xsk_socket__fd(xsk->xsk), xsk))
+		return;
+
+	full = rs->rx_full_npkts - b->prev_full;
+	fill_empty = rs->rx_fill_empty_npkts - b->prev_fill_empty;
+	b->prev_full = rs->rx_full_npkts;
+	b->prev_fill_empty = rs->rx_fill_empty_npkts;
+
+	b->bursts++;
+	b->pkts += b->cur;
+	if (b->cur > b->max)
+		b->max = b->cur;
+	if (full || fill_empty) {
+		b->lossy++;
+		b->rx_full += full;
+		b->fill_empty += fill_empty;
+		if (full > b->max_full)
+			b->max_full = full;
+		if (!b->min_lossy || b->cur < b->min_lossy)
+			b->min_lossy = b->cur;
+	} else if (b->cur > b->max_clean) {
+		b->max_clean = b->cur;
+	}
+	b->cur = 0;
+}
+
+static void rx_drop(struct xsk_socket_info *xsk)
+{
+	unsigned int rcvd, i;
+	u32 idx_rx = 0, idx_fq = 0;
+	unsigned long now = 0;
+	struct timespec ts;
+	u64 start;
+	int ret;
+
+#ifdef MULTI_FCQ
+	/* In a multi-FCQ setup, we take the XSK's dedicated fill queue */
+	struct xsk_ring_prod *fq_ptr = &xsk->fq;
+#else
+	/* Otherwise we take the single umem fill queue */
+	struct xsk_ring_prod *fq_ptr = &xsk->umem->fq;
+#endif
+
+	rcvd = xsk_ring_cons__peek(&xsk->rx, xsk->batch.size, &idx_rx);
+	batch_tune(xsk, rcvd);
+	if (opt_burst_detect_us)
+		burst_rx(xsk, rcvd);
+	if (!rcvd) {
+		util_charge(UTIL_EMPTY);
+		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(fq_ptr)) {
+			xsk->app_stats.rx_empty_polls++;
+			rx_wakeup(xsk);
+		}
+		return;
+	}
+
+	start = batch_time_start();
+	ret = xsk_ring_prod__reserve(fq_ptr, rcvd, &idx_fq);
+	while (ret != rcvd) {
+		if (ret < 0)
+			exit_with_error(-ret);
+		util_stall_begin();
+		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(fq_ptr)) {
+			xsk->app_stats.fill_fail_polls++;
+			rx_wakeup(xsk);
+		}
+		ret = xsk_ring_prod__reserve(fq_ptr, rcvd, &idx_fq);
+	}
+	util_stall_end();
+
+	if (opt_rxcheck)
+		now = get_nsecs();
+	if (xsk->cap)
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (i = 0; i < rcvd; i++) {
+		u64 addr = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr;
+		u32 len = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++)->len;
+		u64 orig = xsk_umem__extract_addr(addr);
+
+		addr = xsk_umem__add_offset_to_addr(addr);
+		char *pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
+
+		hex_dump(pkt, len, addr);
+		if (opt_rxcheck)
+			rxcheck_pkt(xsk, pkt, len, now);
+		if (xsk->cap)
+			capture_pkt(xsk->cap, pkt, len, &ts);
+		*xsk_ring_prod__fill_addr(fq_ptr, idx_fq++) = orig;
+		xsk->ring_stats.rx_bytes += len;
+	}
+
+	xsk_ring_prod__submit(fq_ptr, rcvd);
+	xsk_ring_cons__release(&xsk->rx, rcvd);
+	xsk->ring_stats.rx_npkts += rcvd;
+	batch_time_end(xsk, start);
+}
+
+static void rx_drop_all(void)
+{
+	struct pollfd fds[MAX_SOCKS] = {};
+	int i, ret;
+
+	for (i = 0; i < num_socks; i++) {
+		fds[i].fd = xsk_socket__fd(xsks[i]->xsk);
+		fds[i].events = POLLIN;
+	}
+
+	for (;;) {
+		if (opt_poll) {
+			for (i = 0; i < num_socks; i++)
+				xsks[i]->app_stats.opt_polls++;
+
+			perf_mark();
+			util_mark();
+			ret = poll(fds, num_socks, opt_timeout);
+			perf_poll_end();
+			util_poll_end();
+			if (ret <= 0)
+#ifdef USE_ORIGINAL
+				continue;
+#else
 			{
-				fprintf(stderr, "ERROR: Invalid number of XSK sockets: %d (Min: 1 Max: %d)\n",
-					opt_num_xsks, MAX_SOCKS);
-				usage(basename(argv[0]));
+				if (benchmark_done)
+					break;
+				continue;
+			}
+#endif /* USE_ORIGINAL */
+		}
+
+		perf_mark();
+		util_mark();
+		for (i = 0; i < num_socks; i++) {
+			rx_drop(xsks[i]);
+			perf_charge(xsks[i]);
+			util_turn_end(xsks[i]);
+		}
+
+		if (benchmark_done)
+			break;
+	}
+}
+
+/* The frames tx_only() cycles through, frame_nb wraps at this. */
+static inline u32 tx_frames(const struct xsk_socket_info *xsk)
+{
+	/* --rfc2544 also receives, so it sends from its probe frames */
+	if (opt_bench == BENCH_RFC2544)
+		return probe_tx_frames();
+	return opt_replay ? NUM_FRAMES : xsk->tx_img_frames;
+}
+
+static int tx_only(struct xsk_socket_info *xsk, u32 *frame_nb,
+		   int batch_size, unsigned long tx_ns)
+{
+	bool probe = opt_bench == BENCH_RFC2544;
+	u32 nframes = tx_frames(xsk);
+	u32 idx, tv_sec, tv_usec, frame = *frame_nb;
+	unsigned int i;
+	u64 start;
+
+	/* Completions only tell how far the NIC is behind. The load txonly
+	 * can offer is the room left in the TX ring.
+	 */
+	if (opt_batch_auto) {
+		u32 room = xsk_prod_nb_free(&xsk->tx, xsk->batch.size);
+
+		batch_tune(xsk, room < xsk->batch.size ? room : xsk->batch.size);
+	}
+
+	while (xsk_ring_prod__reserve(&xsk->tx, batch_size, &idx) <
+				      batch_size) {
+		util_stall_begin();
+		complete_tx_only(xsk, batch_size);
+		if (benchmark_done)
+			return 0;
+	}
+	util_stall_end();
+	start = batch_time_start();
+
+	if (opt_tstamp) {
+		tv_sec = (u32)(tx_ns / NSEC_PER_SEC);
+		tv_usec = (u32)((tx_ns % NSEC_PER_SEC) / 1000);
+	}
+
+	for (i = 0; i < batch_size; i++) {
+		struct xdp_desc *tx_desc = xsk_ring_prod__tx_desc(&xsk->tx,
+								  idx + i);
+		u32 len;
+
+		if (opt_replay) {
+			replay_desc(xsk, tx_desc);
+			continue;
+		}
+
+		if (probe) {
+			tx_desc->addr = probe_tx_addr(xsk, frame);
+			tx_desc->len = tx_frame_size[frame] - ETH_FCS_SIZE;
+		} else {
+			*tx_desc = xsk->tx_img[frame];
+		}
+		len = tx_desc->len;
+		if (opt_num_mutators)
+			tx_mutate(xsk_umem__get_data(xsk->umem->buffer, tx_desc->addr), len);
+		xsk->ring_stats.tx_bytes += len;
+		xsk->ring_stats.tx_size_npkts[tx_frame_bucket[frame]]++;
+
+		if (opt_tstamp) {
+			struct pktgen_hdr *pktgen_hdr;
+			u64 addr = tx_desc->addr;
+			char *pkt;
+
+			pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
+			pktgen_hdr = (struct pktgen_hdr *)(pkt + PKTGEN_HDR_OFFSET);
+
+			pktgen_hdr->seq_num = htonl(tx_flows[tx_frame_flow[frame]].seq++);
+			pktgen_hdr->tv_sec = htonl(tv_sec);
+			pktgen_hdr->tv_usec = htonl(tv_usec);
+
+			hex_dump(pkt, len, addr);
+		}
+
+		if (++frame == nframes)
+			frame = 0;
+	}
+
+	xsk_ring_prod__submit(&xsk->tx, batch_size);
+	xsk->ring_stats.tx_npkts += batch_size;
+	xsk->outstanding_tx += batch_size;
+	*frame_nb = frame;
+	complete_tx_only(xsk, batch_size);
+	batch_time_end(xsk, start);
+
+	return batch_size;
+}
+
+static inline int get_batch_size(struct xsk_socket_info *xsk, int pkt_cnt)
+{
+	if (!opt_pkt_count)
+		return xsk->batch.size;
+
+	if (pkt_cnt + xsk->batch.size <= opt_pkt_count)
+		return xsk->batch.size;
+
+	return opt_pkt_count - pkt_cnt;
+}
+
+static void complete_tx_only_all(void)
+{
+	bool pending;
+	int i;
+
+	do {
+		pending = false;
+		for (i = 0; i < num_socks; i++) {
+			if (xsks[i]->outstanding_tx) {
+				complete_tx_only(xsks[i], xsks[i]->batch.size);
+				pending = !!xsks[i]->outstanding_tx;
 			}
-#else
-			opt_num_xsks = MAX_SOCKS;
-#endif
-			break;
-		case 'd':
-			opt_duration = atoi(optarg);
-			opt_duration *= 1000000000;
-			break;
-		case 'b':
-			opt_batch_size = atoi(optarg);
-			break;
-		case 'C':
-			opt_pkt_count = atoi(optarg);
+		}
+		sleep(1);
+	} while (pending && opt_retries-- > 0);
+}
+
+static void rate_init(const struct rate_spec *rates, int num_rates)
+{
+	u32 i, max_frame = 0;
+	u64 now = tsc_now();
+
+	for (i = 0; i < NUM_FRAMES; i++)
+		if (tx_frame_size[i] > max_frame)
+			max_frame = tx_frame_size[i];
+
+	for (i = 0; i < num_socks; i++) {
+		const struct rate_spec *spec = &rates[num_rates > 1 ? i : 0];
+		struct xsk_rate *r = &xsks[i]->rate;
+
+		r->bps = spec->bps;
+		r->per_tick = (spec->bps ? spec->rate / 8 : spec->rate) / tsc_hz;
+		r->burst = (opt_rate_burst ? opt_rate_burst : opt_batch_size) *
+			   (spec->bps ? max_frame : 1);
+		r->tokens = r->burst;
+		r->last = now;
+	}
+}
+
+/* Refill the bucket and take as much of batch as its tokens pay for. */
+static int rate_batch(struct xsk_socket_info *xsk, u32 frame_nb, int batch, u64 now)
+{
+	struct xsk_rate *r = &xsk->rate;
+	double cost = 0, c;
+	int n;
+
+	r->tokens += (now - r->last) * r->per_tick;
+	r->last = now;
+	if (r->tokens > r->burst)
+		r->tokens = r->burst;
+
+	for (n = 0; n < batch; n++) {
+		c = r->bps ? tx_frame_size[(frame_nb + n) % tx_frames(xsk)] : 1;
+		if (cost + c > r->tokens)
 			break;
-		case 's':
-			opt_pkt_size = atoi(optarg);
-			if (opt_pkt_size > (XSK_UMEM__DEFAULT_FRAME_SIZE) ||
-			    opt_pkt_size < MIN_PKT_SIZE) {
-				fprintf(stderr,
-					"ERROR: Invalid frame size %d\n",
-					opt_pkt_size);
-				usage(basename(argv[0]));
+		cost += c;
+	}
+	if (!n)
+		return 0;
+
+	r->tokens -= cost;
+	if (r->prev_depart) {
+		double gap = now - r->prev_depart;
+
+		hist_record(&r->jitter, tsc_to_ns(fabs(gap - r->ideal_gap)));
+	}
+	r->prev_depart = now;
+	r->ideal_gap = cost / r->per_tick;
+	r->pkts += n;
+	r->bytes += r->bps ? cost : 0;
+
+	return n;
+}
+
+/* TSC at which the first socket can afford its next frame. */
+static u64 rate_next_due(const u32 *frame_nb)
+{
+	u64 due = ~0ULL;
+	int i;
+
+	for (i = 0; i < num_socks; i++) {
+		struct xsk_rate *r = &xsks[i]->rate;
+		double need = r->bps ? tx_frame_size[frame_nb[i] % tx_frames(xsks[i])] : 1;
+		u64 t = r->last + (need > r->tokens ? (need - r->tokens) / r->per_tick : 0);
+
+		if (t < due)
+			due = t;
+	}
+
+	return due;
+}
+
+/* Sleep through most of the wait and spin the rest, since a timer wakeup
+ * alone is tens of microseconds late.
+ */
+static void rate_wait(u64 due)
+{
+	u64 now = tsc_now();
+	u64 spin = RATE_SPIN_NS * tsc_hz / NSEC_PER_SEC;
+
+	if (due > now + spin) {
+		u64 ns = tsc_to_ns(due - now - spin);
+		struct timespec ts = { ns / NSEC_PER_SEC, ns % NSEC_PER_SEC };
+
+		nanosleep(&ts, NULL);
+	}
+
+	while (tsc_now() < due && !benchmark_done)
+		cpu_relax();
+}
+
+static u32 burst_draw(void)
+{
+	switch (opt_burst) {
+	case BURST_UNIFORM:
+		return opt_burst_size[0] +
+		       prng_next() % (opt_burst_size[1] - opt_burst_size[0] + 1);
+	case BURST_EXP:
+		/* 1 + exponential, so the mean stays at the requested size.
+		 * Rounded, since truncating would take half a packet off it.
+		 */
+		return 1 + (u32)(-log(1.0 - prng_double()) * (opt_burst_size[0] - 1) + 0.5);
+	default:
+		return opt_burst_size[0];
+	}
+}
+
+/* --burst: each burst is posted back-to-back in batch sized chunks, so the
+ * NIC sends it at line rate, and is followed by --burst-idle of silence. With
+ * --burst-sync all channels get the same burst size and their chunks are
+ * interleaved, so their bursts hit the wire together.
+ */
+static void burst_all(void)
+{
+	u64 idle = (u64)opt_burst_idle_us * tsc_hz / 1000000;
+	u32 frame_nb[MAX_SOCKS] = {}, left[MAX_SOCKS], sent[MAX_SOCKS];
+	u64 next[MAX_SOCKS], now = tsc_now(), due;
+	unsigned long pkt_cnt = 0;
+	bool pending;
+	int i, n;
+
+	for (i = 0; i < num_socks; i++)
+		next[i] = now;
+
+	while (!benchmark_done && (!opt_pkt_count || pkt_cnt < opt_pkt_count)) {
+		unsigned long tx_ns = opt_tstamp ? get_nsecs() : 0;
+
+		now = tsc_now();
+		n = opt_burst_sync ? burst_draw() : 0;
+		for (i = 0; i < num_socks; i++) {
+			struct xsk_burst_stats *b = &xsks[i]->burst;
+
+			left[i] = 0;
+			sent[i] = 0;
+			if (now < next[i])
+				continue;
+
+			left[i] = opt_burst_sync ? n : burst_draw();
+			b->bursts++;
+		}
+
+		do {
+			pending = false;
+			for (i = 0; i < num_socks; i++) {
+				if (!left[i])
+					continue;
+				n = left[i] < xsks[i]->batch.size ? left[i] : xsks[i]->batch.size;
+				/* 0 once benchmark_done is set */
+				n = tx_only(xsks[i], &frame_nb[i], n, tx_ns);
+				pkt_cnt += n;
+				sent[i] += n;
+				left[i] -= n;
+				pending |= left[i] > 0;
 			}
-			break;
-		case 'P':
-			opt_pkt_fill_pattern = strtol(optarg, NULL, 16);
-			break;
-		case 'V':
-			opt_vlan_tag = true;
-			break;
-		case 'J':
-			opt_pkt_vlan_id = atoi(optarg);
-			break;
-		case 'K':
-			opt_pkt_vlan_pri = atoi(optarg);
-			break;
-		case 'G':
-			if (!ether_aton_r(optarg,
-					  (struct ether_addr *)&opt_txdmac)) {
-				fprintf(stderr, "Invalid dmac address:%s\n",
-					optarg);
-				usage(basename(argv[0]));
+		} while (pending && !benchmark_done);
+
+		for (i = 0; i < num_socks; i++) {
+			struct xsk_burst_stats *b = &xsks[i]->burst;
+
+			b->pkts += sent[i];
+			if (sent[i] > b->max)
+				b->max = sent[i];
+		}
+
+		now = tsc_now();
+		due = ~0ULL;
+		for (i = 0; i < num_socks; i++) {
+			if (next[i] <= now)
+				next[i] = now + idle;
+			if (next[i] < due)
+				due = next[i];
+			complete_tx_only(xsks[i], xsks[i]->batch.size);
+		}
+		rate_wait(due);
+	}
+
+	if (opt_pkt_count)
+		complete_tx_only_all();
+}
+
+static void tx_only_all(void)
+{
+	struct pollfd fds[MAX_SOCKS] = {};
+	u32 frame_nb[MAX_SOCKS] = {};
+	unsigned long next_tx_ns = 0;
+	int pkt_cnt = 0;
+	int i, ret;
+
+	if (opt_poll && opt_tx_cycle_ns) {
+		fprintf(stderr,
+			"Error: --poll and --tx-cycles are both set\n");
+		return;
+	}
+
+	for (i = 0; i < num_socks; i++) {
+		fds[0].fd = xsk_socket__fd(xsks[i]->xsk);
+		fds[0].events = POLLOUT;
+	}
+
+	if (opt_tx_cycle_ns) {
+		/* Align Tx time to micro-second boundary */
+		next_tx_ns = (get_nsecs() / NSEC_PER_USEC + 1) *
+			     NSEC_PER_USEC;
+		next_tx_ns += opt_tx_cycle_ns;
+
+		/* Initialize periodic Tx scheduling variance */
+		tx_cycle_diff_min = 1000000000;
+		tx_cycle_diff_max = 0;
+		tx_cycle_diff_ave = 0.0;
+	}
+
+	replay_start_ns = get_nsecs();
+	if (opt_num_rates)
+		rate_init(opt_rates, opt_num_rates);
+
+	while ((opt_pkt_count && pkt_cnt < opt_pkt_count) || !opt_pkt_count) {
+		unsigned long tx_ns = 0;
+		struct timespec next;
+		int tx_cnt = 0;
+		long diff;
+		int err;
+
+		if (opt_poll) {
+			for (i = 0; i < num_socks; i++)
+				xsks[i]->app_stats.opt_polls++;
+			perf_mark();
+			util_mark();
+			ret = poll(fds, num_socks, opt_timeout);
+			perf_poll_end();
+			util_poll_end();
+			if (ret <= 0)
+#ifdef USE_ORIGINAL
+				continue;
+#else
+			{
+				if (benchmark_done)
+					break;
+				continue;
 			}
-			break;
-		case 'H':
-			if (!ether_aton_r(optarg,
-					  (struct ether_addr *)&opt_txsmac)) {
-				fprintf(stderr, "Invalid smac address:%s\n",
-					optarg);
-				usage(basename(argv[0]));
+#endif
+
+			if (!(fds[0].revents & POLLOUT))
+				continue;
+		}
+
+		if (opt_tx_cycle_ns) {
+			next.tv_sec = next_tx_ns / NSEC_PER_SEC;
+			next.tv_nsec = next_tx_ns % NSEC_PER_SEC;
+			err = clock_nanosleep(opt_clock, TIMER_ABSTIME, &next, NULL);
+			if (err) {
+				if (err != EINTR)
+					fprintf(stderr,
+						"clock_nanosleep failed. Err:%d errno:%d\n",
+						err, errno);
+				break;
 			}
-			break;
-		case 'T':
-			opt_tx_cycle_ns = atoi(optarg);
-			opt_tx_cycle_ns *= NSEC_PER_USEC;
-			break;
-		case 'y':
-			opt_tstamp = 1;
-			break;
-		case 'W':
-			if (get_schpolicy(&opt_schpolicy, optarg)) {
-				fprintf(stderr,
-					"ERROR: Invalid policy %s. Default to SCHED_OTHER.\n",
-					optarg);
-				opt_schpolicy = SCHED_OTHER;
+
+			/* Measure periodic Tx scheduling variance */
+			tx_ns = get_nsecs();
+			diff = tx_ns - next_tx_ns;
+			if (diff < tx_cycle_diff_min)
+				tx_cycle_diff_min = diff;
+
+			if (diff > tx_cycle_diff_max)
+				tx_cycle_diff_max = diff;
+
+			tx_cycle_diff_ave += (double)diff;
+			tx_cycle_cnt++;
+		} else if (opt_tstamp) {
+			tx_ns = get_nsecs();
+		}
+
+		perf_mark();
+		util_mark();
+		for (i = 0; i < num_socks; i++) {
+			int batch_size = get_batch_size(xsks[i], pkt_cnt + tx_cnt);
+
+			if (opt_replay) {
+				batch_size = replay_batch(xsks[i], batch_size,
+							  opt_replay_speed ? get_nsecs() : 0);
+				if (!batch_size) {
+					complete_tx_only(xsks[i], xsks[i]->batch.size);
+					perf_charge(xsks[i]);
+					util_turn_end(xsks[i]);
+					continue;
+				}
 			}
-			break;
-		case 'U':
-			opt_schprio = atoi(optarg);
-			break;
-		case 'x':
-			opt_extra_stats = 1;
-			break;
-		case 'Q':
-			opt_quiet = 1;
-			break;
-		case 'a':
-			opt_app_stats = 1;
-			break;
-		case 'I':
-			opt_irq_str = optarg;
-			if (get_interrupt_number())
-				irqs_at_init = get_irqs();
-			if (irqs_at_init < 0) {
-				fprintf(stderr, "ERROR: Failed to get irqs for %s\n", opt_irq_str);
-				usage(basename(argv[0]));
+
+			if (opt_num_rates) {
+				batch_size = rate_batch(xsks[i], frame_nb[i], batch_size,
+							tsc_now());
+				if (!batch_size) {
+					complete_tx_only(xsks[i], xsks[i]->batch.size);
+					perf_charge(xsks[i]);
+					util_turn_end(xsks[i]);
+					continue;
+				}
 			}
+
+			tx_cnt += tx_only(xsks[i], &frame_nb[i], batch_size, tx_ns);
+			perf_charge(xsks[i]);
+			util_turn_end(xsks[i]);
+		}
+
+		pkt_cnt += tx_cnt;
+
+		if (opt_num_rates && !tx_cnt)
+			rate_wait(rate_next_due(frame_nb));
+
+		/* Nothing due yet in capture time, sleep until something is. */
+		if (opt_replay && opt_replay_speed && !tx_cnt) {
+			unsigned long due = replay_next_due_ns();
+
+			next.tv_sec = due / NSEC_PER_SEC;
+			next.tv_nsec = due % NSEC_PER_SEC;
+			clock_nanosleep(opt_clock, TIMER_ABSTIME, &next, NULL);
+		}
+
+		if (benchmark_done)
 			break;
-		case 'B':
-			opt_busy_poll = 1;
-			break;
-		case 'R':
-			opt_reduced_cap = true;
-			break;
-		default:
-			usage(basename(argv[0]));
+
+		if (opt_tx_cycle_ns)
+			next_tx_ns += opt_tx_cycle_ns;
+	}
+
+	if (opt_pkt_count)
+		complete_tx_only_all();
+}
+
+static void l2fwd(struct xsk_socket_info *xsk)
+{
+	unsigned int rcvd, i;
+	u32 idx_rx = 0, idx_tx = 0;
+	u64 start;
+	int ret;
+
+	complete_tx_l2fwd(xsk);
+
+	rcvd = xsk_ring_cons__peek(&xsk->rx, xsk->batch.size, &idx_rx);
+	batch_tune(xsk, rcvd);
+	if (!rcvd) {
+#ifdef MULTI_FCQ
+		struct xsk_ring_prod *fq_ptr = &xsk->fq;
+#else
+		struct xsk_ring_prod *fq_ptr = &xsk->umem->fq;
+#endif
+		util_charge(UTIL_EMPTY);
+		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(fq_ptr)) {
+			xsk->app_stats.rx_empty_polls++;
+			rx_wakeup(xsk);
 		}
+		return;
 	}
+	start = batch_time_start();
+	xsk->ring_stats.rx_npkts += rcvd;
 
-	if (!(opt_xdp_flags & XDP_FLAGS_SKB_MODE))
-		opt_xdp_flags |= XDP_FLAGS_DRV_MODE;
+	ret = xsk_ring_prod__reserve(&xsk->tx, rcvd, &idx_tx);
+	while (ret != rcvd) {
+		if (ret < 0)
+			exit_with_error(-ret);
+		util_stall_begin();
+		complete_tx_l2fwd(xsk);
+		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(&xsk->tx)) {
+			xsk->app_stats.tx_wakeup_sendtos++;
+			kick_tx(xsk);
+		}
+		ret = xsk_ring_prod__reserve(&xsk->tx, rcvd, &idx_tx);
+	}
+	util_stall_end();
 
-	opt_ifindex = if_nametoindex(opt_if);
-	if (!opt_ifindex) {
-		fprintf(stderr, "ERROR: interface \"%s\" does not exist\n",
-			opt_if);
-		usage(basename(argv[0]));
+	for (i = 0; i < rcvd; i++) {
+		u64 addr = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr;
+		u32 len = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++)->len;
+		u64 orig = addr;
+
+		addr = xsk_umem__add_offset_to_addr(addr);
+		char *pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
+
+		/* Pull in the next header while this one is rewritten */
+		if (i + 1 < rcvd)
+			__builtin_prefetch(xsk_umem__get_data(xsk->umem->buffer,
+				xsk_umem__add_offset_to_addr(
+					xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr)), 1);
+
+		if (opt_reflect)
+			reflect_pkt(pkt, len);
+		else
+			swap_mac_addresses(pkt);
+
+		hex_dump(pkt, len, addr);
+		xsk_ring_prod__tx_desc(&xsk->tx, idx_tx)->addr = orig;
+		xsk_ring_prod__tx_desc(&xsk->tx, idx_tx++)->len = len;
+		xsk->ring_stats.rx_bytes += len;
+		xsk->ring_stats.tx_bytes += len;
 	}
 
-	if ((opt_xsk_frame_size & (opt_xsk_frame_size - 1)) &&
-	    !opt_unaligned_chunks) {
-		fprintf(stderr, "--frame-size=%d is not a power of two\n",
-			opt_xsk_frame_size);
-		usage(basename(argv[0]));
+	xsk_ring_prod__submit(&xsk->tx, rcvd);
+	xsk_ring_cons__release(&xsk->rx, rcvd);
+
+	xsk->ring_stats.tx_npkts += rcvd;
+	xsk->outstanding_tx += rcvd;
+	batch_time_end(xsk, start);
+}
+
+/* --l3fwd: IPv4 routes live in a DIR-24-8 table (one tbl24 entry per /24,
+ * extended into a 256 entry tbl8 group for longer prefixes), IPv6 routes in a
+ * leaf-pushed multibit trie with an 8 bit stride. Both hold next hop indices
+ * into l3_nh[]. Routes are inserted shortest prefix first, so a longer prefix
+ * simply overwrites the entries it covers.
+ */
+static struct l3_nh {
+	struct in6_addr addr;	/**< IPv4 next hops are stored v4-mapped */
+	struct ether_addr mac;
+	u32 xsk;		/**< Index of the socket we forward on */
+} l3_nh[L3_NH_MAX];
+static u32 l3_num_nh;
+static struct ether_addr l3_smac;
+
+static u16 *l3_tbl24;
+static u16 *l3_tbl8;
+static u32 l3_num_tbl8;
+static u32 *l3_trie;
+static u32 l3_trie_nodes;
+static u32 l3_trie_alloc;
+
+struct l3_route {
+	struct in6_addr prefix;
+	u8 len;
+	bool v6;
+	u16 nh;
+};
+
+static int l3_parse_addr(const char *str, struct in6_addr *addr)
+{
+	struct in_addr v4;
+
+	if (inet_pton(AF_INET6, str, addr) == 1)
+		return AF_INET6;
+	if (inet_pton(AF_INET, str, &v4) != 1)
+		return 0;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->s6_addr[10] = 0xff;
+	addr->s6_addr[11] = 0xff;
+	memcpy(&addr->s6_addr[12], &v4, sizeof(v4));
+	return AF_INET;
+}
+
+static void l3_route4_add(u32 ip, u8 len, u16 nh)
+{
+	u32 i, start, n;
+	u16 *e, *grp;
+
+	if (len <= 24) {
+		n = 1U << (24 - len);
+		start = (ip >> 8) & ~(n - 1);
+		for (i = start; i < start + n; i++)
+			l3_tbl24[i] = nh;
+		return;
 	}
 
-	if (opt_reduced_cap && opt_num_xsks > 1) {
-		fprintf(stderr, "ERROR: -M and -R cannot be used together\n");
-		usage(basename(argv[0]));
+	e = &l3_tbl24[ip >> 8];
+	if (!(*e & L3_TBL8_FLAG)) {
+		if (l3_num_tbl8 == L3_TBL8_GROUPS) {
+			fprintf(stderr, "ERROR: Out of tbl8 groups, too many IPv4 prefixes longer than /24\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < 256; i++)
+			l3_tbl8[l3_num_tbl8 * 256 + i] = *e;
+		*e = L3_TBL8_FLAG | l3_num_tbl8++;
 	}
+
+	grp = &l3_tbl8[(*e & ~L3_TBL8_FLAG) * 256];
+	n = 1U << (32 - len);
+	start = ip & 0xff & ~(n - 1);
+	for (i = start; i < start + n; i++)
+		grp[i] = nh;
 }
 
-static void kick_tx(struct xsk_socket_info *xsk)
+static u32 l3_trie_node_new(u32 fill)
+{
+	u32 i;
+
+	if (l3_trie_nodes == l3_trie_alloc) {
+		l3_trie_alloc = l3_trie_alloc ? l3_trie_alloc * 2 : 1024;
+		l3_trie = realloc(l3_trie, (size_t)l3_trie_alloc * 256 * sizeof(*l3_trie));
+		if (!l3_trie)
+			exit_with_error(errno);
+	}
+
+	for (i = 0; i < 256; i++)
+		l3_trie[l3_trie_nodes * 256 + i] = fill;
+
+	return l3_trie_nodes++;
+}
+
+static void l3_route6_add(const u8 *addr, u8 len, u16 nh)
+{
+	u32 node = 0, d, i, start, n;
+
+	for (d = 0; len > 8 * (d + 1); d++) {
+		u32 e = l3_trie[node * 256 + addr[d]];
+
+		if (!(e & L3_TRIE_CHILD)) {
+			e = L3_TRIE_CHILD | l3_trie_node_new(e);
+			l3_trie[node * 256 + addr[d]] = e;
+		}
+		node = e & ~L3_TRIE_CHILD;
+	}
+
+	n = 1U << (8 * (d + 1) - len);
+	start = addr[d] & ~(n - 1);
+	for (i = start; i < start + n; i++)
+		l3_trie[node * 256 + i] = nh;
+}
+
+static inline u16 l3_lookup4(u32 ip)
+{
+	u16 e = l3_tbl24[ip >> 8];
+
+	if (e & L3_TBL8_FLAG)
+		e = l3_tbl8[(e & ~L3_TBL8_FLAG) * 256 + (ip & 0xff)];
+	return e;
+}
+
+static inline u16 l3_lookup6(const u8 *addr)
+{
+	u32 node = 0, d, e;
+
+	for (d = 0; d < 16; d++) {
+		e = l3_trie[node * 256 + addr[d]];
+		if (!(e & L3_TRIE_CHILD))
+			return e;
+		node = e & ~L3_TRIE_CHILD;
+	}
+
+	return L3_NH_NONE;
+}
+
+static int l3_route_cmp(const void *a, const void *b)
+{
+	return ((const struct l3_route *)a)->len - ((const struct l3_route *)b)->len;
+}
+
+static FILE *l3_open(const char *path)
+{
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		fprintf(stderr, "ERROR: Can't open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return f;
+}
+
+/* Neighbour file lines are "<next hop> <mac> [<xsk index>]", route file lines
+ * "<prefix>/<len> <next hop>". Blank lines and '#' comments are ignored.
+ */
+static void l3fwd_load(void)
+{
+	u32 i, nroutes = 0, alloc = 0, unresolved = 0, v6 = 0;
+	struct l3_route *routes = NULL;
+	char line[256], a[64], b[64];
+	unsigned int xsk;
+	FILE *f;
+
+	if (netdev_attr_read("address", line, sizeof(line)) ||
+	    !ether_aton_r(line, &l3_smac))
+		l3_smac = opt_txsmac;
+
+	f = l3_open(opt_neigh);
+	while (fgets(line, sizeof(line), f)) {
+		struct l3_nh *nh = &l3_nh[l3_num_nh];
+		int n;
+
+		if (line[0] == '#' || (n = sscanf(line, "%63s %63s %u", a, b, &xsk)) < 2)
+			continue;
+		if (n == 2)
+			xsk = 0;
+		if (l3_num_nh == L3_NH_MAX || !l3_parse_addr(a, &nh->addr) ||
+		    !ether_aton_r(b, &nh->mac) || xsk >= opt_num_xsks) {
+			fprintf(stderr, "ERROR: Invalid neighbour entry: %s", line);
+			exit(EXIT_FAILURE);
+		}
+		nh->xsk = xsk;
+		l3_num_nh++;
+	}
+	fclose(f);
+
+	f = l3_open(opt_routes);
+	while (fgets(line, sizeof(line), f)) {
+		struct in6_addr gw;
+		struct l3_route *r;
+		char *slash;
+		int af, max;
+
+		if (line[0] == '#' || sscanf(line, "%63s %63s", a, b) != 2)
+			continue;
+
+		if (nroutes == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			routes = realloc(routes, alloc * sizeof(*routes));
+			if (!routes)
+				exit_with_error(errno);
+		}
+		r = &routes[nroutes];
+
+		slash = strchr(a, '/');
+		if (slash)
+			*slash++ = '\0';
+		af = l3_parse_addr(a, &r->prefix);
+		max = af == AF_INET6 ? 128 : 32;
+		r->len = slash ? atoi(slash) : max;
+		if (!af || r->len > max || l3_parse_addr(b, &gw) != af) {
+			fprintf(stderr, "ERROR: Invalid route: %s", line);
+			exit(EXIT_FAILURE);
+		}
+		r->v6 = af == AF_INET6;
+
+		for (i = 0; i < l3_num_nh; i++)
+			if (!memcmp(&l3_nh[i].addr, &gw, sizeof(gw)))
+				break;
+		if (i == l3_num_nh) {
+			unresolved++;
+			continue;
+		}
+		r->nh = i;
+		v6 += r->v6;
+		nroutes++;
+	}
+	fclose(f);
+
+	l3_tbl24 = malloc((1 << 24) * sizeof(*l3_tbl24));
+	l3_tbl8 = malloc(L3_TBL8_GROUPS * 256 * sizeof(*l3_tbl8));
+	if (!l3_tbl24 || !l3_tbl8)
+		exit_with_error(errno);
+	for (i = 0; i < 1 << 24; i++)
+		l3_tbl24[i] = L3_NH_NONE;
+	l3_trie_node_new(L3_NH_NONE);
+
+	qsort(routes, nroutes, sizeof(*routes), l3_route_cmp);
+	for (i = 0; i < nroutes; i++) {
+		if (routes[i].v6)
+			l3_route6_add(routes[i].prefix.s6_addr, routes[i].len, routes[i].nh);
+		else
+			l3_route4_add(ntohl(*(u32 *)&routes[i].prefix.s6_addr[12]),
+				      routes[i].len, routes[i].nh);
+	}
+	free(routes);
+
+	printf("Loaded %u IPv4 and %u IPv6 routes (%u unresolved) via %u neighbours, %u tbl8 groups, %u trie nodes\n",
+	       nroutes - v6, v6, unresolved, l3_num_nh, l3_num_tbl8, l3_trie_nodes);
+}
+
+/* Return frames to the fill queue of the socket they belong to. */
+static void l3fwd_refill(struct xsk_socket_info *xsk, const u64 *addrs, u32 n)
 {
+#ifdef MULTI_FCQ
+	struct xsk_ring_prod *fq_ptr = &xsk->fq;
+#else
+	struct xsk_ring_prod *fq_ptr = &xsk->umem->fq;
+#endif
+	u32 idx_fq = 0, i;
 	int ret;
 
-	ret = sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
-	if (ret >= 0 || errno == ENOBUFS || errno == EAGAIN ||
-	    errno == EBUSY || errno == ENETDOWN)
-		return;
-	exit_with_error(errno);
+	ret = xsk_ring_prod__reserve(fq_ptr, n, &idx_fq);
+	while (ret != n) {
+		if (ret < 0)
+			exit_with_error(-ret);
+		util_stall_begin();
+		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(fq_ptr)) {
+			xsk->app_stats.fill_fail_polls++;
+			rx_wakeup(xsk);
+		}
+		ret = xsk_ring_prod__reserve(fq_ptr, n, &idx_fq);
+	}
+	util_stall_end();
+
+	for (i = 0; i < n; i++)
+		*xsk_ring_prod__fill_addr(fq_ptr, idx_fq++) = addrs[i];
+	xsk_ring_prod__submit(fq_ptr, n);
 }
 
-static inline void complete_tx_l2fwd(struct xsk_socket_info *xsk)
+/* Like complete_tx_l2fwd(), except that with Multi-FCQ a frame may have been
+ * received on another socket and must go back to that socket's fill queue.
+ */
+static void complete_tx_l3fwd(struct xsk_socket_info *xsk)
 {
-	u32 idx_cq = 0, idx_fq = 0;
-	unsigned int rcvd;
-	size_t ndescs;
+#ifdef MULTI_FCQ
+	struct xsk_ring_cons *cq_ptr = &xsk->cq;
+	u64 addrs[MAX_SOCKS][L3FWD_BATCH];
+	u32 n[MAX_SOCKS] = {};
+	int s;
+#else
+	struct xsk_ring_cons *cq_ptr = &xsk->umem->cq;
+	u64 addrs[L3FWD_BATCH];
+#endif
+	u32 idx_cq = 0, rcvd, i;
 
 	if (!xsk->outstanding_tx)
 		return;
 
-	/* In copy mode, Tx is driven by a syscall so we need to use e.g. sendto() to
-	 * really send the packets. In zero-copy mode we do not have to do this, since Tx
-	 * is driven by the NAPI loop. So as an optimization, we do not have to call
-	 * sendto() all the time in zero-copy mode for l2fwd.
-	 */
 	if (opt_xdp_bind_flags & XDP_COPY) {
 		xsk->app_stats.copy_tx_sendtos++;
 		kick_tx(xsk);
 	}
 
-	ndescs = (xsk->outstanding_tx > opt_batch_size) ? opt_batch_size :
-		xsk->outstanding_tx;
+	rcvd = xsk_ring_cons__peek(cq_ptr, xsk->outstanding_tx > L3FWD_BATCH ?
+				   L3FWD_BATCH : xsk->outstanding_tx, &idx_cq);
+	if (!rcvd)
+		return;
 
+	for (i = 0; i < rcvd; i++) {
+		u64 addr = *xsk_ring_cons__comp_addr(cq_ptr, idx_cq++);
 #ifdef MULTI_FCQ
-	struct xsk_ring_prod *fq_ptr = &xsk->fq;
-	struct xsk_ring_cons *cq_ptr = &xsk->cq;
+		s = xsk_umem__extract_addr(addr) / (NUM_FRAMES * opt_xsk_frame_size);
+		addrs[s][n[s]++] = addr;
 #else
-	struct xsk_umem_info *umem = xsk->umem;
-	struct xsk_ring_prod *fq_ptr = &umem->fq;
-	struct xsk_ring_cons *cq_ptr = &umem->cq;
+		addrs[i] = addr;
 #endif
+	}
+	xsk_ring_cons__release(cq_ptr, rcvd);
+	xsk->outstanding_tx -= rcvd;
 
-	/* re-add completed Tx buffers */
-	rcvd = xsk_ring_cons__peek(cq_ptr, ndescs, &idx_cq);
-	if (rcvd > 0) {
-		unsigned int i;
-		int ret;
+#ifdef MULTI_FCQ
+	for (s = 0; s < num_socks; s++)
+		if (n[s])
+			l3fwd_refill(xsks[s], addrs[s], n[s]);
+#else
+	l3fwd_refill(xsk, addrs, rcvd);
+#endif
+}
 
-		ret = xsk_ring_prod__reserve(fq_ptr, rcvd, &idx_fq);
-		while (ret != rcvd) {
-			if (ret < 0)
-				exit_with_error(-ret);
-			if (opt_busy_poll || xsk_ring_prod__needs_wakeup(fq_ptr)) {
-				xsk->app_stats.fill_fail_polls++;
-				recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL,
-					 NULL);
+static void l3fwd_xmit(struct xsk_socket_info *xsk, const struct xdp_desc *descs, u32 n)
+{
+	u32 idx_tx = 0, i;
+	int ret;
+
+	ret = xsk_ring_prod__reserve(&xsk->tx, n, &idx_tx);
+	while (ret != n) {
+		if (ret < 0)
+			exit_with_error(-ret);
+		complete_tx_l3fwd(xsk);
+		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(&xsk->tx)) {
+			xsk->app_stats.tx_wakeup_sendtos++;
+			kick_tx(xsk);
+		}
+		ret = xsk_ring_prod__reserve(&xsk->tx, n, &idx_tx);
+	}
+
+	for (i = 0; i < n; i++) {
+		*xsk_ring_prod__tx_desc(&xsk->tx, idx_tx++) = descs[i];
+		xsk->ring_stats.tx_bytes += descs[i].len;
+	}
+	xsk_ring_prod__submit(&xsk->tx, n);
+
+	xsk->ring_stats.tx_npkts += n;
+	xsk->outstanding_tx += n;
+}
+
+/* Route one RX batch. The first pass parses every packet and prefetches the
+ * table line its lookup starts from, so the lookups of the second pass find
+ * the batch's entries in cache instead of missing one after the other.
+ */
+static void l3fwd(struct xsk_socket_info *xsk)
+{
+	struct xdp_desc out[MAX_SOCKS][L3FWD_BATCH];
+	u8 *l3[L3FWD_BATCH], proto[L3FWD_BATCH];
+	u64 addrs[L3FWD_BATCH], drop[L3FWD_BATCH];
+	u32 lens[L3FWD_BATCH], nout[MAX_SOCKS] = {};
+	u32 idx_rx = 0, rcvd, i, ndrop = 0;
+	int s;
+
+	complete_tx_l3fwd(xsk);
+
+	rcvd = xsk_ring_cons__peek(&xsk->rx, xsk->batch.size > L3FWD_BATCH ?
+				   L3FWD_BATCH : xsk->batch.size, &idx_rx);
+	batch_tune(xsk, rcvd);
+	if (!rcvd) {
+#ifdef MULTI_FCQ
+		struct xsk_ring_prod *fq_ptr = &xsk->fq;
+#else
+		struct xsk_ring_prod *fq_ptr = &xsk->umem->fq;
+#endif
+		util_charge(UTIL_EMPTY);
+		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(fq_ptr)) {
+			xsk->app_stats.rx_empty_polls++;
+			rx_wakeup(xsk);
+		}
+		return;
+	}
+	xsk->ring_stats.rx_npkts += rcvd;
+
+	for (i = 0; i < rcvd; i++) {
+		const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++);
+		u8 *pkt = xsk_umem__get_data(xsk->umem->buffer,
+					     xsk_umem__add_offset_to_addr(desc->addr));
+		u16 eth_proto = ((struct ethhdr *)pkt)->h_proto;
+		u32 hlen = sizeof(struct ethhdr);
+
+		addrs[i] = desc->addr;
+		lens[i] = desc->len;
+		xsk->ring_stats.rx_bytes += desc->len;
+
+		if (eth_proto == htons(ETH_P_8021Q)) {
+			eth_proto = ((struct vlan_ethhdr *)pkt)->h_vlan_encapsulated_proto;
+			hlen = sizeof(struct vlan_ethhdr);
+		}
+		l3[i] = pkt + hlen;
+		proto[i] = 0;
+
+		if (eth_proto == htons(ETH_P_IP) && desc->len >= hlen + sizeof(struct iphdr)) {
+			proto[i] = 4;
+			__builtin_prefetch(&l3_tbl24[ntohl(((struct iphdr *)l3[i])->daddr) >> 8]);
+		} else if (eth_proto == htons(ETH_P_IPV6) && desc->len >= hlen + 40) {
+			proto[i] = 6;
+			__builtin_prefetch(&l3_trie[l3[i][24]]);
+		}
+	}
+	xsk_ring_cons__release(&xsk->rx, rcvd);
+
+	for (i = 0; i < rcvd; i++) {
+		struct ethhdr *eth = (struct ethhdr *)xsk_umem__get_data(xsk->umem->buffer,
+						xsk_umem__add_offset_to_addr(addrs[i]));
+		struct xdp_desc *desc;
+		u16 nh;
+
+		if (proto[i] == 4) {
+			struct iphdr *iph = (struct iphdr *)l3[i];
+			u16 old;
+
+			nh = l3_lookup4(ntohl(iph->daddr));
+			if (nh != L3_NH_NONE && iph->ttl <= 1) {
+				xsk->l3fwd.ttl_exceeded++;
+				goto drop;
+			}
+			if (nh != L3_NH_NONE) {
+				old = *(u16 *)&iph->ttl;
+				iph->ttl--;
+				iph->check = csum_replace2(iph->check, old, *(u16 *)&iph->ttl);
+			}
+		} else if (proto[i] == 6) {
+			/* hop limit is byte 7, the destination starts at byte 24 */
+			nh = l3_lookup6(&l3[i][24]);
+			if (nh != L3_NH_NONE && l3[i][7] <= 1) {
+				xsk->l3fwd.ttl_exceeded++;
+				goto drop;
+			}
+			if (nh != L3_NH_NONE)
+				l3[i][7]--;
+		} else {
+			xsk->l3fwd.other++;
+			goto drop;
+		}
+
+		if (nh == L3_NH_NONE) {
+			xsk->l3fwd.no_route++;
+			goto drop;
+		}
+
+		memcpy(eth->h_dest, &l3_nh[nh].mac, ETH_ALEN);
+		memcpy(eth->h_source, &l3_smac, ETH_ALEN);
+		hex_dump((char *)eth, lens[i], xsk_umem__add_offset_to_addr(addrs[i]));
+
+		s = l3_nh[nh].xsk;
+		desc = &out[s][nout[s]++];
+		desc->addr = addrs[i];
+		desc->len = lens[i];
+		desc->options = 0;
+		xsk->l3fwd.fwd++;
+		continue;
+drop:
+		drop[ndrop++] = xsk_umem__extract_addr(addrs[i]);
+	}
+
+	for (s = 0; s < num_socks; s++)
+		if (nout[s])
+			l3fwd_xmit(xsks[s], out[s], nout[s]);
+	if (ndrop)
+		l3fwd_refill(xsk, drop, ndrop);
+}
+
+static void l2fwd_all(void)
+{
+	struct pollfd fds[MAX_SOCKS] = {};
+	int i, ret;
+
+	for (;;) {
+		if (opt_poll) {
+			for (i = 0; i < num_socks; i++) {
+				fds[i].fd = xsk_socket__fd(xsks[i]->xsk);
+				fds[i].events = POLLOUT | POLLIN;
+				xsks[i]->app_stats.opt_polls++;
 			}
-			ret = xsk_ring_prod__reserve(fq_ptr, rcvd, &idx_fq);
+			perf_mark();
+			util_mark();
+			ret = poll(fds, num_socks, opt_timeout);
+			perf_poll_end();
+			util_poll_end();
+			if (ret <= 0)
+#ifdef USE_ORIGINAL
+				continue;
+#else
+			{
+				if (benchmark_done)
+					break;
+				continue;
+			}
+#endif /* USE_ORIGINAL */
 		}
 
-		for (i = 0; i < rcvd; i++)
-			*xsk_ring_prod__fill_addr(fq_ptr, idx_fq++) =
-				*xsk_ring_cons__comp_addr(cq_ptr, idx_cq++);
+		perf_mark();
+		util_mark();
+		for (i = 0; i < num_socks; i++) {
+			if (opt_bench == BENCH_L3FWD)
+				l3fwd(xsks[i]);
+			else
+				l2fwd(xsks[i]);
+			perf_charge(xsks[i]);
+			util_turn_end(xsks[i]);
+		}
 
-		xsk_ring_prod__submit(fq_ptr, rcvd);
-		xsk_ring_cons__release(cq_ptr, rcvd);
-		xsk->outstanding_tx -= rcvd;
+		if (benchmark_done)
+			break;
 	}
 }
 
-static inline void complete_tx_only(struct xsk_socket_info *xsk,
-				    int batch_size)
+/* Send time for each probe seq, shared by all sockets since the reply
+ * may come back on whichever channel RSS picks.
+ */
+static struct lat_slot {
+	unsigned long tx_ns;
+	u32 seq;
+	u32 xsk_index;
+} lat_slots[LAT_SLOTS];
+
+/* Give up on the probe in a slot: it timed out, or the slot is needed for a
+ * new one. A reply that still turns up counts as unmatched.
+ */
+static void lat_expire(struct lat_slot *slot)
 {
-	unsigned int rcvd;
-	u32 idx;
+	struct xsk_latency_stats *lat = &xsks[slot->xsk_index]->lat;
 
-	if (!xsk->outstanding_tx)
-		return;
+	if (lat->inflight)
+		lat->inflight--;
+	lat->lost++;
+	slot->tx_ns = 0;
+}
 
-	if (!opt_need_wakeup || xsk_ring_prod__needs_wakeup(&xsk->tx)) {
-		xsk->app_stats.tx_wakeup_sendtos++;
-		kick_tx(xsk);
+/* Walk the slots a few at a time, expiring probes older than LAT_TIMEOUT_NS. */
+static void lat_sweep(unsigned long now)
+{
+	static u32 cursor;
+	int i;
+
+	for (i = 0; i < 64; i++, cursor = (cursor + 1) & (LAT_SLOTS - 1)) {
+		struct lat_slot *slot = &lat_slots[cursor];
+
+		if (slot->tx_ns && now - slot->tx_ns >= LAT_TIMEOUT_NS)
+			lat_expire(slot);
 	}
+}
 
-#ifdef MULTI_FCQ
-	struct xsk_ring_cons *cq_ptr = &xsk->cq;
-#else
-	struct xsk_ring_cons *cq_ptr = &xsk->umem->cq;
-#endif
+static void lat_send(struct xsk_socket_info *xsk, u32 n)
+{
+	struct xsk_latency_stats *lat = &xsk->lat;
+	unsigned long now;
+	u32 idx, i;
 
-	rcvd = xsk_ring_cons__peek(cq_ptr, batch_size, &idx);
-	if (rcvd > 0) {
-		xsk_ring_cons__release(cq_ptr, rcvd);
-		xsk->outstanding_tx -= rcvd;
+	if (n > probe_tx_frames() - xsk->outstanding_tx)
+		n = probe_tx_frames() - xsk->outstanding_tx;
+	if (!n || xsk_ring_prod__reserve(&xsk->tx, n, &idx) != n)
+		return;
+
+	now = get_nsecs();
+	for (i = 0; i < n; i++) {
+		struct xdp_desc *tx_desc = xsk_ring_prod__tx_desc(&xsk->tx, idx + i);
+		u64 addr = probe_tx_addr(xsk, lat->frame_nb);
+		struct pktgen_hdr *pktgen_hdr;
+		struct lat_slot *slot;
+		u32 seq = sequence++;
+		char *pkt;
+
+		pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
+		pktgen_hdr = (struct pktgen_hdr *)(pkt + PKTGEN_HDR_OFFSET);
+		pktgen_hdr->seq_num = htonl(seq);
+		pktgen_hdr->tv_sec = htonl((u32)(now / NSEC_PER_SEC));
+		pktgen_hdr->tv_usec = htonl((u32)((now % NSEC_PER_SEC) / 1000));
+
+		/* The wire stamp is only usec, so RTT uses our own copy. */
+		slot = &lat_slots[seq & (LAT_SLOTS - 1)];
+		if (slot->tx_ns)
+			lat_expire(slot);
+		slot->tx_ns = now;
+		slot->seq = seq;
+		slot->xsk_index = xsk->xsk_index;
+		lat->last_seq = seq;
+
+		tx_desc->addr = addr;
+		tx_desc->len = PKT_SIZE;
+		lat->frame_nb = (lat->frame_nb + 1) % probe_tx_frames();
 	}
+
+	xsk_ring_prod__submit(&xsk->tx, n);
+	xsk->ring_stats.tx_npkts += n;
+	xsk->outstanding_tx += n;
+	lat->probes += n;
+	lat->inflight += n;
 }
 
-static void rx_drop(struct xsk_socket_info *xsk)
+static void lat_recv(struct xsk_socket_info *xsk)
 {
 	unsigned int rcvd, i;
 	u32 idx_rx = 0, idx_fq = 0;
+	unsigned long now;
 	int ret;
 
 #ifdef MULTI_FCQ
-	/* In a multi-FCQ setup, we take the XSK's dedicated fill queue */
 	struct xsk_ring_prod *fq_ptr = &xsk->fq;
 #else
-	/* Otherwise we take the single umem fill queue */
 	struct xsk_ring_prod *fq_ptr = &xsk->umem->fq;
 #endif
 
-	rcvd = xsk_ring_cons__peek(&xsk->rx, opt_batch_size, &idx_rx);
+	rcvd = xsk_ring_cons__peek(&xsk->rx, xsk->batch.size, &idx_rx);
+	batch_tune(xsk, rcvd);
 	if (!rcvd) {
 		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(fq_ptr)) {
 			xsk->app_stats.rx_empty_polls++;
@@ -1629,6 +7172,7 @@ static void rx_drop(struct xsk_socket_info *xsk)
 		}
 		return;
 	}
+	now = get_nsecs();
 
 	ret = xsk_ring_prod__reserve(fq_ptr, rcvd, &idx_fq);
 	while (ret != rcvd) {
@@ -1645,12 +7189,38 @@ static void rx_drop(struct xsk_socket_info *xsk)
 		u64 addr = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr;
 		u32 len = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++)->len;
 		u64 orig = xsk_umem__extract_addr(addr);
+		struct pktgen_hdr *pktgen_hdr;
+		struct lat_slot *slot;
+		u32 seq;
 
 		addr = xsk_umem__add_offset_to_addr(addr);
 		char *pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
 
 		hex_dump(pkt, len, addr);
 		*xsk_ring_prod__fill_addr(fq_ptr, idx_fq++) = orig;
+
+		pktgen_hdr = (struct pktgen_hdr *)(pkt + PKTGEN_HDR_OFFSET);
+		if (len < PKTGEN_HDR_OFFSET + sizeof(*pktgen_hdr) ||
+		    pktgen_hdr->pgh_magic != htonl(PKTGEN_MAGIC)) {
+			xsk->lat.rx_other++;
+			continue;
+		}
+
+		seq = ntohl(pktgen_hdr->seq_num);
+		slot = &lat_slots[seq & (LAT_SLOTS - 1)];
+		if (!slot->tx_ns || slot->seq != seq) {
+			xsk->lat.unmatched++;
+			continue;
+		}
+
+		/* Account the RTT to the socket that sent the probe. */
+		struct xsk_latency_stats *lat = &xsks[slot->xsk_index]->lat;
+
+		hist_record(&lat->rtt, now - slot->tx_ns);
+		lat->replies++;
+		if (lat->inflight)
+			lat->inflight--;
+		slot->tx_ns = 0;
 	}
 
 	xsk_ring_prod__submit(fq_ptr, rcvd);
@@ -1658,14 +7228,55 @@ static void rx_drop(struct xsk_socket_info *xsk)
 	xsk->ring_stats.rx_npkts += rcvd;
 }
 
-static void rx_drop_all(void)
+/* With --latency-rate=0 keep a single probe in flight, sending the next one
+ * as soon as the reply is back (or LAT_TIMEOUT_NS has passed). Otherwise send
+ * whatever is due at the offered rate, a batch at a time.
+ */
+static void lat_tx_due(struct xsk_socket_info *xsk, unsigned long now)
+{
+	struct xsk_latency_stats *lat = &xsk->lat;
+	unsigned long period, due;
+
+	if (!opt_lat_rate) {
+		if (lat->inflight) {
+			struct lat_slot *slot = &lat_slots[lat->last_seq & (LAT_SLOTS - 1)];
+
+			if (now < lat->next_ns)
+				return;
+			if (slot->tx_ns && slot->seq == lat->last_seq)
+				lat_expire(slot);
+		}
+		lat->next_ns = now + LAT_TIMEOUT_NS;
+		lat_send(xsk, 1);
+		return;
+	}
+
+	if (now < lat->next_ns)
+		return;
+
+	period = NSEC_PER_SEC / opt_lat_rate;
+	due = (now - lat->next_ns) / period + 1;
+	if (due > xsk->batch.size)
+		due = xsk->batch.size;
+
+	lat_send(xsk, due);
+	lat->next_ns += due * period;
+
+	/* Don't try to catch up on more than a batch worth of backlog. */
+	if (now > lat->next_ns + xsk->batch.size * period)
+		lat->next_ns = now;
+}
+
+static void latency_all(void)
 {
 	struct pollfd fds[MAX_SOCKS] = {};
+	unsigned long now = get_nsecs();
 	int i, ret;
 
 	for (i = 0; i < num_socks; i++) {
 		fds[i].fd = xsk_socket__fd(xsks[i]->xsk);
 		fds[i].events = POLLIN;
+		xsks[i]->lat.next_ns = now;
 	}
 
 	for (;;) {
@@ -1673,293 +7284,212 @@ static void rx_drop_all(void)
 			for (i = 0; i < num_socks; i++)
 				xsks[i]->app_stats.opt_polls++;
 
-			ret = poll(fds, num_socks, opt_timeout);
-			if (ret <= 0)
-#ifdef USE_ORIGINAL
-				continue;
-#else
-			{
-				if (benchmark_done)
-					break;
-				continue;
-			}
-#endif /* USE_ORIGINAL */
+			/* Don't sleep past the next probe. */
+			ret = poll(fds, num_socks, opt_lat_rate ? 0 : 1);
+			if (ret < 0 && benchmark_done)
+				break;
 		}
 
-		for (i = 0; i < num_socks; i++)
-			rx_drop(xsks[i]);
+		now = get_nsecs();
+		lat_sweep(now);
+		for (i = 0; i < num_socks; i++) {
+			lat_recv(xsks[i]);
+			complete_tx_only(xsks[i], xsks[i]->batch.size);
+			lat_tx_due(xsks[i], now);
+		}
 
 		if (benchmark_done)
 			break;
 	}
 }
 
-static int tx_only(struct xsk_socket_info *xsk, u32 *frame_nb,
-		   int batch_size, unsigned long tx_ns)
-{
-	u32 idx, tv_sec, tv_usec;
-	unsigned int i;
-
-	while (xsk_ring_prod__reserve(&xsk->tx, batch_size, &idx) <
-				      batch_size) {
-		complete_tx_only(xsk, batch_size);
-		if (benchmark_done)
-			return 0;
-	}
-
-	if (opt_tstamp) {
-		tv_sec = (u32)(tx_ns / NSEC_PER_SEC);
-		tv_usec = (u32)((tx_ns % NSEC_PER_SEC) / 1000);
-	}
-
-	for (i = 0; i < batch_size; i++) {
-		struct xdp_desc *tx_desc = xsk_ring_prod__tx_desc(&xsk->tx,
-								  idx + i);
-		tx_desc->addr = (*frame_nb + i) * opt_xsk_frame_size;
-		tx_desc->len = PKT_SIZE;
-
-		if (opt_tstamp) {
-			struct pktgen_hdr *pktgen_hdr;
-			u64 addr = tx_desc->addr;
-			char *pkt;
-
-			pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
-			pktgen_hdr = (struct pktgen_hdr *)(pkt + PKTGEN_HDR_OFFSET);
-
-			pktgen_hdr->seq_num = htonl(sequence++);
-			pktgen_hdr->tv_sec = htonl(tv_sec);
-			pktgen_hdr->tv_usec = htonl(tv_usec);
-
-			hex_dump(pkt, PKT_SIZE, addr);
-		}
-	}
-
-	xsk_ring_prod__submit(&xsk->tx, batch_size);
-	xsk->ring_stats.tx_npkts += batch_size;
-	xsk->outstanding_tx += batch_size;
-	*frame_nb += batch_size;
-	*frame_nb %= NUM_FRAMES;
-	complete_tx_only(xsk, batch_size);
-
-	return batch_size;
-}
-
-static inline int get_batch_size(int pkt_cnt)
-{
-	if (!opt_pkt_count)
-		return opt_batch_size;
-
-	if (pkt_cnt + opt_batch_size <= opt_pkt_count)
-		return opt_batch_size;
-
-	return opt_pkt_count - pkt_cnt;
-}
+struct rfc2544_trial {
+	double tx_pps;
+	unsigned long sent;
+	unsigned long lost;
+	double loss_pct;
+	struct hist owd;
+};
 
-static void complete_tx_only_all(void)
+/* Frames the pktgen receive check has lost so far, over all trials: the
+ * sequence gaps in each stream, plus what was sent of each flow before its
+ * first or after its last arrival (all of it if it never arrived). Flow
+ * sequences start at 0 in tx_flows_distribute().
+ */
+static unsigned long rfc2544_lost(void)
 {
-	bool pending;
+	unsigned long lost = 0;
+	u32 f;
 	int i;
 
-	do {
-		pending = false;
-		for (i = 0; i < num_socks; i++) {
-			if (xsks[i]->outstanding_tx) {
-				complete_tx_only(xsks[i], opt_batch_size);
-				pending = !!xsks[i]->outstanding_tx;
-			}
-		}
-		sleep(1);
-	} while (pending && opt_retries-- > 0);
-}
-
-static void tx_only_all(void)
-{
-	struct pollfd fds[MAX_SOCKS] = {};
-	u32 frame_nb[MAX_SOCKS] = {};
-	unsigned long next_tx_ns = 0;
-	int pkt_cnt = 0;
-	int i, ret;
-
-	if (opt_poll && opt_tx_cycle_ns) {
-		fprintf(stderr,
-			"Error: --poll and --tx-cycles are both set\n");
-		return;
-	}
-
-	for (i = 0; i < num_socks; i++) {
-		fds[0].fd = xsk_socket__fd(xsks[i]->xsk);
-		fds[0].events = POLLOUT;
-	}
-
-	if (opt_tx_cycle_ns) {
-		/* Align Tx time to micro-second boundary */
-		next_tx_ns = (get_nsecs() / NSEC_PER_USEC + 1) *
-			     NSEC_PER_USEC;
-		next_tx_ns += opt_tx_cycle_ns;
-
-		/* Initialize periodic Tx scheduling variance */
-		tx_cycle_diff_min = 1000000000;
-		tx_cycle_diff_max = 0;
-		tx_cycle_diff_ave = 0.0;
-	}
-
-	while ((opt_pkt_count && pkt_cnt < opt_pkt_count) || !opt_pkt_count) {
-		int batch_size = get_batch_size(pkt_cnt);
-		unsigned long tx_ns = 0;
-		struct timespec next;
-		int tx_cnt = 0;
-		long diff;
-		int err;
+	for (i = 0; i < num_socks; i++)
+		lost += xsks[i]->rxcheck.lost;
 
-		if (opt_poll) {
-			for (i = 0; i < num_socks; i++)
-				xsks[i]->app_stats.opt_polls++;
-			ret = poll(fds, num_socks, opt_timeout);
-			if (ret <= 0)
-#ifdef USE_ORIGINAL
-				continue;
-#else
-			{
-				if (benchmark_done)
-					break;
-				continue;
-			}
-#endif
+	for (f = 0; f < opt_flow_count; f++) {
+		const struct tx_flow *flow = &tx_flows[f];
+		u32 seen = 0;
 
-			if (!(fds[0].revents & POLLOUT))
-				continue;
-		}
+		for (i = 0; i < num_socks; i++) {
+			struct rxcheck_stream *st;
 
-		if (opt_tx_cycle_ns) {
-			next.tv_sec = next_tx_ns / NSEC_PER_SEC;
-			next.tv_nsec = next_tx_ns % NSEC_PER_SEC;
-			err = clock_nanosleep(opt_clock, TIMER_ABSTIME, &next, NULL);
-			if (err) {
-				if (err != EINTR)
-					fprintf(stderr,
-						"clock_nanosleep failed. Err:%d errno:%d\n",
-						err, errno);
+			st = rxcheck_stream_get(&xsks[i]->rxcheck, htonl(flow->saddr),
+						htonl(flow->daddr), htons(flow->sport),
+						htons(flow->dport), false);
+			if (st) {
+				seen = st->next_seq - st->first_seq;
 				break;
 			}
-
-			/* Measure periodic Tx scheduling variance */
-			tx_ns = get_nsecs();
-			diff = tx_ns - next_tx_ns;
-			if (diff < tx_cycle_diff_min)
-				tx_cycle_diff_min = diff;
-
-			if (diff > tx_cycle_diff_max)
-				tx_cycle_diff_max = diff;
-
-			tx_cycle_diff_ave += (double)diff;
-			tx_cycle_cnt++;
-		} else if (opt_tstamp) {
-			tx_ns = get_nsecs();
 		}
+		lost += flow->seq - seen;
+	}
 
-		for (i = 0; i < num_socks; i++)
-			tx_cnt += tx_only(xsks[i], &frame_nb[i], batch_size, tx_ns);
+	return lost;
+}
 
-		pkt_cnt += tx_cnt;
+/* One-way delay histogram summed over the sockets. */
+static void rfc2544_owd(struct hist *h)
+{
+	int i, n;
 
-		if (benchmark_done)
-			break;
+	memset(h, 0, sizeof(*h));
+	for (i = 0; i < num_socks; i++) {
+		const struct hist *owd = &xsks[i]->rxcheck.owd;
 
-		if (opt_tx_cycle_ns)
-			next_tx_ns += opt_tx_cycle_ns;
+		for (n = 0; n < HIST_BUCKETS; n++)
+			h->count[n] += owd->count[n];
+		h->total += owd->total;
 	}
-
-	if (opt_pkt_count)
-		complete_tx_only_all();
 }
 
-static void l2fwd(struct xsk_socket_info *xsk)
+/* Offer pps (0: as fast as possible) on every socket for opt_trial_time, then
+ * only receive for RFC2544_DRAIN_NS and account what came back. The rxcheck
+ * state only ever grows, since the poller reads it: a trial is the difference
+ * it made.
+ */
+static void rfc2544_run(double pps, struct rfc2544_trial *t)
 {
-	unsigned int rcvd, i;
-	u32 idx_rx = 0, idx_tx = 0;
-	int ret;
+	struct rate_spec spec = { .rate = pps / num_socks };
+	unsigned long start, end, now, lost;
+	u32 frame_nb[MAX_SOCKS] = {};
+	struct hist owd;
+	int i, n;
 
-	complete_tx_l2fwd(xsk);
+	memset(t, 0, sizeof(*t));
+	lost = rfc2544_lost();
+	rfc2544_owd(&owd);
 
-	rcvd = xsk_ring_cons__peek(&xsk->rx, opt_batch_size, &idx_rx);
-	if (!rcvd) {
-#ifdef MULTI_FCQ
-		struct xsk_ring_prod *fq_ptr = &xsk->fq;
-#else
-		struct xsk_ring_prod *fq_ptr = &xsk->umem->fq;
-#endif
-		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(fq_ptr)) {
-			xsk->app_stats.rx_empty_polls++;
-			recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+	if (pps)
+		rate_init(&spec, 1);
+
+	start = get_nsecs();
+	end = start + opt_trial_time * NSEC_PER_SEC;
+	for (now = start; now < end && !benchmark_done; now = get_nsecs()) {
+		for (i = 0; i < num_socks; i++) {
+			struct xsk_socket_info *xsk = xsks[i];
+
+			n = get_batch_size(xsk, t->sent);
+			if (n > (int)(probe_tx_frames() - xsk->outstanding_tx))
+				n = probe_tx_frames() - xsk->outstanding_tx;
+			if (n > 0 && pps)
+				n = rate_batch(xsk, frame_nb[i], n, tsc_now());
+			if (n > 0)
+				t->sent += tx_only(xsk, &frame_nb[i], n, now);
+			else
+				complete_tx_only(xsk, xsk->batch.size);
+
+			rx_drop(xsk);
 		}
-		return;
 	}
-	xsk->ring_stats.rx_npkts += rcvd;
+	t->tx_pps = t->sent * (double)NSEC_PER_SEC / (now - start);
 
-	ret = xsk_ring_prod__reserve(&xsk->tx, rcvd, &idx_tx);
-	while (ret != rcvd) {
-		if (ret < 0)
-			exit_with_error(-ret);
-		complete_tx_l2fwd(xsk);
-		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(&xsk->tx)) {
-			xsk->app_stats.tx_wakeup_sendtos++;
-			kick_tx(xsk);
+	for (end = now + RFC2544_DRAIN_NS; get_nsecs() < end && !benchmark_done;)
+		for (i = 0; i < num_socks; i++) {
+			complete_tx_only(xsks[i], xsks[i]->batch.size);
+			rx_drop(xsks[i]);
 		}
-		ret = xsk_ring_prod__reserve(&xsk->tx, rcvd, &idx_tx);
-	}
 
-	for (i = 0; i < rcvd; i++) {
-		u64 addr = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr;
-		u32 len = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++)->len;
-		u64 orig = addr;
+	t->lost = rfc2544_lost() - lost;
+	t->loss_pct = t->sent ? t->lost * 100.0 / t->sent : 0;
 
-		addr = xsk_umem__add_offset_to_addr(addr);
-		char *pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
+	rfc2544_owd(&t->owd);
+	for (n = 0; n < HIST_BUCKETS; n++) {
+		t->owd.count[n] -= owd.count[n];
+		/* The trial's max, to bucket precision */
+		if (t->owd.count[n])
+			t->owd.max = hist_value(n);
+	}
+	t->owd.total -= owd.total;
+}
 
-		swap_mac_addresses(pkt);
+/* Bake every socket's probe frames at one frame size. */
+static void rfc2544_frames(struct xsk_umem_info *umem, u16 size)
+{
+	u32 n;
+	int i;
 
-		hex_dump(pkt, len, addr);
-		xsk_ring_prod__tx_desc(&xsk->tx, idx_tx)->addr = orig;
-		xsk_ring_prod__tx_desc(&xsk->tx, idx_tx++)->len = len;
+	for (n = 0; n < probe_tx_frames(); n++) {
+		tx_frame_size[n] = size;
+		tx_frame_bucket[n] = size_bucket(size);
 	}
 
-	xsk_ring_prod__submit(&xsk->tx, rcvd);
-	xsk_ring_cons__release(&xsk->rx, rcvd);
-
-	xsk->ring_stats.tx_npkts += rcvd;
-	xsk->outstanding_tx += rcvd;
+	for (i = 0; i < num_socks; i++)
+		for (n = 0; n < probe_tx_frames(); n++)
+			gen_eth_hdr(xsk_umem__get_data(umem->buffer, probe_tx_addr(xsks[i], n)),
+				    &tx_flows[tx_frame_flow[n]], size);
 }
 
-static void l2fwd_all(void)
+/* RFC 2544 section 26.1 throughput: per frame size, the highest offered rate
+ * whose loss stays within --loss-tolerance. The first trial runs unpaced to
+ * find the ceiling, then the rate is binary searched below it.
+ */
+static void rfc2544_all(struct xsk_umem_info *umem)
 {
-	struct pollfd fds[MAX_SOCKS] = {};
-	int i, ret;
-
-	for (;;) {
-		if (opt_poll) {
-			for (i = 0; i < num_socks; i++) {
-				fds[i].fd = xsk_socket__fd(xsks[i]->xsk);
-				fds[i].events = POLLOUT | POLLIN;
-				xsks[i]->app_stats.opt_polls++;
-			}
-			ret = poll(fds, num_socks, opt_timeout);
-			if (ret <= 0)
-#ifdef USE_ORIGINAL
-				continue;
-#else
-			{
-				if (benchmark_done)
-					break;
-				continue;
+	static struct rfc2544_trial t, best;
+	int s;
+
+	printf("\nRFC 2544 throughput: %d channel(s), %us trials, loss tolerance %.3f%%\n",
+	       num_socks, opt_trial_time, opt_loss_tolerance);
+	printf("%-8s %-14s %-10s %-10s %-8s %-10s %-10s %-10s\n", "frame", "max pps",
+	       "Mbps", "loss %", "trials", "owd p50", "owd p99", "owd max");
+
+	tx_flows_distribute();
+	for (s = 0; s < opt_rfc2544_num_sizes && !benchmark_done; s++) {
+		u16 size = opt_rfc2544_sizes[s];
+		double lo = 0, hi;
+		int trials = 1;
+
+		if (size < PKTGEN_SIZE_MIN || size > opt_xsk_frame_size) {
+			printf("%-8u skipped, outside %lu..%d\n", size,
+			       PKTGEN_SIZE_MIN, opt_xsk_frame_size);
+			continue;
+		}
+		rfc2544_frames(umem, size);
+
+		rfc2544_run(0, &t);
+		best = t;
+		hi = t.tx_pps;
+		if (t.loss_pct > opt_loss_tolerance) {
+			memset(&best, 0, sizeof(best));
+			while (hi - lo > hi * RFC2544_RESOLUTION &&
+			       trials < RFC2544_MAX_TRIALS && !benchmark_done) {
+				double mid = (lo + hi) / 2;
+
+				rfc2544_run(mid, &t);
+				trials++;
+				if (t.loss_pct <= opt_loss_tolerance) {
+					lo = mid;
+					best = t;
+				} else {
+					hi = mid;
+				}
 			}
-#endif /* USE_ORIGINAL */
 		}
 
-		for (i = 0; i < num_socks; i++)
-			l2fwd(xsks[i]);
-
-		if (benchmark_done)
-			break;
+		printf("%-8u %-14.0f %-10.1f %-10.4f %-8d %-10llu %-10llu %-10llu\n", size,
+		       best.tx_pps, best.tx_pps * size * 8 / 1e6, best.loss_pct, trials,
+		       hist_percentile(&best.owd, 50.0), hist_percentile(&best.owd, 99.0),
+		       best.owd.max);
+		fflush(stdout);
 	}
 }
 
@@ -2035,6 +7565,7 @@ static void enter_xsks_into_map(struct bpf_object *obj)
 
 static void apply_setsockopt(struct xsk_socket_info *xsk)
 {
+	const struct busy_poll_profile *prof = bp_profile_of(xsk->xsk_index);
 	int sock_opt;
 
 	if (!opt_busy_poll)
@@ -2045,15 +7576,143 @@ static void apply_setsockopt(struct xsk_socket_info *xsk)
 		       (void *)&sock_opt, sizeof(sock_opt)) < 0)
 		exit_with_error(errno);
 
-	sock_opt = 20;
+	sock_opt = prof->busy_poll_us;
 	if (setsockopt(xsk_socket__fd(xsk->xsk), SOL_SOCKET, SO_BUSY_POLL,
 		       (void *)&sock_opt, sizeof(sock_opt)) < 0)
 		exit_with_error(errno);
 
-	sock_opt = opt_batch_size;
+	if (prof->budget)
+		sock_opt = prof->budget;
+	else
+		sock_opt = opt_batch_auto ? opt_batch_max : opt_batch_size;
 	if (setsockopt(xsk_socket__fd(xsk->xsk), SOL_SOCKET, SO_BUSY_POLL_BUDGET,
 		       (void *)&sock_opt, sizeof(sock_opt)) < 0)
 		exit_with_error(errno);
+
+	fprintf(stdout, "XSK[%u] busy poll profile %s: busy_poll=%dus budget=%d\n",
+		xsk->xsk_index, prof->name, prof->busy_poll_us, sock_opt);
+}
+
+/* Pin the NAPI kthreads of our interface (named napi/<if>-<napi id>) round
+ * robin over the CPUs from --napi-cpu onwards. The kernel truncates comm to
+ * 15 characters, so long interface names only get a prefix match.
+ */
+static void pin_napi_threads(void)
+{
+	int cpu = opt_napi_cpu, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char prefix[64], comm[64], path[PATH_MAX];
+	struct dirent *ent;
+	size_t prefix_len;
+	DIR *dir;
+
+	snprintf(prefix, sizeof(prefix), "napi/%s-", opt_if);
+	prefix_len = strlen(prefix);
+	if (prefix_len > 15)
+		prefix_len = 15;
+
+	dir = opendir("/proc");
+	if (dir == NULL) {
+		fprintf(stderr, "Failed to open /proc, NAPI threads not pinned\n");
+		return;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		pid_t pid = atoi(ent->d_name);
+		cpu_set_t set;
+		FILE *f;
+
+		if (pid <= 0)
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		if (fgets(comm, sizeof(comm), f) == NULL ||
+		    strncmp(comm, prefix, prefix_len)) {
+			fclose(f);
+			continue;
+		}
+		fclose(f);
+		comm[strcspn(comm, "\n")] = '\0';
+
+		if (napi_num_pins == NAPI_PINS_MAX) {
+			fprintf(stderr, "Too many NAPI threads, %s (pid %d) not pinned\n",
+				comm, pid);
+			continue;
+		}
+		if (sched_getaffinity(pid, sizeof(napi_pins[0].orig),
+				      &napi_pins[napi_num_pins].orig)) {
+			fprintf(stderr, "Failed to get the affinity of %s (pid %d): %s\n",
+				comm, pid, strerror(errno));
+			continue;
+		}
+		napi_pins[napi_num_pins++].pid = pid;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu % ncpus, &set);
+		if (sched_setaffinity(pid, sizeof(set), &set))
+			fprintf(stderr, "Failed to pin %s (pid %d) to CPU %d: %s\n",
+				comm, pid, cpu % ncpus, strerror(errno));
+		else
+			fprintf(stdout, "Pinned %s (pid %d) to CPU %d\n",
+				comm, pid, cpu % ncpus);
+		cpu++;
+	}
+
+	closedir(dir);
+}
+
+/* The NAPI knobs are per device, so with mixed profiles we take the most
+ * aggressive IRQ deferral any socket asked for, and go threaded if any did.
+ */
+static void apply_napi_profile(void)
+{
+	long gro_flush_timeout = -1;
+	int defer_hard_irqs = -1;
+	bool threaded = false;
+	char val[32];
+	int i, ret;
+
+	if (!opt_busy_poll)
+		return;
+
+	/* Also covers the plain exit() calls of later setup failures */
+	atexit(napi_knobs_restore);
+
+	for (i = 0; i < num_socks; i++) {
+		const struct busy_poll_profile *prof = bp_profile_of(i);
+
+		if (prof->defer_hard_irqs > defer_hard_irqs)
+			defer_hard_irqs = prof->defer_hard_irqs;
+		if (prof->gro_flush_timeout > gro_flush_timeout)
+			gro_flush_timeout = prof->gro_flush_timeout;
+		threaded |= prof->threaded;
+	}
+
+	if (defer_hard_irqs >= 0) {
+		snprintf(val, sizeof(val), "%d", defer_hard_irqs);
+		ret = napi_knob_set("napi_defer_hard_irqs", val);
+		if (ret)
+			exit_with_error(-ret);
+	}
+
+	if (gro_flush_timeout >= 0) {
+		snprintf(val, sizeof(val), "%ld", gro_flush_timeout);
+		ret = napi_knob_set("gro_flush_timeout", val);
+		if (ret)
+			exit_with_error(-ret);
+	}
+
+	if (threaded) {
+		ret = napi_knob_set("threaded", "1");
+		if (ret)
+			exit_with_error(-ret);
+		pin_napi_threads();
+	}
+
+	fprintf(stdout, "%s NAPI: napi_defer_hard_irqs=%d gro_flush_timeout=%ld threaded=%d\n",
+		opt_if, defer_hard_irqs, gro_flush_timeout, threaded);
 }
 
 static int recv_xsks_map_fd_from_ctrl_node(int sock, int *_fd)
@@ -2123,6 +7782,435 @@ recv_xsks_map_fd(int *xsks_map_fd)
 	return 0;
 }
 
+/* Parameters of one cell appended to the command line we were started with,
+ * where they override whatever came before. @base_m is the socket count of a
+ * -M given on that command line, or NULL.
+ */
+static void sweep_cell_args(char **cell, const char *base_m, char **args, int *nargs,
+			    char *exe, size_t exe_len)
+{
+	char self[PATH_MAX];
+#ifdef MULTI_FCQ
+	bool multi = true;
+#else
+	bool multi = false;
+#endif
+	ssize_t len;
+
+	len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	self[len > 0 ? len : 0] = '\0';
+	if (cell[SWEEP_FCQ]) {
+		snprintf(exe, exe_len, "%s/xdpsock_%s", dirname(self), cell[SWEEP_FCQ]);
+		multi = !strcmp(cell[SWEEP_FCQ], "multi");
+	} else {
+		snprintf(exe, exe_len, "%s", self);
+	}
+
+	if (cell[SWEEP_CHANNELS] || base_m) {
+		args[(*nargs)++] = "-M";
+		/* Single-FCQ -M takes no count and opens MAX_SOCKS */
+		if (multi)
+			args[(*nargs)++] = cell[SWEEP_CHANNELS] ? cell[SWEEP_CHANNELS] : (char *)base_m;
+	}
+	if (cell[SWEEP_BIND])
+		args[(*nargs)++] = strcmp(cell[SWEEP_BIND], "zc") ? "-c" : "-z";
+	if (cell[SWEEP_MODE] && !strcmp(cell[SWEEP_MODE], "poll"))
+		args[(*nargs)++] = "-p";
+	else if (cell[SWEEP_MODE] && !strcmp(cell[SWEEP_MODE], "busy-poll"))
+		args[(*nargs)++] = "-B";
+	else if (cell[SWEEP_MODE] && !strcmp(cell[SWEEP_MODE], "no-wakeup"))
+		args[(*nargs)++] = "-m";
+	if (cell[SWEEP_BATCH]) {
+		args[(*nargs)++] = "-b";
+		args[(*nargs)++] = cell[SWEEP_BATCH];
+	}
+	if (cell[SWEEP_SIZE]) {
+		args[(*nargs)++] = "-s";
+		args[(*nargs)++] = cell[SWEEP_SIZE];
+	}
+}
+
+struct sweep_result {
+	unsigned long samples;
+	double rx_sum, rx_sq, tx_sum, tx_sq;
+	unsigned long drops[5]; /**< rx_dropped, rx_invalid, tx_invalid, rx_ring_full, fill_ring_empty */
+	int status;
+};
+
+static void sweep_print(char **cell, const struct sweep_result *r, bool header)
+{
+	static const char *const drop_names[5] = {
+		"rx_dropped", "rx_invalid", "tx_invalid", "rx_ring_full", "fill_ring_empty"
+	};
+	double n = r->samples;
+	double rx_mean = n ? r->rx_sum / n : 0, tx_mean = n ? r->tx_sum / n : 0;
+	double rx_sd = n > 1 ? sqrt((r->rx_sq - n * rx_mean * rx_mean) / (n - 1)) : 0;
+	double tx_sd = n > 1 ? sqrt((r->tx_sq - n * tx_mean * tx_mean) / (n - 1)) : 0;
+	int d;
+
+	if (opt_sweep_json) {
+		printf("{");
+		for (d = 0; d < SWEEP_DIMS; d++)
+			printf("\"%s\":\"%s\",", sweep_dim_names[d], cell[d] ? cell[d] : "");
+		printf("\"samples\":%lu,\"rx_pps_mean\":%.0f,\"rx_pps_stddev\":%.0f,"
+		       "\"tx_pps_mean\":%.0f,\"tx_pps_stddev\":%.0f", r->samples,
+		       rx_mean, rx_sd, tx_mean, tx_sd);
+		for (d = 0; d < 5; d++)
+			printf(",\"%s\":%lu", drop_names[d], r->drops[d]);
+		printf(",\"exit_status\":%d}\n", r->status);
+	} else {
+		if (header) {
+			for (d = 0; d < SWEEP_DIMS; d++)
+				printf("%s,", sweep_dim_names[d]);
+			printf("samples,rx_pps_mean,rx_pps_stddev,tx_pps_mean,tx_pps_stddev");
+			for (d = 0; d < 5; d++)
+				printf(",%s", drop_names[d]);
+			printf(",exit_status\n");
+		}
+		for (d = 0; d < SWEEP_DIMS; d++)
+			printf("%s,", cell[d] ? cell[d] : "");
+		printf("%lu,%.0f,%.0f,%.0f,%.0f", r->samples, rx_mean, rx_sd, tx_mean, tx_sd);
+		for (d = 0; d < 5; d++)
+			printf(",%lu", r->drops[d]);
+		printf(",%d\n", r->status);
+	}
+	fflush(stdout);
+}
+
+static void sweep_cell(int argc, char **argv, char **cell, struct sweep_result *r)
+{
+	char exe[PATH_MAX], duration[16], warmup[32], result_fd[32], line[256], base_m[16];
+	char *args[argc + 32];
+	int nargs = 0, i, fds[2], status;
+	bool has_m = false;
+	double rx, tx;
+	pid_t pid;
+	FILE *f;
+
+	memset(r, 0, sizeof(*r));
+
+	/* argv minus the sweep options and -M, whose count depends on the
+	 * child's FCQ build, then the cell
+	 */
+	args[nargs++] = NULL;
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--sweep", 7)) {
+			if (!strchr(argv[i], '='))
+				i++;
+			continue;
+		}
+#ifdef MULTI_FCQ
+		if (!strncmp(argv[i], "-M", 2) || !strncmp(argv[i], "--channels", 10)) {
+			if (!strcmp(argv[i], "-M") || !strcmp(argv[i], "--channels"))
+				i++;
+			has_m = true;
+			continue;
+		}
+#else
+		if (!strcmp(argv[i], "-M") || !strcmp(argv[i], "--shared-umem")) {
+			has_m = true;
+			continue;
+		}
+#endif
+		args[nargs++] = argv[i];
+	}
+	snprintf(base_m, sizeof(base_m), "%d", opt_num_xsks);
+	sweep_cell_args(cell, has_m ? base_m : NULL, args, &nargs, exe, sizeof(exe));
+	args[0] = exe;
+
+	if (pipe(fds))
+		exit_with_error(errno);
+	snprintf(duration, sizeof(duration), "%lu",
+		 opt_warmup + (opt_duration ? opt_duration / NSEC_PER_SEC : 10));
+	snprintf(warmup, sizeof(warmup), "--warmup=%u", opt_warmup);
+	snprintf(result_fd, sizeof(result_fd), "--result-fd=%d", fds[1]);
+	args[nargs++] = "-d";
+	args[nargs++] = duration;
+	args[nargs++] = warmup;
+	args[nargs++] = result_fd;
+	args[nargs] = NULL;
+
+	pid = fork();
+	if (pid < 0)
+		exit_with_error(errno);
+	if (!pid) {
+		int null = open("/dev/null", O_WRONLY);
+
+		close(fds[0]);
+		if (null >= 0)
+			dup2(null, STDOUT_FILENO);
+		execv(exe, args);
+		fprintf(stderr, "ERROR: Can't run %s: %s\n", exe, strerror(errno));
+		_exit(127);
+	}
+
+	close(fds[1]);
+	f = fdopen(fds[0], "r");
+	while (f && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "sample %lf %lf", &rx, &tx) == 2) {
+			r->samples++;
+			r->rx_sum += rx;
+			r->rx_sq += rx * rx;
+			r->tx_sum += tx;
+			r->tx_sq += tx * tx;
+		} else {
+			sscanf(line, "final %lu %lu %lu %lu %lu", &r->drops[0], &r->drops[1],
+			       &r->drops[2], &r->drops[3], &r->drops[4]);
+		}
+	}
+	if (f)
+		fclose(f);
+
+	waitpid(pid, &status, 0);
+	r->status = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+}
+
+static bool sweep_single_fcq(const char *fcq)
+{
+#ifdef MULTI_FCQ
+	return fcq && !strcmp(fcq, "single");
+#else
+	return !fcq || !strcmp(fcq, "single");
+#endif
+}
+
+/* Walk the matrix like an odometer, the last dimension changing fastest. */
+static void sweep_run(int argc, char **argv)
+{
+	char *cell[SWEEP_DIMS];
+	int idx[SWEEP_DIMS] = {};
+	struct sweep_result r;
+	bool first = true;
+	int d;
+
+	signal(SIGINT, int_exit);
+	signal(SIGTERM, int_exit);
+
+	while (!benchmark_done) {
+		for (d = 0; d < SWEEP_DIMS; d++)
+			cell[d] = sweep_nvals[d] ? sweep_vals[d][idx[d]] : NULL;
+
+		/* Single-FCQ -M always opens MAX_SOCKS: one row, not one per count */
+		if (cell[SWEEP_CHANNELS] && sweep_single_fcq(cell[SWEEP_FCQ])) {
+			if (!idx[SWEEP_CHANNELS])
+				cell[SWEEP_CHANNELS] = "MAX_SOCKS";
+			else
+				cell[SWEEP_CHANNELS] = NULL;
+		}
+
+		if (!sweep_nvals[SWEEP_CHANNELS] || cell[SWEEP_CHANNELS]) {
+			sweep_cell(argc, argv, cell, &r);
+			sweep_print(cell, &r, first);
+			first = false;
+		}
+
+		for (d = SWEEP_DIMS - 1; d >= 0; d--) {
+			if (++idx[d] < (sweep_nvals[d] ? sweep_nvals[d] : 1))
+				break;
+			idx[d] = 0;
+		}
+		if (d < 0)
+			break;
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+/* --testbed: a veth pair across two namespaces, with a generator child on
+ * one end and the mode under test on the other.
+ */
+static char testbed_ns[2][32];
+static pid_t testbed_pids[2];
+static int testbed_ready_fd = -1; /**< A child's end of its readiness pipe */
+
+/* Called by main() in a testbed child once its side is set up. */
+static void testbed_ready(void)
+{
+	if (testbed_ready_fd < 0)
+		return;
+	if (write(testbed_ready_fd, "", 1) != 1)
+		fprintf(stderr, "WARNING: testbed readiness not sent: %s\n", strerror(errno));
+	close(testbed_ready_fd);
+	testbed_ready_fd = -1;
+}
+
+/* The parent passes SIGINT/SIGTERM on and tears down once the children exit. */
+static void testbed_signal(int sig)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (testbed_pids[i] > 0)
+			kill(testbed_pids[i], sig);
+}
+
+static void testbed_cleanup(void)
+{
+	char cmd[sizeof("ip netns del  2>/dev/null") + sizeof(testbed_ns)];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (!testbed_ns[i][0])
+			continue;
+		snprintf(cmd, sizeof(cmd), "ip netns del %s 2>/dev/null", testbed_ns[i]);
+		if (system(cmd))
+			fprintf(stderr, "WARNING: '%s' failed\n", cmd);
+	}
+}
+
+static void testbed_cmd(const char *fmt, ...)
+{
+	char cmd[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(cmd, sizeof(cmd), fmt, ap);
+	va_end(ap);
+
+	if (system(cmd)) {
+		fprintf(stderr, "ERROR: testbed setup '%s' failed\n", cmd);
+		testbed_cleanup();
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Continue main() as one side of the testbed, inside its namespace. */
+static void testbed_enter(const char *ns, const char *ifname, enum benchmark_type bench)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "/var/run/netns/%s", ns);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || setns(fd, CLONE_NEWNET)) {
+		fprintf(stderr, "ERROR: Can't enter netns %s: %s\n", ns, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	/* Like "ip netns exec": remount /sys privately so the NAPI knobs
+	 * under /sys/class/net are those of this namespace.
+	 */
+	if (unshare(CLONE_NEWNS) || mount("", "/", NULL, MS_SLAVE | MS_REC, NULL) ||
+	    umount2("/sys", MNT_DETACH) || mount(ns, "/sys", "sysfs", 0, NULL))
+		fprintf(stderr, "WARNING: Can't remount /sys in %s: %s\n", ns, strerror(errno));
+
+	opt_if = strdup(ifname);
+	opt_ifindex = if_nametoindex(opt_if);
+	if (!opt_ifindex) {
+		fprintf(stderr, "ERROR: interface \"%s\" does not exist in %s\n",
+			opt_if, ns);
+		exit(EXIT_FAILURE);
+	}
+	opt_bench = bench;
+
+	/* Once the parent has dropped the netns names, the namespaces only
+	 * live as long as we do. Don't outlive the parent either.
+	 */
+	if (prctl(PR_SET_PDEATHSIG, SIGTERM) || getppid() == 1)
+		exit(EXIT_FAILURE);
+
+	/* veth has no zero-copy support */
+	opt_xdp_bind_flags &= ~XDP_ZEROCOPY;
+	opt_xdp_bind_flags |= XDP_COPY;
+}
+
+/* Returns only in the two children. The side under test is started first and
+ * reports over a pipe when it is ready, then the generator. Once both are in
+ * their namespaces the parent deletes the netns names, so the kernel removes
+ * the namespaces and the veth pair when the children exit, whatever happens
+ * to the parent. It then waits for both and exits.
+ */
+static void testbed_run(void)
+{
+	static const char *const side[2] = { "gen", "dut" };
+	enum benchmark_type bench[2] = { BENCH_TXONLY, opt_testbed_mode };
+	int nq = opt_queue + opt_num_xsks;
+	char ifname[2][IFNAMSIZ], mac[2][18];
+	int i, n, status, ret = EXIT_SUCCESS;
+	int ready[2];
+	pid_t done;
+	char c;
+
+	/* Latency probes are reflected by l2fwd on the far side. */
+	if (opt_testbed_mode == BENCH_LATENCY) {
+		bench[0] = BENCH_LATENCY;
+		bench[1] = BENCH_L2FWD;
+	}
+
+	strcpy(mac[0], ether_ntoa(&opt_txsmac));
+	strcpy(mac[1], ether_ntoa(&opt_txdmac));
+	for (i = 0; i < 2; i++) {
+		snprintf(testbed_ns[i], sizeof(testbed_ns[i]), "xsk-tb%d-%s", getpid(), side[i]);
+		snprintf(ifname[i], IFNAMSIZ, "xtb%d%c", getpid() % 1000000, 'a' + i);
+		testbed_cmd("ip netns add %s", testbed_ns[i]);
+	}
+
+	testbed_cmd("ip link add %s numtxqueues %d numrxqueues %d address %s netns %s type veth "
+		    "peer name %s numtxqueues %d numrxqueues %d address %s netns %s",
+		    ifname[0], nq, nq, mac[0], testbed_ns[0],
+		    ifname[1], nq, nq, mac[1], testbed_ns[1]);
+	for (i = 0; i < 2; i++)
+		testbed_cmd("ip -n %s link set %s up", testbed_ns[i], ifname[i]);
+
+	printf("Testbed: %s (%s) <-> %s (%s), %d queues\n", ifname[0], testbed_ns[0],
+	       ifname[1], testbed_ns[1], nq);
+	fflush(stdout);
+
+	signal(SIGINT, testbed_signal);
+	signal(SIGTERM, testbed_signal);
+
+	/* The side under test comes up first so the generator finds it ready. */
+	for (i = 1; i >= 0; i--) {
+		if (pipe(ready) || (testbed_pids[i] = fork()) < 0) {
+			fprintf(stderr, "ERROR: testbed start failed: %s\n", strerror(errno));
+			testbed_signal(SIGTERM);
+			testbed_cleanup();
+			exit(EXIT_FAILURE);
+		}
+		if (!testbed_pids[i]) {
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			close(ready[0]);
+			testbed_ready_fd = ready[1];
+			testbed_enter(testbed_ns[i], ifname[i], bench[i]);
+			return;
+		}
+
+		close(ready[1]);
+		do {
+			n = read(ready[0], &c, 1);
+		} while (n < 0 && errno == EINTR);
+		close(ready[0]);
+		if (n != 1) {
+			fprintf(stderr, "ERROR: testbed %s side did not come up\n", side[i]);
+			testbed_signal(SIGTERM);
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	/* Both children hold their namespace now, the names aren't needed. */
+	if (ret == EXIT_SUCCESS) {
+		testbed_cleanup();
+		testbed_ns[0][0] = testbed_ns[1][0] = '\0';
+	}
+
+	while ((done = wait(&status)) > 0 || errno == EINTR) {
+		if (done < 0)
+			continue;
+		testbed_pids[done == testbed_pids[0] ? 0 : 1] = 0;
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			ret = EXIT_FAILURE;
+			/* Don't leave the other side running on its own. */
+			testbed_signal(SIGINT);
+		}
+	}
+
+	testbed_cleanup();
+	exit(ret);
+}
+
 int main(int argc, char **argv)
 {
 	struct __user_cap_header_struct hdr = { _LINUX_CAPABILITY_VERSION_3, 0 };
@@ -2137,6 +8225,14 @@ int main(int argc, char **argv)
 	void *bufs;
 
 	parse_command_line(argc, argv);
+	csum_init();
+
+	if (opt_csum_bench)
+		csum_bench();
+	if (opt_sweep)
+		sweep_run(argc, argv);
+	if (opt_testbed)
+		testbed_run();
 
 	if (opt_reduced_cap) {
 		if (capget(&hdr, data)  < 0)
@@ -2175,6 +8271,17 @@ int main(int argc, char **argv)
 #endif
 	);
 
+	tx_flows_init();
+	if (opt_replay)
+		replay_load(opt_replay);
+	if (opt_template)
+		tmpl_load(opt_template);
+	if (opt_bench == BENCH_L3FWD)
+		l3fwd_load();
+	if (opt_num_rates || opt_bench == BENCH_RFC2544 || opt_burst || opt_batch_hist ||
+	    opt_util)
+		tsc_calibrate();
+
 	/* Reserve memory for the umem. Use hugepages if unaligned chunk mode */
 #ifdef MULTI_FCQ
 	bufs = mmap(NULL, (NUM_FRAMES * opt_xsk_frame_size) * opt_num_xsks,
@@ -2196,7 +8303,9 @@ int main(int argc, char **argv)
 #else
 	umem = xsk_configure_umem(bufs, NUM_FRAMES * opt_xsk_frame_size);
 #endif
-	if (opt_bench == BENCH_RXDROP || opt_bench == BENCH_L2FWD) {
+	if (opt_bench == BENCH_RXDROP || opt_bench == BENCH_L2FWD ||
+	    opt_bench == BENCH_LATENCY || opt_bench == BENCH_L3FWD ||
+	    opt_bench == BENCH_RFC2544) {
 		rx = true;
 #ifdef MULTI_FCQ
 		/* In multi-fcq setup we don't fill here, we need XSK's to be setup. */
@@ -2205,7 +8314,9 @@ int main(int argc, char **argv)
 		xsk_populate_fill_ring(umem, NULL);
 #endif
 	}
-	if (opt_bench == BENCH_L2FWD || opt_bench == BENCH_TXONLY)
+	if (opt_bench == BENCH_L2FWD || opt_bench == BENCH_TXONLY ||
+	    opt_bench == BENCH_LATENCY || opt_bench == BENCH_L3FWD ||
+	    opt_bench == BENCH_RFC2544)
 		tx = true;
 	for (i = 0; i < opt_num_xsks; i++)
 		xsks[num_socks++] = xsk_configure_socket(umem, rx, tx, i);
@@ -2218,15 +8329,36 @@ int main(int argc, char **argv)
 
 	for (i = 0; i < opt_num_xsks; i++)
 		apply_setsockopt(xsks[i]);
+	apply_napi_profile();
 
 	if (opt_bench == BENCH_TXONLY) {
-		if (opt_tstamp && opt_pkt_size < PKTGEN_SIZE_MIN)
+		u32 min = PKT_HDR_SIZE + ETH_FCS_SIZE;
+
+		if ((opt_tstamp || opt_encap) && opt_pkt_size < min)
+			opt_pkt_size = min;
+		for (i = 0; i < opt_num_sizes; i++)
+			if ((opt_tstamp || opt_encap) && opt_sizes[i].size < min)
+				opt_sizes[i].size = min;
+		if ((opt_tstamp || opt_encap) && opt_size_range[0] < min)
+			opt_size_range[0] = min;
+		if (opt_size_range[1] < opt_size_range[0])
+			opt_size_range[1] = opt_size_range[0];
+
+		if (opt_replay)
+			replay_setup(umem);
+		else
+			gen_tx_frames(umem);
+	} else if (opt_bench == BENCH_LATENCY) {
+		u32 n;
+
+		if (opt_pkt_size < PKTGEN_SIZE_MIN)
 			opt_pkt_size = PKTGEN_SIZE_MIN;
 
 		gen_eth_hdr_data();
 
-		for (i = 0; i < NUM_FRAMES; i++)
-			gen_eth_frame(umem, i * opt_xsk_frame_size);
+		for (i = 0; i < num_socks; i++)
+			for (n = 0; n < probe_tx_frames(); n++)
+				gen_eth_frame(umem, probe_tx_addr(xsks[i], n));
 	}
 
 #ifdef MULTI_FCQ
@@ -2253,11 +8385,17 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (opt_capture)
+		for (i = 0; i < num_socks; i++)
+			capture_open(xsks[i]);
+
 	signal(SIGINT, int_exit);
 	signal(SIGTERM, int_exit);
 	signal(SIGABRT, int_exit);
 
-	setlocale(LC_ALL, "");
+	/* Thousands grouping for the tables, machine records keep the C locale */
+	if (opt_stats_format == STATS_TEXT)
+		setlocale(LC_ALL, "");
 
 	prev_time = get_nsecs();
 	start_time = prev_time;
@@ -2268,6 +8406,9 @@ int main(int argc, char **argv)
 			exit_with_error(ret);
 	}
 
+	if (opt_metrics)
+		metrics_start();
+
 	/* Configure sched priority for better wake-up accuracy */
 	memset(&schparam, 0, sizeof(schparam));
 	schparam.sched_priority = opt_schprio;
@@ -2278,10 +8419,21 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
+	if (opt_perf_counters)
+		perf_open();
+
+	testbed_ready();
+
 	if (opt_bench == BENCH_RXDROP)
 		rx_drop_all();
+	else if (opt_bench == BENCH_TXONLY && opt_burst)
+		burst_all();
 	else if (opt_bench == BENCH_TXONLY)
 		tx_only_all();
+	else if (opt_bench == BENCH_LATENCY)
+		latency_all();
+	else if (opt_bench == BENCH_RFC2544)
+		rfc2544_all(umem);
 	else
 		l2fwd_all();
 